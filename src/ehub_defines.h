@@ -43,8 +43,23 @@
 //
 #define NO_USE_XHCI_EHUB_SPIN_LOCK
 #define USE_TRB_CACHE_MODE
-#define NO_USE_DELAYED_CACHE_MODE
+#define USE_DELAYED_CACHE_MODE
+/* Needs firmware that applies a register write trailing a cache payload. */
+#define NO_USE_CACHE_WRITE_DOORBELL
+#define USE_EVENT_FAST_PATH
+/* Needs firmware that parses several read responses in one transfer. */
+#define NO_USE_MEMORY_READ_COALESCE
+#define USE_IOVA_TABLE
 #define EHUB_ISOCH_ENABLE
 #define EHUB_ISOCH_DATA_CACHE_ENABLE
+#define USE_OUT_HOST_PUSH
+
+#if defined(USE_DELAYED_CACHE_MODE) && !defined(USE_TRB_CACHE_MODE)
+#error "USE_DELAYED_CACHE_MODE batches the cache writes of USE_TRB_CACHE_MODE"
+#endif
+
+#if defined(USE_OUT_HOST_PUSH) && !defined(EHUB_ISOCH_DATA_CACHE_ENABLE)
+#error "USE_OUT_HOST_PUSH needs the data cache blocks of EHUB_ISOCH_DATA_CACHE_ENABLE"
+#endif
 
 #endif /* EHUB_DEFINES_H */
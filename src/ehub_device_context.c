@@ -24,6 +24,7 @@ PDEVICE_CONTEXT
 DEVICECONTEXT_Create( struct device *dev)
 {
 	PDEVICE_CONTEXT deviceContext;
+	int indexOfRead;
 
 	FUNCTION_ENTRY;
 
@@ -31,11 +32,9 @@ DEVICECONTEXT_Create( struct device *dev)
 	if (!deviceContext)
 		return deviceContext;
 
-	INIT_LIST_HEAD(&deviceContext->doorbell_list_free);
-	INIT_LIST_HEAD(&deviceContext->doorbell_list_busy);
-
 	INIT_LIST_HEAD( &deviceContext->WorkItemPendingQueue );
 	INIT_LIST_HEAD( &deviceContext->WorkItemProcessingQueue );
+	INIT_LIST_HEAD( &deviceContext->WorkItemFreeQueue );
 
 //  deviceContext->WorkItemQueue = create_singlethread_workqueue("ehub_WorkItemQueue");
 	deviceContext->WorkItemQueue = alloc_ordered_workqueue("ehub_WorkItemQueue", WQ_HIGHPRI | WQ_MEM_RECLAIM);
@@ -44,13 +43,52 @@ DEVICECONTEXT_Create( struct device *dev)
 		return NULL;
 	}
 
+	deviceContext->DmaReadQueue = alloc_ordered_workqueue("ehub_DmaReadQueue", WQ_HIGHPRI | WQ_MEM_RECLAIM);
+	if (!deviceContext->DmaReadQueue) {
+		dev_dbg(dev, "ERROR failed to create DmaReadQueue\n");
+		destroy_workqueue(deviceContext->WorkItemQueue);
+		return NULL;
+	}
+
 	spin_lock_init( &deviceContext->SpinLockWorkItemQueue );
+	spin_lock_init( &deviceContext->SpinLockMessageBuffer );
+	spin_lock_init( &deviceContext->SpinLockMessageFast );
+	spin_lock_init( &deviceContext->SpinLockDmaRead );
+	INIT_WORK( &deviceContext->DmaReadWork, MESSAGE_DmaReadProcess );
 	spin_lock_init( &deviceContext->SpinLockEmbeddedDoorbellWrite );
+	spin_lock_init( &deviceContext->SpinLockOutTransport );
 	deviceContext->NumberOfWorkItemInProcessingQueue = 0;
 
-	mutex_init(&deviceContext->MessageHandleEmbeddedMemoryReadCompletionLock);
+	spin_lock_init( &deviceContext->MessageLoopBulk.SpinLock );
+	spin_lock_init( &deviceContext->MessageLoopInterrupt.SpinLock );
+	sema_init( &deviceContext->MessageLoopLock, 1 );
+	INIT_DELAYED_WORK( &deviceContext->MessageLoopTuneWork, MESSAGE_LoopTune );
+
+	if (IOVA_Create( deviceContext ) < 0) {
+		dev_dbg(dev, "ERROR failed to create IOVA table\n");
+		destroy_workqueue(deviceContext->DmaReadQueue);
+		destroy_workqueue(deviceContext->WorkItemQueue);
+		return NULL;
+	}
+
+	if (WORK_ITEM_PoolCreate( deviceContext ) < NUMBER_OF_WORK_ITEM)
+		dev_warn(dev, "WARNING work item pool incomplete\n");
+
+	INIT_LIST_HEAD(&deviceContext->EmbeddedMemoryReadCompletionFree);
+	spin_lock_init(&deviceContext->SpinLockEmbeddedMemoryReadCompletion);
+	init_waitqueue_head(&deviceContext->EmbeddedMemoryReadCompletionWait);
 	sema_init(&deviceContext->EmbeddedRegisterLock, 1);
 
+	sema_init(&deviceContext->EmbeddedRegisterReadSlots, NUMBER_OF_EMBEDDED_REGISTER_READ);
+	spin_lock_init(&deviceContext->SpinLockEmbeddedRegisterRead);
+	INIT_LIST_HEAD(&deviceContext->EmbeddedRegisterReadPending);
+
+	for (indexOfRead = 0; indexOfRead < NUMBER_OF_EMBEDDED_REGISTER_READ; indexOfRead++) {
+		INIT_LIST_HEAD(&deviceContext->EmbeddedRegisterRead[indexOfRead].list);
+		init_completion(&deviceContext->EmbeddedRegisterRead[indexOfRead].Event);
+		deviceContext->EmbeddedRegisterRead[indexOfRead].Tag = indexOfRead;
+	}
+
 	FUNCTION_LEAVE;
 
 	return deviceContext;
@@ -65,11 +103,22 @@ DEVICECONTEXT_Destroy(
 
 	dev_dbg(dev_ctx_to_dev(DeviceContext), "\n");
 
+	cancel_delayed_work_sync( &DeviceContext->MessageLoopTuneWork );
+
 	if (DeviceContext->WorkItemQueue) {
 		destroy_workqueue(DeviceContext->WorkItemQueue);
 		DeviceContext->WorkItemQueue = NULL;
 	}
 
+	if (DeviceContext->DmaReadQueue) {
+		destroy_workqueue(DeviceContext->DmaReadQueue);
+		DeviceContext->DmaReadQueue = NULL;
+	}
+
+	WORK_ITEM_PoolDestroy( DeviceContext );
+
+	IOVA_Destroy( DeviceContext );
+
 	kfree( DeviceContext );
 
 	FUNCTION_LEAVE;
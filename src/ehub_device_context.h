@@ -28,13 +28,31 @@
 #define NUMBER_OF_MESSAGE_BULK      ( 8 )
 #define NUMBER_OF_MESSAGE_INTERRUPT ( 8 )
 #define NUMBER_OF_MESSAGE_ISOCH     ( 6 )
+/* Most URBs an adaptive message loop grows to, see MESSAGE_LoopTune. */
+#define NUMBER_OF_MESSAGE_LOOP_MAX  ( 32 )
+/* How often the message loops are resized. */
+#define EHUB_MESSAGE_LOOP_TUNE_MS   ( 100 )
 
 /* Large values here can delay Urb completions to the device driver.
  * 16 is a potential 2ms delay.  If the device driver is using Isoch
  * Urbs that have a small number of packets and isn't queuing up enough
  * transfers then this can be a problem. */
 #define NUMBER_OF_MESSAGE_ISOCH_PKT ( 16 )
+/* Doorbell URB ring, must be a power of two. */
 #define NUMBER_OF_MESSAGE_DOORBELL  ( 32 )
+/* Doorbell writes packed into one interrupt OUT transfer. */
+#define NUMBER_OF_DOORBELL_COALESCE   ( 16 )
+/* Doorbell transfers outstanding before new rings are staged and merged. */
+#define NUMBER_OF_DOORBELL_IN_FLIGHT  ( 2 )
+/* Every distinct doorbell: 32 targets for each of the MAX_HC_SLOTS doorbell
+ * registers.  Streams are not supported, so merging keeps the staging area
+ * within this and a doorbell never has to wait for room. */
+#define NUMBER_OF_DOORBELL_STAGED     ( 9 * 32 )
+
+/* One outstanding register read per value of the 3-bit RequestId. */
+#define NUMBER_OF_EMBEDDED_REGISTER_READ    ( 8 )
+/* Register write commands packed into one bulk OUT transfer. */
+#define NUMBER_OF_EMBEDDED_REGISTER_WRITE_BATCH ( 32 )
 
 #define MESSAGE_DATA_BUFFER_SIZE_BULK       ( 8 * MAX_PACKET_SIZE_BULK )
 #define MESSAGE_DATA_BUFFER_SIZE_INTERRUPT  ( 3 * MAX_PACKET_SIZE_INTERRUPT )
@@ -47,6 +65,19 @@
 
 #define DATA_INDEX_EMBEDDED_REGISTER_READ                 ( 3 )
 
+/* Memory read response URBs allocated at connect, and the most the pool grows to. */
+#define NUMBER_OF_MEMORY_READ_RESPONSE      ( NUMBER_OF_MESSAGE_BULK )
+#define NUMBER_OF_MEMORY_READ_RESPONSE_MAX  ( 32 )
+/* How often a reader waiting for a response URB rechecks the device. */
+#define EHUB_MEMORY_READ_RESPONSE_WAIT_MS   ( 100 )
+
+/* Memory read requests waiting for the DMA read lane, must be a power of two. */
+#define NUMBER_OF_DMA_READ_REQUEST          ( 64 )
+
+/* Work items preallocated at connect, each with an inline data buffer. */
+#define NUMBER_OF_WORK_ITEM                 ( 32 )
+#define WORK_ITEM_DATA_BUFFER_SIZE          ( max( MESSAGE_DATA_BUFFER_SIZE_BULK, MESSAGE_DATA_BUFFER_SIZE_ISOCH ) )
+
 #define WORK_ITEM_FROM_NOPLACE              ( 0 )
 #define WORK_ITEM_FROM_REGISTER_READ        ( 1 )
 #define WORK_ITEM_FROM_REGISTER_WRITE       ( 2 )
@@ -80,8 +111,23 @@ typedef struct _WORK_ITEM_CONTEXT_
 	u8* DataBuffer;
 	int DataBufferLength;
 	int FromWhere;
+	u8 InlineBuffer[];
 } WORK_ITEM_CONTEXT, *PWORK_ITEM_CONTEXT;
 
+struct _URB_CONTEXT_;
+struct _MESSAGE_LOOP_;
+
+/* One of the two receive buffers of a message IN URB. */
+typedef struct _MESSAGE_BUFFER_
+{
+	struct work_struct WorkItem;
+	struct _URB_CONTEXT_* UrbContext;
+	u8* DataBuffer;
+	dma_addr_t DataBufferDma;
+	int DataOffset;
+	int DataLength;
+} MESSAGE_BUFFER, *PMESSAGE_BUFFER;
+
 typedef struct _URB_CONTEXT_
 {
 	void* DeviceContextPvoid;
@@ -95,8 +141,86 @@ typedef struct _URB_CONTEXT_
 	int ActualLength;
 	int Status;
 	struct list_head list;
+
+	/* Message IN URBs only.  A received message is parsed in place in one
+	 * buffer while the URB is resubmitted with the other; with no spare the
+	 * URB is held and resubmitted once a buffer has been parsed. */
+	MESSAGE_BUFFER MessageBuffer[ 2 ];
+	int MessageBufferInUrb;
+	bool MessageBufferSpareFree;
+	bool MessageBufferHeld;
+
+	/* Bulk and interrupt message URBs belong to an adaptive loop and are
+	 * parked instead of resubmitted while their index is past its depth. */
+	struct _MESSAGE_LOOP_* MessageLoop;
+	int MessageLoopIndex;
+	bool MessageLoopParked;
 } URB_CONTEXT, *PURB_CONTEXT;
 
+/*
+ * The message IN URBs of one pipe.  Depth of them are kept on the wire, each
+ * receiving up to BufferSize; MESSAGE_LoopTune moves the depth within its
+ * bounds from the fill ratio and starvation seen over the last interval.
+ * BufferSize stays the device's transfer unit: the device ends a full one
+ * without a zero length packet, so a longer URB would wait for more data.
+ */
+typedef struct _MESSAGE_LOOP_
+{
+	const char* Name;
+	PURB_CONTEXT UrbContext[ NUMBER_OF_MESSAGE_LOOP_MAX ];
+	unsigned int UsbPipe;
+	spinlock_t SpinLock;
+	bool Running;
+	int Created;
+	int Depth;
+	int DepthMin;
+	int DepthMax;
+	int BufferSize;
+	int InFlight;
+
+	/* This interval, under SpinLock.  Starved counts completions that
+	 * left no URB on the wire. */
+	u32 Completions;
+	u32 FullCompletions;
+	u32 Starved;
+	u64 Bytes;
+
+	/* Fill ratio of the last interval in percent, and running totals. */
+	u32 Utilization;
+	u32 StarvedTotal;
+	u32 Resized;
+} MESSAGE_LOOP, *PMESSAGE_LOOP;
+
+struct _DEVICE_CONTEXT_;
+
+/* Completion of an EMBEDDED_REGISTER_ReadAsync, Status < 0 on failure. */
+typedef void ( *EMBEDDED_REGISTER_READ_CALLBACK )(
+	struct _DEVICE_CONTEXT_* DeviceContext,
+	void* Context,
+	u32 Address,
+	u32 Data,
+	int Status
+	);
+
+/* A read tag goes back to the free pool once none of these hold it. */
+#define EMBEDDED_REGISTER_READ_BUSY_URB        ( 0x01 )  /* read command URB owned by the USB core */
+#define EMBEDDED_REGISTER_READ_BUSY_RESPONSE   ( 0x02 )  /* on EmbeddedRegisterReadPending */
+#define EMBEDDED_REGISTER_READ_BUSY_WAITER     ( 0x04 )  /* synchronous reader not done yet */
+
+typedef struct _EMBEDDED_REGISTER_READ_CONTEXT_
+{
+	struct list_head list;
+	PURB_CONTEXT UrbContext;
+	struct completion Event;
+	EMBEDDED_REGISTER_READ_CALLBACK Callback;
+	void* CallbackContext;
+	u32 Address;
+	u32 Data;
+	u8 Tag;
+	/* EMBEDDED_REGISTER_READ_BUSY_*, under SpinLockEmbeddedRegisterRead. */
+	u8 Busy;
+} EMBEDDED_REGISTER_READ_CONTEXT, *PEMBEDDED_REGISTER_READ_CONTEXT;
+
 typedef struct _MICROFRAME_COUNTER_CONTEXT_
 {
 	u64 PerformanceFrequency;
@@ -126,40 +250,108 @@ typedef struct _DEVICE_CONTEXT_
 	USB_CONTEXT UsbContext;
 
 	/* TODO: EHUB rename generic *Locks as either Mutex or Semaphore they stop changing. */
-	struct mutex MessageHandleEmbeddedMemoryReadCompletionLock;
 	struct semaphore EmbeddedRegisterLock;
 
+	/* Tagged register reads.  The semaphore counts free tags, the pending
+	 * list holds submitted reads in wire order so completions can be routed
+	 * back to their tag. */
+	struct semaphore EmbeddedRegisterReadSlots;
+	spinlock_t SpinLockEmbeddedRegisterRead;
+	unsigned long EmbeddedRegisterReadTagMap;
+	struct list_head EmbeddedRegisterReadPending;
+	EMBEDDED_REGISTER_READ_CONTEXT EmbeddedRegisterRead[ NUMBER_OF_EMBEDDED_REGISTER_READ ];
+
 	spinlock_t SpinLockEmbeddedDoorbellWrite;
 
-	struct list_head doorbell_list_free;
-	struct list_head doorbell_list_busy;
+	/* Pipe policy for cache writes and doorbells, see USB_OutPipeSelect.
+	 * Counts are indexed by EHUB_OUT_TRANSPORT_INTERRUPT / _BULK. */
+	spinlock_t SpinLockOutTransport;
+	int OutTransport;
+	u32 OutInFlight[ 2 ];
+	u32 OutTransfers[ 2 ];
+	u32 OutTransportHeld;
+	bool OutTransportSysfsCreated;
+
+	/* All doorbell URBs, and a ring of the free ones.  Completions publish
+	 * at DoorbellRingHead without the lock, the submitter consumes at
+	 * DoorbellRingTail under SpinLockEmbeddedDoorbellWrite. */
+	PURB_CONTEXT DoorbellUrb[ NUMBER_OF_MESSAGE_DOORBELL ];
+	PURB_CONTEXT DoorbellRing[ NUMBER_OF_MESSAGE_DOORBELL ];
+	atomic_t DoorbellRingHead;
+	atomic_t DoorbellRingTail;
+	atomic_t DoorbellInFlight;
+	u32 DoorbellRingHighWater;
+	u32 DoorbellRingStalls;
+
+	/* Doorbells not yet on the wire, oldest first, one entry per
+	 * (slot, target). */
+	u32 DoorbellStagedAddress[ NUMBER_OF_DOORBELL_STAGED ];
+	u32 DoorbellStagedData[ NUMBER_OF_DOORBELL_STAGED ];
+	int DoorbellStagedCount;
 
 	struct list_head WorkItemPendingQueue;
 	struct list_head WorkItemProcessingQueue;
 
 	struct workqueue_struct *WorkItemQueue;
 	spinlock_t SpinLockWorkItemQueue;
+	spinlock_t SpinLockMessageBuffer;
 	int NumberOfWorkItemInProcessingQueue;
 
+	/* Transfer events and memory writes handled in URB completion context.
+	 * MessageDeferred counts message buffers handed to the WorkItemQueue and
+	 * not yet parsed; while it is non-zero everything goes to the queue to
+	 * keep order. */
+	spinlock_t SpinLockMessageFast;
+	int MessageDeferred;
+
+	/* DMA read lane.  Memory read requests are served in order on their own
+	 * worker so a large read does not hold up the event TRBs behind it.
+	 * Memory writes stay on the WorkItemQueue so they still land before the
+	 * event TRBs that reference them. */
+	struct workqueue_struct *DmaReadQueue;
+	struct work_struct DmaReadWork;
+	spinlock_t SpinLockDmaRead;
+	u32 DmaReadRequest[ NUMBER_OF_DMA_READ_REQUEST ][ 3 ];
+	unsigned int DmaReadHead;
+	unsigned int DmaReadTail;
+	u32 DmaReadHighWater;
+	u32 DmaReadFullWaits;
+
+	/* Work item pool.  When it runs dry, message URBs wait with their data
+	 * on WorkItemPendingQueue, in completion order, for an item to free up. */
+	struct list_head WorkItemFreeQueue;
+	int WorkItemHighWater;
+	u32 WorkItemExhausted;
+	u32 WorkItemOversize;
+
 	int EmbeddedRegisterReadOccupy;
 	int EmbeddedRegisterWriteOccupy;
 	int EmbeddedCacheWriteOccupy;
 
-	struct completion CompletionEventEmbeddedRegisterRead;
-	u32 DataEmbeddedRegisterRead;
-
 	int UrbPendingCount;
 
-	PURB_CONTEXT UrbContextEmbeddedRegisterRead;
 	PURB_CONTEXT UrbContextEmbeddedRegisterWrite;
 
-	/* TODO: Use a safe method to select entry to use instead of just
-	 * grabbing next entry. */
-	PURB_CONTEXT UrbContextEmbeddedMemoryReadCompletion[ NUMBER_OF_MESSAGE_BULK ];
-	int CurrentEmbeddedMemoryReadCompletionUrbContextIndex;
-
-	PURB_CONTEXT UrbContextMessageBulk[ NUMBER_OF_MESSAGE_BULK ];
-	PURB_CONTEXT UrbContextMessageInterrupt[ NUMBER_OF_MESSAGE_BULK ];
+	/* Device addresses of host memory, see ehub_iova.h. */
+	struct _IOVA_TABLE_* IovaTable;
+
+	/* Memory read response URBs.  The array owns every URB allocated so
+	 * far, the free list holds those not on the wire; completions put them
+	 * back and wake anyone waiting. */
+	PURB_CONTEXT UrbContextEmbeddedMemoryReadCompletion[ NUMBER_OF_MEMORY_READ_RESPONSE_MAX ];
+	int NumberOfEmbeddedMemoryReadCompletion;
+	struct list_head EmbeddedMemoryReadCompletionFree;
+	spinlock_t SpinLockEmbeddedMemoryReadCompletion;
+	wait_queue_head_t EmbeddedMemoryReadCompletionWait;
+	u32 EmbeddedMemoryReadCompletionStalls;
+	u32 EmbeddedMemoryReadCompletionCoalesced;
+
+	MESSAGE_LOOP MessageLoopBulk;
+	MESSAGE_LOOP MessageLoopInterrupt;
+	/* Serializes loop start/stop against MessageLoopTuneWork. */
+	struct semaphore MessageLoopLock;
+	struct delayed_work MessageLoopTuneWork;
+	bool MessageLoopSysfsCreated;
 	PURB_CONTEXT UrbContextMessageIsoch[ NUMBER_OF_MESSAGE_ISOCH ];
 
 	ERROR_FLAGS     ErrorFlags;
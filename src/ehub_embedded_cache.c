@@ -20,10 +20,14 @@
 
 #include "ehub_public.h"
 
+/*
+ * Build one cache write record, the header and the qword padded payload,
+ * at Buffer.  Returns the record length, see EMBEDDED_CACHE_RECORD_LENGTH.
+ */
 int
-EMBEDDED_CACHE_Write(
+EMBEDDED_CACHE_FillRecord(
 	PDEVICE_CONTEXT DeviceContext,
-	URB_CONTEXT *UrbContext,
+	u8* Buffer,
 	u32 CacheAddress,
 	u32* DataBuffer,
 	u32 DataBufferLength,
@@ -33,31 +37,12 @@ EMBEDDED_CACHE_Write(
 	PEMBEDDED_CACHE_TRANSFER embeddedCacheTransfer;
 	u32 alignment;
 	u32 dataBufferLengthAligned;
-	u32 transferLength;
-	int status;
 	u8* tempBuffer;
 
-	FUNCTION_ENTRY;
-
-	if (UrbContext->Status != URB_STATUS_FREE && UrbContext->Status != URB_STATUS_COMPLETE)
-		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR UrbContext->Status=%d not expected\n", UrbContext->Status);
-
-	dev_dbg(dev_ctx_to_dev(DeviceContext),
-			 "EMBEDDED_CACHE_Write from %ps CA=0x%08x DP=0x%pk, Len=0x%0X \n",
-				__builtin_return_address ( 0 ),
-			 CacheAddress, DataBuffer, DataBufferLength);
-
-	status = DEVICECONTEXT_ErrorCheck( DeviceContext );
-	if ( status < 0 )
-	{
-		goto Exit;
-	}
-
 	if ( CacheAddress & 0x7 )
 	{
-		status = -EINVAL;
 		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR CacheAddress=0x%X not qword aligned\n", CacheAddress );
-		goto Exit;
+		return -EINVAL;
 	}
 
 	if ( DataBufferLength & 0x7 )
@@ -71,19 +56,15 @@ EMBEDDED_CACHE_Write(
 
 	dataBufferLengthAligned = DataBufferLength + alignment;
 
-	transferLength = sizeof( EMBEDDED_CACHE_TRANSFER );
-	transferLength += dataBufferLengthAligned;
-
-	ASSERT(transferLength <= UrbContext->DataBufferLength);
-	UrbContext->Urb->transfer_buffer_length = transferLength;
-
-	embeddedCacheTransfer = ( PEMBEDDED_CACHE_TRANSFER )UrbContext->DataBuffer;
+	embeddedCacheTransfer = ( PEMBEDDED_CACHE_TRANSFER )Buffer;
 
+	/* Records may land anywhere in a shared buffer, so start clean. */
+	embeddedCacheTransfer->EmbeddedMemoryCommand.Value = 0;
 	embeddedCacheTransfer->Address = CacheAddress;
 	embeddedCacheTransfer->EmbeddedMemoryCommand.Length = dataBufferLengthAligned >> 3;
 	embeddedCacheTransfer->EmbeddedMemoryCommand.Cache = true;
 
-	tempBuffer = ( u8* )( ( u64 )UrbContext->DataBuffer + ( u64 )sizeof( EMBEDDED_CACHE_TRANSFER ) );
+	tempBuffer = Buffer + sizeof( EMBEDDED_CACHE_TRANSFER );
 
 	if (NULL != DataBuffer) {
 		memcpy(tempBuffer, DataBuffer, DataBufferLength);
@@ -97,19 +78,96 @@ EMBEDDED_CACHE_Write(
 
 			trb = (struct xhci_link_trb*)tempBuffer;
 
-			for (index = 0; index < TRBS_PER_SEGMENT; index++) {
+			for (index = 0; index < DataBufferLength / sizeof(struct xhci_link_trb); index++) {
 				trb->control |= TRB_CYCLE;
-				trb += sizeof(struct xhci_link_trb);
+				trb++;
 			}
 		}
 	}
 
+	return sizeof( EMBEDDED_CACHE_TRANSFER ) + dataBufferLengthAligned;
+}
+
+/*
+ * Send the records already built in the data buffer of UrbContext.
+ */
+int
+EMBEDDED_CACHE_Submit(
+	PDEVICE_CONTEXT DeviceContext,
+	URB_CONTEXT *UrbContext,
+	u32 TransferLength
+	)
+{
+	int status;
+
+	ASSERT(TransferLength <= UrbContext->DataBufferLength);
+	UrbContext->Urb->transfer_buffer_length = TransferLength;
+
+	USB_OutPipeSelect( DeviceContext, UrbContext->Urb, TransferLength );
+
 	status = URB_Submit( UrbContext );
 	if ( status < 0 ) {
 		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR URB_Submit fail! %d\n", status);
+		USB_OutPipeDone( DeviceContext, UrbContext->Urb );
+		DeviceContext->ErrorFlags.EmbeddedCacheWriteError = 1;
+	}
+
+	return status;
+}
+
+int
+EMBEDDED_CACHE_Write(
+	PDEVICE_CONTEXT DeviceContext,
+	URB_CONTEXT *UrbContext,
+	u32 CacheAddress,
+	u32* DataBuffer,
+	u32 DataBufferLength,
+	int TrbCycleState,
+	PEMBEDDED_REGISTER_DATA_TRANSFER Doorbell
+	)
+{
+	u32 transferLength;
+	int status;
+
+	FUNCTION_ENTRY;
+
+	if (UrbContext->Status != URB_STATUS_FREE && UrbContext->Status != URB_STATUS_COMPLETE)
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR UrbContext->Status=%d not expected\n", UrbContext->Status);
+
+	dev_dbg(dev_ctx_to_dev(DeviceContext),
+			 "EMBEDDED_CACHE_Write from %ps CA=0x%08x DP=0x%pk, Len=0x%0X \n",
+				__builtin_return_address ( 0 ),
+			 CacheAddress, DataBuffer, DataBufferLength);
+
+	status = DEVICECONTEXT_ErrorCheck( DeviceContext );
+	if ( status < 0 )
+	{
 		goto Exit;
 	}
 
+	ASSERT(EMBEDDED_CACHE_RECORD_LENGTH(DataBufferLength) <= UrbContext->DataBufferLength);
+
+	status = EMBEDDED_CACHE_FillRecord( DeviceContext,
+										( u8* )UrbContext->DataBuffer,
+										CacheAddress,
+										DataBuffer,
+										DataBufferLength,
+										TrbCycleState );
+	if ( status < 0 )
+	{
+		goto Exit;
+	}
+
+	transferLength = status;
+
+	/* A doorbell write rides behind the payload, applied after it. */
+	if (NULL != Doorbell) {
+		memcpy(( u8* )UrbContext->DataBuffer + transferLength, Doorbell, sizeof( EMBEDDED_REGISTER_DATA_TRANSFER ));
+		transferLength += sizeof( EMBEDDED_REGISTER_DATA_TRANSFER );
+	}
+
+	status = EMBEDDED_CACHE_Submit( DeviceContext, UrbContext, transferLength );
+
 Exit:
 
 	if ( status < 0 ) {
@@ -31,9 +31,28 @@
 #define EHUB_CACHE_QUEUE_ENTRIES    ( 32 )
 
 /*
- * Maximum number of cache blocks to use for caching data
+ * Default wait, in microseconds, for a delayed cache write to be joined
+ * by others before its transfer is sent.
+ */
+#define EHUB_CACHE_FLUSH_US         ( 50 )
+
+/*
+ * Maximum number of cache blocks to use for caching data.
+ * The blocks of one URB are always a contiguous run; data past
+ * the run is read by the device from host memory.
  */
 #define EHUB_CACHE_MAX_DATA_BLOCKS  ( 6 )
+/* Cache blocks URB data must leave free for TRB segments. */
+#define EHUB_CACHE_SEGMENT_RESERVE_BLOCKS ( 16 )
+/* Cache blocks only control rings may take, so new devices can enumerate. */
+#define EHUB_CACHE_CONTROL_RESERVE_BLOCKS ( 4 )
+/*
+ * Isoch OUT data quotas: an endpoint may hold EHUB_CACHE_QUOTA_INTERVALS
+ * service intervals of its max ESIT payload, and all quotas together at
+ * most EHUB_CACHE_DATA_QUOTA_BLOCKS.
+ */
+#define EHUB_CACHE_QUOTA_INTERVALS ( 32 )
+#define EHUB_CACHE_DATA_QUOTA_BLOCKS ( 64 )
 
 #define EHUB_CACHE_START_ADDRESS            ( 0x1000 )
 //#define EHUB_CACHE_INITIALIZATION_REGISTER  ( 0x22020FFF )
@@ -91,7 +110,6 @@ typedef union _EMBEDDED_CACHE_TRANSFER_
 
 typedef struct _EHUB_CACHE_BLOCK_
 {
-	struct list_head list;
 	struct urb* urb;
 	u32 IndexOfBlock;
 	u32 Address;
@@ -104,6 +122,27 @@ typedef struct _EHUB_CACHE_TRB_
 	u32 TrbDataField[ 4 ];
 } EHUB_CACHE_TRB, *PEHUB_CACHE_TRB;
 
+/* Bytes one cache write record of Length payload bytes takes on the wire. */
+#define EMBEDDED_CACHE_RECORD_LENGTH( Length ) \
+	( sizeof( EMBEDDED_CACHE_TRANSFER ) + ALIGN( ( Length ), 8 ) )
+
+int
+EMBEDDED_CACHE_FillRecord(
+	PDEVICE_CONTEXT DeviceContext,
+	u8* Buffer,
+	u32 CacheAddress,
+	u32* DataBuffer,
+	u32 DataBufferLength,
+	int TrbCycleState
+	);
+
+int
+EMBEDDED_CACHE_Submit(
+	PDEVICE_CONTEXT DeviceContext,
+	URB_CONTEXT *UrbContext,
+	u32 TransferLength
+	);
+
 int
 EMBEDDED_CACHE_Write(
 	PDEVICE_CONTEXT DeviceContext,
@@ -111,7 +150,8 @@ EMBEDDED_CACHE_Write(
 	u32 CacheAddress,
 	u32* DataBuffer,
 	u32 DataBufferLength,
-	int TrbCycleState
+	int TrbCycleState,
+	PEMBEDDED_REGISTER_DATA_TRANSFER Doorbell
 	);
 
 #endif
@@ -19,40 +19,82 @@
  */
 
 #include <linux/types.h>
+#include <linux/delay.h>
 
 #include "ehub_defines.h"
 #include "xhci.h"
 #include "ehub_embedded_register.h"
 #include "ehub_notification.h"
 #include "ehub_urb.h"
+#include "ehub_usb.h"
 #include "ehub_module.h"
 
-int
-EMBEDDED_REGISTER_Read(
+/*
+ * Grab a free read tag and put the read command on the wire.
+ *
+ * The FL6000 answers register reads in the order they were received on the
+ * bulk OUT pipe, so the tag is queued on EmbeddedRegisterReadPending and the
+ * URB submitted under the same lock to keep the list in wire order.
+ *
+ * When WaitForTag is false and every tag is in flight -EBUSY is returned so
+ * the caller can drain one of its own reads first.  A read with a Callback
+ * is completed and its tag released from the message path.
+ *
+ * The tag stays taken until its URB has completed, its response has come
+ * back (or can no longer come) and a synchronous reader is done with it,
+ * see EMBEDDED_REGISTER_ReadReleaseLocked.
+ */
+static PEMBEDDED_REGISTER_READ_CONTEXT
+EMBEDDED_REGISTER_ReadSubmit(
 	PDEVICE_CONTEXT DeviceContext,
 	u32 Address,
-	u32* Data
+	bool WaitForTag,
+	EMBEDDED_REGISTER_READ_CALLBACK Callback,
+	void* CallbackContext,
+	int* Status
 	)
 {
-	PURB_CONTEXT urbContext;
+	PEMBEDDED_REGISTER_READ_CONTEXT readContext;
 	PEMBEDDED_REGISTER_COMMAND embeddedRegisterCommand;
-	int status;
+	unsigned long flags;
+	int tag;
+
+	if (WaitForTag) {
+		if (down_interruptible(&DeviceContext->EmbeddedRegisterReadSlots)) {
+			*Status = -EINTR;
+			return NULL;
+		}
+	} else if (down_trylock(&DeviceContext->EmbeddedRegisterReadSlots)) {
+		*Status = -EBUSY;
+		return NULL;
+	}
 
-	FUNCTION_ENTRY;
+	spin_lock_irqsave(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
 
-	might_sleep();
-	if (down_interruptible(&DeviceContext->EmbeddedRegisterLock))
-		ASSERT(false);
-
-	urbContext = DeviceContext->UrbContextEmbeddedRegisterRead;
+	tag = find_first_zero_bit(&DeviceContext->EmbeddedRegisterReadTagMap,
+							  NUMBER_OF_EMBEDDED_REGISTER_READ);
+	ASSERT(tag < NUMBER_OF_EMBEDDED_REGISTER_READ);
+	readContext = &DeviceContext->EmbeddedRegisterRead[tag];
 
-	if (!urbContext) {
-		*Data = ~(0);
-		status = -ESHUTDOWN;
-		goto Exit;
+	if (!readContext->UrbContext) {
+		spin_unlock_irqrestore(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
+		up(&DeviceContext->EmbeddedRegisterReadSlots);
+		*Status = -ESHUTDOWN;
+		return NULL;
 	}
 
-	embeddedRegisterCommand = ( PEMBEDDED_REGISTER_COMMAND )urbContext->DataBuffer;
+	set_bit(tag, &DeviceContext->EmbeddedRegisterReadTagMap);
+
+	readContext->Address = Address;
+	readContext->Data = ~(0);
+	readContext->Callback = Callback;
+	readContext->CallbackContext = CallbackContext;
+	readContext->Busy = EMBEDDED_REGISTER_READ_BUSY_URB | EMBEDDED_REGISTER_READ_BUSY_RESPONSE;
+	if (!Callback)
+		readContext->Busy |= EMBEDDED_REGISTER_READ_BUSY_WAITER;
+	NOTIFICATION_Reset(&readContext->Event);
+
+	embeddedRegisterCommand = ( PEMBEDDED_REGISTER_COMMAND )readContext->UrbContext->DataBuffer;
 
 	memset( embeddedRegisterCommand, 0, sizeof( EMBEDDED_REGISTER_COMMAND ) );
 
@@ -62,43 +104,189 @@ EMBEDDED_REGISTER_Read(
 	embeddedRegisterCommand->Read = true;
 	embeddedRegisterCommand->Write = false;
 
-	NOTIFICATION_Reset( &urbContext->Event );
-	NOTIFICATION_Reset( &DeviceContext->CompletionEventEmbeddedRegisterRead );
+	list_add_tail(&readContext->list, &DeviceContext->EmbeddedRegisterReadPending);
 
-	status = URB_Submit( urbContext );
-	if (status < 0)
-	{
-		*Data = ~(0);
-		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR Read addr 0x%X URB_Submit error! %d\n", Address, status );
-		goto Exit;
+	*Status = URB_Submit( readContext->UrbContext );
+	if (*Status < 0) {
+		list_del_init(&readContext->list);
+		readContext->Busy = 0;
+	}
+
+	spin_unlock_irqrestore(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
+
+	if (*Status < 0) {
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR Read addr 0x%X tag %d URB_Submit error! %d\n",
+				Address, tag, *Status );
+		spin_lock_irqsave(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
+		clear_bit(tag, &DeviceContext->EmbeddedRegisterReadTagMap);
+		spin_unlock_irqrestore(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
+		up(&DeviceContext->EmbeddedRegisterReadSlots);
+		return NULL;
+	}
+
+	return readContext;
+}
+
+/*
+ * Drop Owner's hold on a read tag.  Returns true when that was the last one
+ * and the tag is free again; the caller then ups EmbeddedRegisterReadSlots.
+ *
+ * MUST be called with SpinLockEmbeddedRegisterRead held!
+ */
+static bool
+EMBEDDED_REGISTER_ReadReleaseLocked(
+	PDEVICE_CONTEXT DeviceContext,
+	PEMBEDDED_REGISTER_READ_CONTEXT ReadContext,
+	u8 Owner
+	)
+{
+	if (!(ReadContext->Busy & Owner))
+		return false;
+
+	ReadContext->Busy &= ~Owner;
+	if (ReadContext->Busy)
+		return false;
+
+	clear_bit(ReadContext->Tag, &DeviceContext->EmbeddedRegisterReadTagMap);
+
+	return true;
+}
+
+/*
+ * The read command URB of a tag completed.  If the command never reached
+ * the device no response will come either, so stop waiting for one and
+ * fail an async read.  Called from URB_CompletionRoutine_RegisterRead.
+ */
+void
+EMBEDDED_REGISTER_ReadUrbDone(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext
+	)
+{
+	PEMBEDDED_REGISTER_READ_CONTEXT readContext = NULL;
+	EMBEDDED_REGISTER_READ_CALLBACK callback = NULL;
+	void* callbackContext = NULL;
+	unsigned long flags;
+	bool released = false;
+	u32 address = 0;
+	int tag;
+
+	spin_lock_irqsave(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
+
+	for (tag = 0; tag < NUMBER_OF_EMBEDDED_REGISTER_READ; tag++) {
+		if (DeviceContext->EmbeddedRegisterRead[tag].UrbContext == UrbContext) {
+			readContext = &DeviceContext->EmbeddedRegisterRead[tag];
+			break;
+		}
 	}
 
+	if (readContext) {
+		if (UrbContext->UrbCompletionStatus < 0 &&
+			(readContext->Busy & EMBEDDED_REGISTER_READ_BUSY_RESPONSE)) {
+			list_del_init(&readContext->list);
+			readContext->Busy &= ~EMBEDDED_REGISTER_READ_BUSY_RESPONSE;
+			callback = readContext->Callback;
+			callbackContext = readContext->CallbackContext;
+			address = readContext->Address;
+			readContext->Callback = NULL;
+		}
+		released = EMBEDDED_REGISTER_ReadReleaseLocked(DeviceContext, readContext,
+													   EMBEDDED_REGISTER_READ_BUSY_URB);
+	}
+
+	spin_unlock_irqrestore(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
+
+	if (released)
+		up(&DeviceContext->EmbeddedRegisterReadSlots);
+	if (callback)
+		callback(DeviceContext, callbackContext, address, ~(0), UrbContext->UrbCompletionStatus);
+}
+
+/*
+ * Wait for a tagged read to complete and give up the reader's hold on its
+ * tag.  On a timeout the command URB is killed, so the tag is never reused
+ * while the USB core still owns it.  A command that did reach the device
+ * leaves the read pending until its late response consumes it, so that
+ * response cannot be taken for a later read of the same address.
+ */
+static int
+EMBEDDED_REGISTER_ReadWait(
+	PDEVICE_CONTEXT DeviceContext,
+	PEMBEDDED_REGISTER_READ_CONTEXT ReadContext,
+	u32* Data
+	)
+{
+	unsigned long flags;
+	bool released;
+	int status;
+
 	status = NOTIFICATION_Wait( DeviceContext,
-								&urbContext->Event,
+								&ReadContext->UrbContext->Event,
 								NOTIFICATION_EVENT_TIMEOUT );
-	if (status < 0)
-	{
-		*Data = ~(0);
-		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR Read addr 0x%X NOTIFICATION_Wait error! %d\n", Address, status );
+	if (status < 0) {
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR Read addr 0x%X tag %d NOTIFICATION_Wait error! %d\n",
+				ReadContext->Address, ReadContext->Tag, status );
+		usb_kill_urb( ReadContext->UrbContext->Urb );
+		goto Exit;
+	}
+
+	status = ReadContext->UrbContext->UrbCompletionStatus;
+	if (status < 0) {
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR Read addr 0x%X tag %d URB error! %d\n",
+				ReadContext->Address, ReadContext->Tag, status );
 		goto Exit;
 	}
 
 	status = NOTIFICATION_Wait( DeviceContext,
-								&DeviceContext->CompletionEventEmbeddedRegisterRead,
+								&ReadContext->Event,
 								NOTIFICATION_EVENT_TIMEOUT );
-	if (status < 0)
-	{
-		*Data = ~(0);
-		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR Read addr 0x%X NOTIFICATION_Wait Read error! %d\n", Address, status );
+	if (status < 0) {
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR Read addr 0x%X tag %d NOTIFICATION_Wait Read error! %d\n",
+				ReadContext->Address, ReadContext->Tag, status );
+		goto Exit;
 	}
-	else
-	{
-		*Data = DeviceContext->DataEmbeddedRegisterRead;
-		dev_dbg ( dev_ctx_to_dev ( DeviceContext ), "0x%08x = %08xh \n",
-				   Address,
-				   *Data );
+
+	dev_dbg ( dev_ctx_to_dev ( DeviceContext ), "0x%08x = %08xh tag %d\n",
+			   ReadContext->Address,
+			   ReadContext->Data,
+			   ReadContext->Tag );
+
+Exit:
+
+	spin_lock_irqsave(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
+	*Data = (status < 0) ? ~(0) : ReadContext->Data;
+	released = EMBEDDED_REGISTER_ReadReleaseLocked(DeviceContext, ReadContext,
+												   EMBEDDED_REGISTER_READ_BUSY_WAITER);
+	spin_unlock_irqrestore(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
+
+	if (released)
+		up(&DeviceContext->EmbeddedRegisterReadSlots);
+
+	return status;
+}
+
+int
+EMBEDDED_REGISTER_Read(
+	PDEVICE_CONTEXT DeviceContext,
+	u32 Address,
+	u32* Data
+	)
+{
+	PEMBEDDED_REGISTER_READ_CONTEXT readContext;
+	int status;
+
+	FUNCTION_ENTRY;
+
+	might_sleep();
+
+	readContext = EMBEDDED_REGISTER_ReadSubmit(DeviceContext, Address, true, NULL, NULL, &status);
+	if (!readContext) {
+		*Data = ~(0);
+		goto Exit;
 	}
 
+	status = EMBEDDED_REGISTER_ReadWait(DeviceContext, readContext, Data);
+
 Exit:
 
 	if (status < 0)
@@ -106,13 +294,229 @@ Exit:
 		DeviceContext->ErrorFlags.EmbeddedRegisterError = 1;
 	}
 
-	up(&DeviceContext->EmbeddedRegisterLock);
+	FUNCTION_LEAVE;
+
+	return status;
+}
+
+/*
+ * Read Count registers with up to NUMBER_OF_EMBEDDED_REGISTER_READ reads in
+ * flight at once.  A caller only blocks for a free tag when it has none of
+ * its own outstanding, otherwise it drains its oldest read first, so two
+ * callers can never deadlock holding part of the tag space each.
+ */
+int
+EMBEDDED_REGISTER_ReadMultiple(
+	PDEVICE_CONTEXT DeviceContext,
+	const u32* Address,
+	u32* Data,
+	int Count
+	)
+{
+	PEMBEDDED_REGISTER_READ_CONTEXT inFlight[ NUMBER_OF_EMBEDDED_REGISTER_READ ];
+	int submitted = 0;
+	int completed = 0;
+	int status = 0;
+	int waitStatus;
+
+	FUNCTION_ENTRY;
+
+	might_sleep();
+
+	while (completed < Count) {
+		if (submitted < Count && status == 0) {
+			PEMBEDDED_REGISTER_READ_CONTEXT readContext;
+
+			readContext = EMBEDDED_REGISTER_ReadSubmit(DeviceContext,
+													   Address[ submitted ],
+													   submitted == completed,
+													   NULL,
+													   NULL,
+													   &status);
+			if (readContext) {
+				inFlight[ submitted % NUMBER_OF_EMBEDDED_REGISTER_READ ] = readContext;
+				submitted++;
+				continue;
+			}
+
+			if (status == -EBUSY)
+				status = 0;
+		}
+
+		if (completed == submitted) {
+			/* Submit failed with nothing left in flight. */
+			for (; completed < Count; completed++)
+				Data[ completed ] = ~(0);
+			break;
+		}
+
+		waitStatus = EMBEDDED_REGISTER_ReadWait(DeviceContext,
+												inFlight[ completed % NUMBER_OF_EMBEDDED_REGISTER_READ ],
+												&Data[ completed ]);
+		if (waitStatus < 0 && status == 0)
+			status = waitStatus;
+		completed++;
+	}
+
+	if (status < 0)
+	{
+		DeviceContext->ErrorFlags.EmbeddedRegisterError = 1;
+	}
 
 	FUNCTION_LEAVE;
 
 	return status;
 }
 
+/*
+ * Start a register read without waiting for it.  Callback runs from the
+ * message path once the value arrives, or with a negative Status if the
+ * device goes away first.  Does not sleep: returns -EBUSY when every read
+ * tag is in flight so the caller can fall back to a synchronous read from
+ * process context.
+ */
+int
+EMBEDDED_REGISTER_ReadAsync(
+	PDEVICE_CONTEXT DeviceContext,
+	u32 Address,
+	EMBEDDED_REGISTER_READ_CALLBACK Callback,
+	void* Context
+	)
+{
+	PEMBEDDED_REGISTER_READ_CONTEXT readContext;
+	int status;
+
+	ASSERT( NULL != Callback );
+
+	status = DEVICECONTEXT_ErrorCheck( DeviceContext );
+	if (status < 0)
+		return status;
+
+	readContext = EMBEDDED_REGISTER_ReadSubmit(DeviceContext, Address, false, Callback, Context, &status);
+	if (!readContext && status != -EBUSY)
+	{
+		DeviceContext->ErrorFlags.EmbeddedRegisterError = 1;
+	}
+
+	return status;
+}
+
+/*
+ * Route a register read response to the oldest pending tag for that address.
+ * Called from the message path.
+ */
+void
+EMBEDDED_REGISTER_ReadComplete(
+	PDEVICE_CONTEXT DeviceContext,
+	u32 Address,
+	u32 Data
+	)
+{
+	PEMBEDDED_REGISTER_READ_CONTEXT readContext;
+	PEMBEDDED_REGISTER_READ_CONTEXT found = NULL;
+	EMBEDDED_REGISTER_READ_CALLBACK callback = NULL;
+	void* callbackContext = NULL;
+	unsigned long flags;
+	bool released = false;
+
+	spin_lock_irqsave(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
+
+	list_for_each_entry(readContext, &DeviceContext->EmbeddedRegisterReadPending, list) {
+		if (readContext->Address == Address) {
+			found = readContext;
+			break;
+		}
+	}
+
+	if (found) {
+		list_del_init(&found->list);
+		found->Data = Data;
+		if (found->Callback) {
+			/*
+			 * Nobody waits on an async read.  The response can arrive
+			 * before the completion of the read command URB has run, so
+			 * the tag is only freed once both are in.
+			 */
+			callback = found->Callback;
+			callbackContext = found->CallbackContext;
+			found->Callback = NULL;
+		} else {
+			/* Wake the reader; one that timed out only frees the tag. */
+			NOTIFICATION_Notify(DeviceContext, &found->Event);
+		}
+		released = EMBEDDED_REGISTER_ReadReleaseLocked(DeviceContext, found,
+													   EMBEDDED_REGISTER_READ_BUSY_RESPONSE);
+	}
+
+	spin_unlock_irqrestore(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
+
+	if (released)
+		up(&DeviceContext->EmbeddedRegisterReadSlots);
+
+	if (!found) {
+		dev_warn(dev_ctx_to_dev(DeviceContext), "WARNING: no pending read for 0x%X data 0x%X\n",
+				 Address, Data);
+		return;
+	}
+
+	if (callback)
+		callback(DeviceContext, callbackContext, Address, Data, 0);
+}
+
+/*
+ * Fail every outstanding async read, and stop waiting for the responses of
+ * reads whose reader timed out.  Called on disconnect once the message path
+ * is gone, so the callbacks can release their context.
+ */
+void
+EMBEDDED_REGISTER_ReadAbort(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	PEMBEDDED_REGISTER_READ_CONTEXT readContext;
+	EMBEDDED_REGISTER_READ_CALLBACK callback;
+	void* callbackContext;
+	unsigned long flags;
+	u32 address;
+	bool released;
+	bool found;
+
+	do {
+		found = false;
+		released = false;
+		callback = NULL;
+
+		spin_lock_irqsave(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
+		list_for_each_entry(readContext, &DeviceContext->EmbeddedRegisterReadPending, list) {
+			if (!readContext->Callback &&
+				!(readContext->Busy & EMBEDDED_REGISTER_READ_BUSY_WAITER)) {
+				list_del_init(&readContext->list);
+				released = EMBEDDED_REGISTER_ReadReleaseLocked(DeviceContext, readContext,
+															   EMBEDDED_REGISTER_READ_BUSY_RESPONSE);
+				found = true;
+				break;
+			}
+			if (readContext->Callback) {
+				list_del_init(&readContext->list);
+				callback = readContext->Callback;
+				callbackContext = readContext->CallbackContext;
+				address = readContext->Address;
+				readContext->Callback = NULL;
+				released = EMBEDDED_REGISTER_ReadReleaseLocked(DeviceContext, readContext,
+															   EMBEDDED_REGISTER_READ_BUSY_RESPONSE);
+				found = true;
+				break;
+			}
+		}
+		spin_unlock_irqrestore(&DeviceContext->SpinLockEmbeddedRegisterRead, flags);
+
+		if (released)
+			up(&DeviceContext->EmbeddedRegisterReadSlots);
+		if (callback)
+			callback(DeviceContext, callbackContext, address, ~(0), -ESHUTDOWN);
+	} while (found);
+}
+
 int
 EMBEDDED_REGISTER_Write(
 	PDEVICE_CONTEXT DeviceContext,
@@ -152,6 +556,8 @@ EMBEDDED_REGISTER_Write(
 
 	embedded_register_transfer->Data = *Data;
 
+	urbContext->Urb->transfer_buffer_length = sizeof( EMBEDDED_REGISTER_DATA_TRANSFER );
+
 	status = URB_Submit( urbContext );
 	if (status < 0)
 	{
@@ -184,70 +590,280 @@ Exit:
 	return status;
 }
 
+/*
+ * Write Count registers with one bulk OUT transfer per
+ * NUMBER_OF_EMBEDDED_REGISTER_WRITE_BATCH commands.  The FL6000 executes the
+ * packed commands in buffer order and EmbeddedRegisterLock serializes the
+ * batch against EMBEDDED_REGISTER_Write, so the writes land exactly as if
+ * they had been issued one at a time.
+ */
 int
-EMBEDDED_REGISTER_Write_Doorbell(
+EMBEDDED_REGISTER_WriteBatch(
 	PDEVICE_CONTEXT DeviceContext,
-	u32 Address,
-	u32* Data
+	const u32* Address,
+	const u32* Data,
+	int Count
 	)
 {
 	PURB_CONTEXT urbContext;
-	PEMBEDDED_REGISTER_COMMAND embeddedRegisterCommand;
 	PEMBEDDED_REGISTER_DATA_TRANSFER embedded_register_transfer;
-	int status;
-	unsigned long flags;
-	int new_entries = 1;
+	int index;
+	int chunk;
+	int i;
+	int status = 0;
 
 	FUNCTION_ENTRY;
 
-	dev_dbg(dev_ctx_to_dev(DeviceContext), "WriteAddress : 0x%08x , WriteData : 0x%08x \n",
-			Address,
-			*Data);
+	might_sleep();
+	if (down_interruptible(&DeviceContext->EmbeddedRegisterLock))
+		ASSERT(false);
 
-	spin_lock_irqsave( &DeviceContext->SpinLockEmbeddedDoorbellWrite, flags);
+	urbContext = DeviceContext->UrbContextEmbeddedRegisterWrite;
+
+	for (index = 0; index < Count; index += chunk)
+	{
+		chunk = min(Count - index, NUMBER_OF_EMBEDDED_REGISTER_WRITE_BATCH);
+
+		embedded_register_transfer = ( PEMBEDDED_REGISTER_DATA_TRANSFER )urbContext->DataBuffer;
+
+		memset( embedded_register_transfer, 0, chunk * sizeof( EMBEDDED_REGISTER_DATA_TRANSFER ) );
+
+		for (i = 0; i < chunk; i++)
+		{
+			PEMBEDDED_REGISTER_COMMAND embeddedRegisterCommand;
+
+			dev_dbg(dev_ctx_to_dev(DeviceContext),
+					"WriteAddress : 0x%04x , WriteData : 0x%08x (batch %d/%d)\n",
+					Address[ index + i ],
+					Data[ index + i ],
+					index + i + 1,
+					Count);
+
+			embeddedRegisterCommand = &embedded_register_transfer[ i ].EmbeddedRegisterCommand;
+
+			embeddedRegisterCommand->Address = Address[ index + i ];
+			embeddedRegisterCommand->ByteEnables = 0xFF;
+			embeddedRegisterCommand->RegAccess = true;
+			embeddedRegisterCommand->Read = false;
+			embeddedRegisterCommand->Write = true;
+
+			embedded_register_transfer[ i ].Data = Data[ index + i ];
+		}
+
+		urbContext->Urb->transfer_buffer_length = chunk * sizeof( EMBEDDED_REGISTER_DATA_TRANSFER );
+
+		status = URB_Submit( urbContext );
+		if (status < 0)
+		{
+			dev_err(dev_ctx_to_dev(DeviceContext), "ERROR WriteBatch addr 0x%X count %d URB_Submit fail! %d\n",
+					Address[ index ], chunk, status );
+			goto Exit;
+		}
+
+		status = NOTIFICATION_Wait( DeviceContext,
+									&urbContext->Event,
+									NOTIFICATION_EVENT_TIMEOUT );
+		if (status < 0)
+		{
+			dev_err(dev_ctx_to_dev(DeviceContext), "ERROR WriteBatch addr 0x%X count %d NOTIFICATION_Wait timeout! %d\n",
+					Address[ index ], chunk, status );
+			goto Exit;
+		}
+	}
 
-	if (list_empty(&DeviceContext->doorbell_list_free))
-		new_entries = ehub_xhci_doorbell_expand(DeviceContext, 4, GFP_ATOMIC);
+Exit:
 
-	if (new_entries < 1) {
-		ASSERT(false);
-		spin_unlock_irqrestore(&DeviceContext->SpinLockEmbeddedDoorbellWrite, flags);
-		return -ENOBUFS;
+	if (status < 0)
+	{
+		DeviceContext->ErrorFlags.EmbeddedRegisterError = 1;
 	}
 
-	urbContext = list_first_entry(&DeviceContext->doorbell_list_free,
-								  URB_CONTEXT,
-								  list);
+	up(&DeviceContext->EmbeddedRegisterLock);
 
-	list_move_tail(&urbContext->list, &DeviceContext->doorbell_list_busy);
-	spin_unlock_irqrestore( &DeviceContext->SpinLockEmbeddedDoorbellWrite, flags );
+	FUNCTION_LEAVE;
 
-	embedded_register_transfer = ( PEMBEDDED_REGISTER_DATA_TRANSFER )urbContext->DataBuffer;
+	return status;
+}
 
-	embeddedRegisterCommand = &embedded_register_transfer->EmbeddedRegisterCommand;
+/*
+ * Take a free doorbell URB from the ring, NULL if all are in flight.
+ *
+ * MUST be called with SpinLockEmbeddedDoorbellWrite held!  The submitter is
+ * the only consumer; completions publish URBs back without the lock.
+ */
+static PURB_CONTEXT
+EMBEDDED_REGISTER_DoorbellRingGet(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	u32 tail = ( u32 )atomic_read( &DeviceContext->DoorbellRingTail );
+	PURB_CONTEXT urbContext;
 
-	memset( embeddedRegisterCommand, 0, sizeof( EMBEDDED_REGISTER_COMMAND ) );
+	if (tail == ( u32 )atomic_read( &DeviceContext->DoorbellRingHead ))
+		return NULL;
 
-	embeddedRegisterCommand->Address = Address;
-	embeddedRegisterCommand->ByteEnables = 0xFF;
-	embeddedRegisterCommand->RegAccess = true;
-	embeddedRegisterCommand->Read = false;
-	embeddedRegisterCommand->Write = true;
+	/* NULL until the producer that reserved this slot has published it. */
+	urbContext = xchg( &DeviceContext->DoorbellRing[ tail & ( NUMBER_OF_MESSAGE_DOORBELL - 1 ) ],
+					   NULL );
+	if (!urbContext)
+		return NULL;
 
-	embedded_register_transfer->Data = *Data;
+	atomic_set( &DeviceContext->DoorbellRingTail, tail + 1 );
+
+	return urbContext;
+}
+
+/*
+ * Return a doorbell URB to the ring.  Safe from completion context without
+ * SpinLockEmbeddedDoorbellWrite: every URB in the ring was taken out of it
+ * first, so the reserved slot has always been consumed already.
+ */
+static void
+EMBEDDED_REGISTER_DoorbellRingPut(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext
+	)
+{
+	u32 head = ( u32 )atomic_inc_return( &DeviceContext->DoorbellRingHead ) - 1;
+
+	smp_store_release( &DeviceContext->DoorbellRing[ head & ( NUMBER_OF_MESSAGE_DOORBELL - 1 ) ],
+					   UrbContext );
+}
+
+/*
+ * Put the oldest staged doorbells, up to NUMBER_OF_DOORBELL_COALESCE, into
+ * one transfer on a free doorbell URB.  Returns -EBUSY and leaves them
+ * staged when every URB is in flight; the next completion sends them.
+ *
+ * MUST be called with SpinLockEmbeddedDoorbellWrite held!
+ */
+static int
+EMBEDDED_REGISTER_DoorbellSubmitLocked(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	PURB_CONTEXT urbContext;
+	PEMBEDDED_REGISTER_DATA_TRANSFER embedded_register_transfer;
+	int in_flight;
+	int count;
+	int index;
+	int status;
+
+	urbContext = EMBEDDED_REGISTER_DoorbellRingGet( DeviceContext );
+	if (!urbContext)
+		return -EBUSY;
+
+	embedded_register_transfer = ( PEMBEDDED_REGISTER_DATA_TRANSFER )urbContext->DataBuffer;
+	count = min( DeviceContext->DoorbellStagedCount, NUMBER_OF_DOORBELL_COALESCE );
+
+	for (index = 0; index < count; index++)
+		EMBEDDED_REGISTER_FillWrite( &embedded_register_transfer[ index ],
+									 DeviceContext->DoorbellStagedAddress[ index ],
+									 DeviceContext->DoorbellStagedData[ index ] );
+
+	urbContext->Urb->transfer_buffer_length = count * sizeof( EMBEDDED_REGISTER_DATA_TRANSFER );
+
+	DeviceContext->DoorbellStagedCount -= count;
+	if (DeviceContext->DoorbellStagedCount) {
+		memmove( DeviceContext->DoorbellStagedAddress,
+				 &DeviceContext->DoorbellStagedAddress[ count ],
+				 DeviceContext->DoorbellStagedCount * sizeof( u32 ) );
+		memmove( DeviceContext->DoorbellStagedData,
+				 &DeviceContext->DoorbellStagedData[ count ],
+				 DeviceContext->DoorbellStagedCount * sizeof( u32 ) );
+	}
+
+	in_flight = atomic_inc_return( &DeviceContext->DoorbellInFlight );
+	if (in_flight > DeviceContext->DoorbellRingHighWater)
+		DeviceContext->DoorbellRingHighWater = in_flight;
+
+	USB_OutPipeSelect( DeviceContext, urbContext->Urb, urbContext->Urb->transfer_buffer_length );
 
 	status = URB_Submit( urbContext );
 	if (status < 0)
 	{
-		*Data = ~(0);
 		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR URB_Submit fail! %d\n", status);
+		USB_OutPipeDone( DeviceContext, urbContext->Urb );
+		atomic_dec( &DeviceContext->DoorbellInFlight );
+		EMBEDDED_REGISTER_DoorbellRingPut( DeviceContext, urbContext );
+		return status;
+	}
+
+	return status;
+}
+
+/*
+ * Ring a doorbell.
+ *
+ * Doorbells are staged and sent from here only while fewer than
+ * NUMBER_OF_DOORBELL_IN_FLIGHT doorbell transfers are outstanding; otherwise
+ * URB_CompletionRoutine_Doorbell sends them with EMBEDDED_REGISTER_DoorbellFlush.
+ * A ring for a (slot, target) that is still staged merges into that entry,
+ * since one ring makes the controller look at everything queued on the ring
+ * by then, and distinct doorbells share one interrupt OUT transfer.
+ *
+ * The doorbell URBs are a fixed ring; nothing is allocated here.  When every
+ * URB is in flight the doorbell stays staged, which holds every distinct
+ * doorbell, and each completion sends the next transfer's worth.
+ */
+int
+EMBEDDED_REGISTER_Write_Doorbell(
+	PDEVICE_CONTEXT DeviceContext,
+	u32 Address,
+	u32* Data
+	)
+{
+	int status = 0;
+	unsigned long flags;
+	int index;
+
+	FUNCTION_ENTRY;
+
+	dev_dbg(dev_ctx_to_dev(DeviceContext), "WriteAddress : 0x%08x , WriteData : 0x%08x \n",
+			Address,
+			*Data);
+
+	spin_lock_irqsave( &DeviceContext->SpinLockEmbeddedDoorbellWrite, flags);
+
+	for (index = 0; index < DeviceContext->DoorbellStagedCount; index++)
+	{
+		if (DeviceContext->DoorbellStagedAddress[ index ] == Address &&
+			DeviceContext->DoorbellStagedData[ index ] == *Data)
+		{
+			dev_dbg(dev_ctx_to_dev(DeviceContext), "Doorbell 0x%08x merged\n", Address);
+			goto Exit;
+		}
+	}
+
+	if (WARN_ON_ONCE( DeviceContext->DoorbellStagedCount == NUMBER_OF_DOORBELL_STAGED ))
+	{
+		/* Cannot happen without streams; keep the oldest doorbells. */
+		status = -ENOSPC;
 		goto Exit;
 	}
 
+	DeviceContext->DoorbellStagedAddress[ DeviceContext->DoorbellStagedCount ] = Address;
+	DeviceContext->DoorbellStagedData[ DeviceContext->DoorbellStagedCount ] = *Data;
+	DeviceContext->DoorbellStagedCount++;
+
+	if (atomic_read( &DeviceContext->DoorbellInFlight ) < NUMBER_OF_DOORBELL_IN_FLIGHT ||
+		DeviceContext->DoorbellStagedCount >= NUMBER_OF_DOORBELL_COALESCE)
+	{
+		status = EMBEDDED_REGISTER_DoorbellSubmitLocked( DeviceContext );
+		/* Still staged, a completion will send it. */
+		if (status == -EBUSY) {
+			DeviceContext->DoorbellRingStalls++;
+			status = 0;
+		}
+	}
+
 Exit:
 
-	if (status < 0)
+	spin_unlock_irqrestore( &DeviceContext->SpinLockEmbeddedDoorbellWrite, flags );
+
+	if (status < 0 && status != -ENOSPC)
 	{
+		*Data = ~(0);
 		DeviceContext->ErrorFlags.EmbeddedRegisterError = 1;
 	}
 
@@ -256,3 +872,33 @@ Exit:
 	return status;
 }
 
+/*
+ * A doorbell transfer completed: hand its URB back to the ring and send
+ * whatever was staged meanwhile.  Called from URB_CompletionRoutine_Doorbell.
+ */
+void
+EMBEDDED_REGISTER_DoorbellFlush(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext
+	)
+{
+	unsigned long flags;
+	int status = 0;
+
+	atomic_dec( &DeviceContext->DoorbellInFlight );
+	EMBEDDED_REGISTER_DoorbellRingPut( DeviceContext, UrbContext );
+
+	/* Always take the lock: a ring staged while this URB was in flight must
+	 * either see the decremented count or be seen here. */
+	spin_lock_irqsave( &DeviceContext->SpinLockEmbeddedDoorbellWrite, flags );
+
+	if (DeviceContext->DoorbellStagedCount)
+		status = EMBEDDED_REGISTER_DoorbellSubmitLocked( DeviceContext );
+
+	spin_unlock_irqrestore( &DeviceContext->SpinLockEmbeddedDoorbellWrite, flags );
+
+	if (status < 0 && status != -EBUSY)
+	{
+		DeviceContext->ErrorFlags.EmbeddedRegisterError = 1;
+	}
+}
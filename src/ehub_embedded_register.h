@@ -57,6 +57,22 @@ typedef union _EMBEDDED_REGISTER_DATA_TRANSFER_
 	u32 Dwords[ 2 ];
 } EMBEDDED_REGISTER_DATA_TRANSFER, *PEMBEDDED_REGISTER_DATA_TRANSFER;
 
+static inline void
+EMBEDDED_REGISTER_FillWrite(
+	PEMBEDDED_REGISTER_DATA_TRANSFER Transfer,
+	u32 Address,
+	u32 Data
+	)
+{
+	Transfer->EmbeddedRegisterCommand.Value = 0;
+	Transfer->EmbeddedRegisterCommand.Address = Address;
+	Transfer->EmbeddedRegisterCommand.ByteEnables = 0xFF;
+	Transfer->EmbeddedRegisterCommand.RegAccess = true;
+	Transfer->EmbeddedRegisterCommand.Read = false;
+	Transfer->EmbeddedRegisterCommand.Write = true;
+	Transfer->Data = Data;
+}
+
 int
 EMBEDDED_REGISTER_Read(
 	PDEVICE_CONTEXT DeviceContext,
@@ -64,6 +80,40 @@ EMBEDDED_REGISTER_Read(
 	u32* Data
 	);
 
+int
+EMBEDDED_REGISTER_ReadMultiple(
+	PDEVICE_CONTEXT DeviceContext,
+	const u32* Address,
+	u32* Data,
+	int Count
+	);
+
+int
+EMBEDDED_REGISTER_ReadAsync(
+	PDEVICE_CONTEXT DeviceContext,
+	u32 Address,
+	EMBEDDED_REGISTER_READ_CALLBACK Callback,
+	void* Context
+	);
+
+void
+EMBEDDED_REGISTER_ReadComplete(
+	PDEVICE_CONTEXT DeviceContext,
+	u32 Address,
+	u32 Data
+	);
+
+void
+EMBEDDED_REGISTER_ReadAbort(
+	PDEVICE_CONTEXT DeviceContext
+	);
+
+void
+EMBEDDED_REGISTER_ReadUrbDone(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext
+	);
+
 int
 EMBEDDED_REGISTER_Write(
 	PDEVICE_CONTEXT DeviceContext,
@@ -71,6 +121,14 @@ EMBEDDED_REGISTER_Write(
 	u32* Data
 	);
 
+int
+EMBEDDED_REGISTER_WriteBatch(
+	PDEVICE_CONTEXT DeviceContext,
+	const u32* Address,
+	const u32* Data,
+	int Count
+	);
+
 int
 EMBEDDED_REGISTER_Write_Doorbell(
 	PDEVICE_CONTEXT DeviceContext,
@@ -78,4 +136,10 @@ EMBEDDED_REGISTER_Write_Doorbell(
 	u32* Data
 	);
 
+void
+EMBEDDED_REGISTER_DoorbellFlush(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext
+	);
+
 #endif
@@ -0,0 +1,398 @@
+/*
+ * Fresco Logic FL6000 F-One Controller Driver
+ *
+ * Copyright (C) 2014-2017 Fresco Logic, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+
+#include "ehub_public.h"
+
+#ifdef USE_IOVA_TABLE
+
+int
+IOVA_Create(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	PIOVA_TABLE iovaTable;
+
+	iovaTable = vzalloc( sizeof( IOVA_TABLE ) );
+	if (!iovaTable)
+		return -ENOMEM;
+
+	spin_lock_init( &iovaTable->Lock );
+	DeviceContext->IovaTable = iovaTable;
+
+	return 0;
+}
+
+void
+IOVA_Destroy(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	PIOVA_TABLE iovaTable = DeviceContext->IovaTable;
+
+	if (!iovaTable)
+		return;
+
+	dev_dbg(dev_ctx_to_dev(DeviceContext), "IOVA windows in use %u, high water %u, exhausted %u, faults %u\n",
+			iovaTable->WindowsUsed, iovaTable->WindowsHighWater,
+			iovaTable->Exhausted, atomic_read( &iovaTable->Faults ));
+
+	DeviceContext->IovaTable = NULL;
+	vfree( iovaTable );
+}
+
+/*
+ * Find NumberOfWindows free windows in a row, searching on from the last
+ * mapping so a freed address is not handed out again straight away.
+ * Called with the table lock held.
+ */
+static int
+IOVA_AllocateLocked(
+	PIOVA_TABLE IovaTable,
+	unsigned int NumberOfWindows
+	)
+{
+	unsigned long index;
+
+	index = bitmap_find_next_zero_area( IovaTable->Map, IOVA_NUMBER_OF_WINDOWS,
+										IovaTable->NextWindow, NumberOfWindows, 0 );
+	if (index >= IOVA_NUMBER_OF_WINDOWS)
+		index = bitmap_find_next_zero_area( IovaTable->Map, IOVA_NUMBER_OF_WINDOWS,
+											0, NumberOfWindows, 0 );
+	if (index >= IOVA_NUMBER_OF_WINDOWS) {
+		IovaTable->Exhausted++;
+		return -ENOSPC;
+	}
+
+	bitmap_set( IovaTable->Map, index, NumberOfWindows );
+
+	IovaTable->NextWindow = index + NumberOfWindows;
+	if (IovaTable->NextWindow >= IOVA_NUMBER_OF_WINDOWS)
+		IovaTable->NextWindow = 0;
+
+	IovaTable->WindowsUsed += NumberOfWindows;
+	if (IovaTable->WindowsUsed > IovaTable->WindowsHighWater)
+		IovaTable->WindowsHighWater = IovaTable->WindowsUsed;
+
+	return index;
+}
+
+/*
+ * Map Length bytes starting Offset bytes into either the kernel mapping at
+ * Virtual or, when Virtual is NULL, the pages from Page on.
+ */
+static dma_addr_t
+IOVA_Map(
+	PDEVICE_CONTEXT DeviceContext,
+	u8* Virtual,
+	struct page* Page,
+	unsigned int Offset,
+	size_t Length
+	)
+{
+	PIOVA_TABLE iovaTable = DeviceContext->IovaTable;
+	PIOVA_WINDOW window;
+	unsigned int numberOfWindows;
+	unsigned int indexOfWindow;
+	unsigned long flags;
+	struct page* page;
+	int index;
+
+	numberOfWindows = max_t( unsigned int, 1, DIV_ROUND_UP( Offset + Length, IOVA_WINDOW_SIZE ) );
+
+	spin_lock_irqsave( &iovaTable->Lock, flags );
+
+	index = IOVA_AllocateLocked( iovaTable, numberOfWindows );
+	if (index < 0) {
+		spin_unlock_irqrestore( &iovaTable->Lock, flags );
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR: no IOVA windows for 0x%zx bytes\n", Length);
+		return 0;
+	}
+
+	for (indexOfWindow = 0; indexOfWindow < numberOfWindows; indexOfWindow++) {
+		window = &iovaTable->Window[ index + indexOfWindow ];
+
+		if (Virtual) {
+			window->Virtual = Virtual + indexOfWindow * IOVA_WINDOW_SIZE;
+			window->Page = NULL;
+		} else {
+			page = nth_page( Page, indexOfWindow );
+			window->Virtual = PageHighMem( page ) ? NULL : page_address( page );
+			window->Page = page;
+		}
+
+		window->Start = indexOfWindow ? 0 : Offset;
+		window->End = ( indexOfWindow == numberOfWindows - 1 ) ?
+					  Offset + Length - indexOfWindow * IOVA_WINDOW_SIZE : IOVA_WINDOW_SIZE;
+		window->Head = !indexOfWindow;
+	}
+
+	spin_unlock_irqrestore( &iovaTable->Lock, flags );
+
+	return IOVA_BASE + (( u64 )index << IOVA_WINDOW_SHIFT ) + Offset;
+}
+
+dma_addr_t
+IOVA_MapVirtual(
+	PDEVICE_CONTEXT DeviceContext,
+	void* Virtual,
+	size_t Length
+	)
+{
+	return IOVA_Map( DeviceContext,
+					 ( u8* )(( unsigned long )Virtual & PAGE_MASK ),
+					 NULL,
+					 offset_in_page( Virtual ),
+					 Length );
+}
+
+dma_addr_t
+IOVA_MapPage(
+	PDEVICE_CONTEXT DeviceContext,
+	struct page* Page,
+	unsigned int Offset,
+	size_t Length
+	)
+{
+	return IOVA_Map( DeviceContext,
+					 NULL,
+					 nth_page( Page, Offset >> PAGE_SHIFT ),
+					 Offset & ~PAGE_MASK,
+					 Length );
+}
+
+void
+IOVA_Unmap(
+	PDEVICE_CONTEXT DeviceContext,
+	dma_addr_t Address,
+	size_t Length
+	)
+{
+	PIOVA_TABLE iovaTable = DeviceContext->IovaTable;
+	unsigned int numberOfWindows;
+	unsigned long flags;
+	u64 index;
+
+	if (!iovaTable || Address < IOVA_BASE)
+		return;
+
+	index = ( Address - IOVA_BASE ) >> IOVA_WINDOW_SHIFT;
+	numberOfWindows = max_t( unsigned int, 1, DIV_ROUND_UP( offset_in_page( Address ) + Length, IOVA_WINDOW_SIZE ) );
+
+	if (index + numberOfWindows > IOVA_NUMBER_OF_WINDOWS) {
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR: unmap of unknown IOVA 0x%llx\n", ( u64 )Address);
+		return;
+	}
+
+	spin_lock_irqsave( &iovaTable->Lock, flags );
+
+	if (!iovaTable->Window[ index ].Head) {
+		spin_unlock_irqrestore( &iovaTable->Lock, flags );
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR: unmap of unknown IOVA 0x%llx\n", ( u64 )Address);
+		return;
+	}
+
+	memset( &iovaTable->Window[ index ], 0, numberOfWindows * sizeof( IOVA_WINDOW ) );
+	bitmap_clear( iovaTable->Map, index, numberOfWindows );
+	iovaTable->WindowsUsed -= numberOfWindows;
+
+	spin_unlock_irqrestore( &iovaTable->Lock, flags );
+}
+
+/*
+ * Copy between DataBuffer and device address Address, window by window.
+ * Every byte must lie inside one mapping, or nothing more is copied.
+ */
+static int
+IOVA_Copy(
+	PDEVICE_CONTEXT DeviceContext,
+	u64 Address,
+	u8* DataBuffer,
+	size_t Length,
+	bool Write
+	)
+{
+	PIOVA_TABLE iovaTable = DeviceContext->IovaTable;
+	PIOVA_WINDOW window;
+	unsigned long flags;
+	u64 index;
+	unsigned int offset;
+	size_t chunk;
+	u8* target;
+	bool first = true;
+
+	if (!iovaTable)
+		return -ENODEV;
+
+	if (Address < IOVA_BASE)
+		goto Fault;
+
+	index = ( Address - IOVA_BASE ) >> IOVA_WINDOW_SHIFT;
+	offset = offset_in_page( Address );
+
+	spin_lock_irqsave( &iovaTable->Lock, flags );
+
+	while (Length) {
+		if (index >= IOVA_NUMBER_OF_WINDOWS)
+			goto FaultLocked;
+
+		window = &iovaTable->Window[ index ];
+		chunk = min_t( size_t, Length, IOVA_WINDOW_SIZE - offset );
+
+		if (( !window->Virtual && !window->Page ) ||
+			( !first && window->Head ) ||
+			offset < window->Start ||
+			offset + chunk > window->End)
+			goto FaultLocked;
+
+		target = window->Virtual ? ( u8* )window->Virtual : ( u8* )kmap_atomic( window->Page );
+		if (Write)
+			memcpy( target + offset, DataBuffer, chunk );
+		else
+			memcpy( DataBuffer, target + offset, chunk );
+		if (!window->Virtual)
+			kunmap_atomic( target );
+
+		DataBuffer += chunk;
+		Length -= chunk;
+		index++;
+		offset = 0;
+		first = false;
+	}
+
+	spin_unlock_irqrestore( &iovaTable->Lock, flags );
+
+	return 0;
+
+FaultLocked:
+	spin_unlock_irqrestore( &iovaTable->Lock, flags );
+Fault:
+	atomic_inc( &iovaTable->Faults );
+	dev_err(dev_ctx_to_dev(DeviceContext), "ERROR: device %s of unmapped IOVA 0x%llx\n",
+			Write ? "write" : "read", Address);
+	return -EFAULT;
+}
+
+int
+IOVA_Read(
+	PDEVICE_CONTEXT DeviceContext,
+	u64 Address,
+	void* DataBuffer,
+	size_t Length
+	)
+{
+	return IOVA_Copy( DeviceContext, Address, DataBuffer, Length, false );
+}
+
+int
+IOVA_Write(
+	PDEVICE_CONTEXT DeviceContext,
+	u64 Address,
+	const void* DataBuffer,
+	size_t Length
+	)
+{
+	return IOVA_Copy( DeviceContext, Address, ( u8* )DataBuffer, Length, true );
+}
+
+#else /* !USE_IOVA_TABLE */
+
+/* Without the table the device is handed kernel virtual addresses. */
+
+int
+IOVA_Create(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	return 0;
+}
+
+void
+IOVA_Destroy(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+}
+
+dma_addr_t
+IOVA_MapVirtual(
+	PDEVICE_CONTEXT DeviceContext,
+	void* Virtual,
+	size_t Length
+	)
+{
+	return ( dma_addr_t )Virtual;
+}
+
+dma_addr_t
+IOVA_MapPage(
+	PDEVICE_CONTEXT DeviceContext,
+	struct page* Page,
+	unsigned int Offset,
+	size_t Length
+	)
+{
+	if (PageHighMem( Page ))
+		return 0;
+
+	return ( dma_addr_t )page_address( Page ) + Offset;
+}
+
+void
+IOVA_Unmap(
+	PDEVICE_CONTEXT DeviceContext,
+	dma_addr_t Address,
+	size_t Length
+	)
+{
+}
+
+int
+IOVA_Read(
+	PDEVICE_CONTEXT DeviceContext,
+	u64 Address,
+	void* DataBuffer,
+	size_t Length
+	)
+{
+	if (Address < EHUB_MIN_VALID_VADDR)
+		return -EFAULT;
+
+	return probe_kernel_read( DataBuffer, ( void* )Address, Length );
+}
+
+int
+IOVA_Write(
+	PDEVICE_CONTEXT DeviceContext,
+	u64 Address,
+	const void* DataBuffer,
+	size_t Length
+	)
+{
+	if (Address < EHUB_MIN_VALID_VADDR)
+		return -EFAULT;
+
+	return probe_kernel_write( ( void* )Address, DataBuffer, Length );
+}
+
+#endif /* USE_IOVA_TABLE */
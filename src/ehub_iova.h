@@ -0,0 +1,104 @@
+/*
+ * Fresco Logic FL6000 F-One Controller Driver
+ *
+ * Copyright (C) 2014-2017 Fresco Logic, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef EHUB_IOVA_H
+#define EHUB_IOVA_H
+
+/*
+ * Device addresses handed to the FL6000 for host memory.  Each mapping takes
+ * whole windows of one page; a device address is the window index above
+ * IOVA_BASE plus the offset within the page, so the low bits (and with them
+ * the alignment) of the kernel address are kept.
+ */
+#define IOVA_BASE                   ( 0x0000100000000000ULL )
+#define IOVA_NUMBER_OF_WINDOWS      ( 16384 )
+#define IOVA_WINDOW_SIZE            ( PAGE_SIZE )
+#define IOVA_WINDOW_SHIFT           ( PAGE_SHIFT )
+
+typedef struct _IOVA_WINDOW_
+{
+	void* Virtual;          /* Start of the page when it has a kernel mapping. */
+	struct page* Page;      /* Otherwise the page itself, mapped on access. */
+	u32 Start;              /* Mapped bytes of the window are [Start, End). */
+	u32 End;
+	bool Head;              /* First window of its mapping. */
+} IOVA_WINDOW, *PIOVA_WINDOW;
+
+typedef struct _IOVA_TABLE_
+{
+	spinlock_t Lock;
+	unsigned int NextWindow;
+	unsigned int WindowsUsed;
+	unsigned int WindowsHighWater;
+	u32 Exhausted;
+	atomic_t Faults;        /* Bumped outside Lock too. */
+	DECLARE_BITMAP( Map, IOVA_NUMBER_OF_WINDOWS );
+	IOVA_WINDOW Window[ IOVA_NUMBER_OF_WINDOWS ];
+} IOVA_TABLE, *PIOVA_TABLE;
+
+int
+IOVA_Create(
+	PDEVICE_CONTEXT DeviceContext
+	);
+
+void
+IOVA_Destroy(
+	PDEVICE_CONTEXT DeviceContext
+	);
+
+dma_addr_t
+IOVA_MapVirtual(
+	PDEVICE_CONTEXT DeviceContext,
+	void* Virtual,
+	size_t Length
+	);
+
+dma_addr_t
+IOVA_MapPage(
+	PDEVICE_CONTEXT DeviceContext,
+	struct page* Page,
+	unsigned int Offset,
+	size_t Length
+	);
+
+void
+IOVA_Unmap(
+	PDEVICE_CONTEXT DeviceContext,
+	dma_addr_t Address,
+	size_t Length
+	);
+
+int
+IOVA_Read(
+	PDEVICE_CONTEXT DeviceContext,
+	u64 Address,
+	void* DataBuffer,
+	size_t Length
+	);
+
+int
+IOVA_Write(
+	PDEVICE_CONTEXT DeviceContext,
+	u64 Address,
+	const void* DataBuffer,
+	size_t Length
+	);
+
+#endif
@@ -20,6 +20,8 @@
 
 #include <linux/errno.h>
 #include <linux/types.h>
+#include <linux/module.h>
+#include <linux/math64.h>
 #include <linux/workqueue.h>
 #include <linux/slab.h>
 #include <linux/semaphore.h>
@@ -32,12 +34,195 @@
 #include "ehub_device_context.h"
 #include "ehub_embedded_register.h"
 #include "ehub_embedded_cache.h"
+#include "ehub_iova.h"
 #include "ehub_message.h"
 #include "ehub_notification.h"
 #include "ehub_urb.h"
 #include "ehub_work_item.h"
 #include "xhci.h"
 
+/* Bounds of the adaptive message loops, see MESSAGE_LoopResize. */
+static unsigned int message_depth_min = 2;
+module_param(message_depth_min, uint, S_IRUGO);
+MODULE_PARM_DESC(message_depth_min, "Fewest message IN URBs kept on the wire per pipe");
+
+static unsigned int message_depth_max = NUMBER_OF_MESSAGE_LOOP_MAX;
+module_param(message_depth_max, uint, S_IRUGO);
+MODULE_PARM_DESC(message_depth_max, "Most message IN URBs kept on the wire per pipe");
+
+/*
+ * Allocate one more memory read response URB.  It is handed to the caller
+ * rather than put on the free list.
+ */
+PURB_CONTEXT
+MESSAGE_ReadResponseCreate(
+	PDEVICE_CONTEXT DeviceContext,
+	gfp_t flags
+	)
+{
+	PURB_CONTEXT urbContext;
+	unsigned long irqFlags;
+	int index;
+
+	spin_lock_irqsave( &DeviceContext->SpinLockEmbeddedMemoryReadCompletion, irqFlags );
+	index = DeviceContext->NumberOfEmbeddedMemoryReadCompletion;
+	if (index < NUMBER_OF_MEMORY_READ_RESPONSE_MAX)
+		DeviceContext->NumberOfEmbeddedMemoryReadCompletion++;
+	spin_unlock_irqrestore( &DeviceContext->SpinLockEmbeddedMemoryReadCompletion, irqFlags );
+
+	if (index >= NUMBER_OF_MEMORY_READ_RESPONSE_MAX)
+		return NULL;
+
+	/* A failed slot stays empty, URB_Create has flagged the device. */
+	urbContext = URB_Create(DeviceContext,
+							DeviceContext->UsbContext.UsbDevice,
+							DeviceContext->UsbContext.UsbPipeBulkOut,
+							MESSAGE_DATA_BUFFER_SIZE_BULK,
+							URB_CompletionRoutine_MemoryReadResponse,
+							NULL,
+							flags);
+	DeviceContext->UrbContextEmbeddedMemoryReadCompletion[ index ] = urbContext;
+
+	return urbContext;
+}
+
+/*
+ * Return a memory read response URB to the free list, called from its
+ * completion routine or when it was not submitted.
+ */
+void
+MESSAGE_ReadResponsePut(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext
+	)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave( &DeviceContext->SpinLockEmbeddedMemoryReadCompletion, flags );
+	list_add_tail( &UrbContext->list, &DeviceContext->EmbeddedMemoryReadCompletionFree );
+	spin_unlock_irqrestore( &DeviceContext->SpinLockEmbeddedMemoryReadCompletion, flags );
+
+	wake_up( &DeviceContext->EmbeddedMemoryReadCompletionWait );
+}
+
+static bool
+MESSAGE_ReadResponseAvailable(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT* UrbContext
+	)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave( &DeviceContext->SpinLockEmbeddedMemoryReadCompletion, flags );
+	*UrbContext = list_first_entry_or_null( &DeviceContext->EmbeddedMemoryReadCompletionFree,
+											URB_CONTEXT, list );
+	if (*UrbContext)
+		list_del_init( &( *UrbContext )->list );
+	spin_unlock_irqrestore( &DeviceContext->SpinLockEmbeddedMemoryReadCompletion, flags );
+
+	return NULL != *UrbContext;
+}
+
+/*
+ * Take a free memory read response URB.  The pool grows up to
+ * NUMBER_OF_MEMORY_READ_RESPONSE_MAX; after that the caller waits for a
+ * completion, which holds back the DMA read lane instead of reusing a URB
+ * that is still on the wire.
+ */
+static PURB_CONTEXT
+MESSAGE_ReadResponseGet(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	PURB_CONTEXT urbContext;
+
+	might_sleep();
+
+	if (MESSAGE_ReadResponseAvailable( DeviceContext, &urbContext ))
+		return urbContext;
+
+	urbContext = MESSAGE_ReadResponseCreate( DeviceContext, GFP_KERNEL );
+	if (urbContext)
+		return urbContext;
+
+	DeviceContext->EmbeddedMemoryReadCompletionStalls++;
+
+	while (DEVICECONTEXT_ErrorCheck( DeviceContext ) >= 0)
+	{
+		if (wait_event_timeout( DeviceContext->EmbeddedMemoryReadCompletionWait,
+								MESSAGE_ReadResponseAvailable( DeviceContext, &urbContext ),
+								msecs_to_jiffies( EHUB_MEMORY_READ_RESPONSE_WAIT_MS ) ))
+			return urbContext;
+	}
+
+	return NULL;
+}
+
+/*
+ * Copy the host memory a read request asks for, behind its command, into
+ * DataBuffer.  Returns the response length or a negative error.
+ */
+static int
+MESSAGE_ReadResponseFill(
+	PDEVICE_CONTEXT DeviceContext,
+	PEMBEDDED_MEMORY_TRANSFER EmbeddedMemoryTransfer,
+	u8* DataBuffer,
+	int DataBufferLength
+	)
+{
+	int status;
+	int dataLength;
+	u64 addressTarget;
+
+	addressTarget = trb_ptr_to_addr(EmbeddedMemoryTransfer->AddressLow, ( u64 )EmbeddedMemoryTransfer->AddressHigh);
+	dataLength = sizeof( EMBEDDED_MEMORY_COMMAND ) + EmbeddedMemoryTransfer->EmbeddedMemoryCommand.Length;
+
+	if (dataLength > DataBufferLength) {
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR: read of 0x%X bytes does not fit\n",
+				EmbeddedMemoryTransfer->EmbeddedMemoryCommand.Length);
+		return -EOVERFLOW;
+	}
+
+	memcpy(DataBuffer, ( u8* )EmbeddedMemoryTransfer, sizeof(EMBEDDED_MEMORY_COMMAND));
+
+	status = IOVA_Read(DeviceContext,
+					   addressTarget,
+					   DataBuffer + sizeof(EMBEDDED_MEMORY_COMMAND),
+					   EmbeddedMemoryTransfer->EmbeddedMemoryCommand.Length);
+	if (status < 0) {
+		dev_info(dev_ctx_to_dev(DeviceContext), "IOVA_Read of 0x%llx returned %d\n", addressTarget, status);
+		return status;
+	}
+
+	dev_dbg(dev_ctx_to_dev(DeviceContext), "0x%0X bytes @0x%llx\n", EmbeddedMemoryTransfer->EmbeddedMemoryCommand.Length, addressTarget );
+
+	return dataLength;
+}
+
+static void
+MESSAGE_ReadResponseSubmit(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext,
+	int DataBufferLength
+	)
+{
+	int status;
+
+	if (0 == DataBufferLength) {
+		MESSAGE_ReadResponsePut( DeviceContext, UrbContext );
+		return;
+	}
+
+	UrbContext->Urb->transfer_buffer_length = DataBufferLength;
+
+	status = URB_Submit( UrbContext );
+	if (status < 0)
+	{
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR: URB_Submit fail! %d\n", status );
+		MESSAGE_ReadResponsePut( DeviceContext, UrbContext );
+	}
+}
+
 void
 MESSAGE_HandleMessage_EMBEDDED_MEMORY_READ_COMPLETION(
 	PDEVICE_CONTEXT DeviceContext,
@@ -45,62 +230,166 @@ MESSAGE_HandleMessage_EMBEDDED_MEMORY_READ_COMPLETION(
 )
 {
 	int status;
-	PEMBEDDED_MEMORY_TRANSFER embeddedMemoryTransfer;
-	int dataBufferLength;
-	u8* addressTarget;
 	PURB_CONTEXT urbContext;
 
 	//   FUNCTION_ENTRY;
 
-	embeddedMemoryTransfer = ( PEMBEDDED_MEMORY_TRANSFER )EmbeddedGenericHeader;
-	addressTarget = ( u8* )trb_ptr_to_addr(embeddedMemoryTransfer->AddressLow, ( u64 )embeddedMemoryTransfer->AddressHigh);
-
 	status = DEVICECONTEXT_ErrorCheck(DeviceContext);
 	if (status < 0) {
 		dev_dbg(dev_ctx_to_dev(DeviceContext), "ErrorCheck FAILED %d\n", status);
-		goto Exit;
+		return;
 	}
 
-	might_sleep();
-	if (mutex_lock_interruptible(&DeviceContext->MessageHandleEmbeddedMemoryReadCompletionLock))             \
-		KERNEL_PANIC("mutex_lock_interruptible fail!");
+	urbContext = MESSAGE_ReadResponseGet(DeviceContext);
+	if (!urbContext) {
+		dev_dbg(dev_ctx_to_dev(DeviceContext), "EMBEDDED_MEMORY_READ_COMPLETION: urbContext NULL\n");
+		return;
+	}
 
-	urbContext = DeviceContext->UrbContextEmbeddedMemoryReadCompletion[DeviceContext->CurrentEmbeddedMemoryReadCompletionUrbContextIndex];
-	DeviceContext->CurrentEmbeddedMemoryReadCompletionUrbContextIndex++;
-	DeviceContext->CurrentEmbeddedMemoryReadCompletionUrbContextIndex %= NUMBER_OF_MESSAGE_BULK;
+	status = MESSAGE_ReadResponseFill(DeviceContext,
+									  ( PEMBEDDED_MEMORY_TRANSFER )EmbeddedGenericHeader,
+									  urbContext->DataBuffer,
+									  urbContext->DataBufferLength);
 
-	mutex_unlock(&DeviceContext->MessageHandleEmbeddedMemoryReadCompletionLock);
+	MESSAGE_ReadResponseSubmit(DeviceContext, urbContext, status < 0 ? 0 : status);
 
-	if (!urbContext) {
-		dev_dbg(dev_ctx_to_dev(DeviceContext), "EMBEDDED_MEMORY_READ_COMPLETION: urbContext NULL\n");
-		goto Exit;
+//    FUNCTION_LEAVE;
+}
+
+/*
+ * Take the next request off the DMA read lane if there is one and its
+ * response fits in Room bytes; a negative Room always fits.
+ */
+static bool
+MESSAGE_DmaReadPop(
+	PDEVICE_CONTEXT DeviceContext,
+	PEMBEDDED_MEMORY_TRANSFER EmbeddedMemoryTransfer,
+	int Room
+	)
+{
+	unsigned long flags;
+	u32* request;
+	bool popped = false;
+
+	spin_lock_irqsave( &DeviceContext->SpinLockDmaRead, flags );
+
+	if (DeviceContext->DmaReadTail != DeviceContext->DmaReadHead)
+	{
+		request = DeviceContext->DmaReadRequest[ DeviceContext->DmaReadTail & ( NUMBER_OF_DMA_READ_REQUEST - 1 ) ];
+		memcpy( EmbeddedMemoryTransfer->Dwords, request, sizeof( EmbeddedMemoryTransfer->Dwords ) );
+
+		if (Room < 0 ||
+			roundup( sizeof( EMBEDDED_MEMORY_COMMAND ) + EmbeddedMemoryTransfer->EmbeddedMemoryCommand.Length, 4 ) <= Room)
+		{
+			DeviceContext->DmaReadTail++;
+			popped = true;
+		}
 	}
 
-	dataBufferLength = sizeof( EMBEDDED_MEMORY_COMMAND ) + embeddedMemoryTransfer->EmbeddedMemoryCommand.Length;
+	spin_unlock_irqrestore( &DeviceContext->SpinLockDmaRead, flags );
 
-	urbContext->Urb->transfer_buffer_length = dataBufferLength;
+	return popped;
+}
+
+/*
+ * DMA read lane worker: serve the queued memory read requests in order.
+ * Requests already waiting behind the first are packed into the same bulk
+ * OUT transfer, each response dword aligned like the messages are.
+ */
+void
+MESSAGE_DmaReadProcess(
+	struct work_struct* WorkItem
+	)
+{
+	PDEVICE_CONTEXT deviceContext;
+	EMBEDDED_MEMORY_TRANSFER embeddedMemoryTransfer;
+	PURB_CONTEXT urbContext;
+	int dataBufferLength;
+	int status;
 
-	memcpy(urbContext->DataBuffer, ( u8* )embeddedMemoryTransfer, sizeof(EMBEDDED_MEMORY_COMMAND));
+	deviceContext = container_of( WorkItem, DEVICE_CONTEXT, DmaReadWork );
 
-	status = probe_kernel_read(urbContext->DataBuffer + sizeof(EMBEDDED_MEMORY_COMMAND),
-							   addressTarget,
-							   embeddedMemoryTransfer->EmbeddedMemoryCommand.Length);
-	if (status < 0) {
-		dev_info(dev_ctx_to_dev(DeviceContext), "probe_kernel_read returned %d\n", status);
-		goto Exit;
+	while (MESSAGE_DmaReadPop( deviceContext, &embeddedMemoryTransfer, -1 ))
+	{
+		if (DEVICECONTEXT_ErrorCheck( deviceContext ) < 0)
+			continue;
+
+		urbContext = MESSAGE_ReadResponseGet( deviceContext );
+		if (!urbContext)
+			continue;
+
+		dataBufferLength = 0;
+		do {
+			status = MESSAGE_ReadResponseFill( deviceContext,
+											   &embeddedMemoryTransfer,
+											   urbContext->DataBuffer + dataBufferLength,
+											   urbContext->DataBufferLength - dataBufferLength );
+			if (status < 0)
+				continue;
+
+			if (dataBufferLength)
+				deviceContext->EmbeddedMemoryReadCompletionCoalesced++;
+			dataBufferLength += roundup( status, 4 );
+#ifdef USE_MEMORY_READ_COALESCE
+		} while (MESSAGE_DmaReadPop( deviceContext, &embeddedMemoryTransfer,
+									 urbContext->DataBufferLength - dataBufferLength ));
+#else
+		} while (0);
+#endif
+
+		/* A single response goes out at its exact length, as before. */
+		if (status > 0 && dataBufferLength == roundup( status, 4 ))
+			dataBufferLength = status;
+
+		MESSAGE_ReadResponseSubmit( deviceContext, urbContext, dataBufferLength );
 	}
+}
 
-	status = URB_Submit( urbContext );
-	if (status < 0)
+/*
+ * Hand a memory read request to the DMA read lane.  The responses must go
+ * back in request order, so when the lane is full this waits for it to
+ * drain instead of serving the request ahead of the older ones.  Called
+ * from the WorkItemQueue, which may sleep.
+ */
+static void
+MESSAGE_QueueDmaRead(
+	PDEVICE_CONTEXT DeviceContext,
+	PEMBEDDED_GENERIC_HEADER EmbeddedGenericHeader
+	)
+{
+	unsigned long flags;
+	unsigned int depth;
+
+	if (!DeviceContext->DmaReadQueue)
 	{
-		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR: URB_Submit fail! %d\n", status );
-		goto Exit;
+		MESSAGE_HandleMessage_EMBEDDED_MEMORY_READ_COMPLETION( DeviceContext,
+															   EmbeddedGenericHeader );
+		return;
 	}
-	dev_dbg(dev_ctx_to_dev(DeviceContext), "0x%0X bytes @0x%p\n", embeddedMemoryTransfer->EmbeddedMemoryCommand.Length, addressTarget );
 
-Exit:
-	;
-//    FUNCTION_LEAVE;
+	spin_lock_irqsave( &DeviceContext->SpinLockDmaRead, flags );
+
+	depth = DeviceContext->DmaReadHead - DeviceContext->DmaReadTail;
+	while (depth >= NUMBER_OF_DMA_READ_REQUEST)
+	{
+		DeviceContext->DmaReadFullWaits++;
+		spin_unlock_irqrestore( &DeviceContext->SpinLockDmaRead, flags );
+
+		flush_work( &DeviceContext->DmaReadWork );
+
+		spin_lock_irqsave( &DeviceContext->SpinLockDmaRead, flags );
+		depth = DeviceContext->DmaReadHead - DeviceContext->DmaReadTail;
+	}
+
+	memcpy( DeviceContext->DmaReadRequest[ DeviceContext->DmaReadHead & ( NUMBER_OF_DMA_READ_REQUEST - 1 ) ],
+			EmbeddedGenericHeader,
+			sizeof( EMBEDDED_MEMORY_TRANSFER ) );
+	DeviceContext->DmaReadHead++;
+	if (depth + 1 > DeviceContext->DmaReadHighWater)
+		DeviceContext->DmaReadHighWater = depth + 1;
+	queue_work( DeviceContext->DmaReadQueue, &DeviceContext->DmaReadWork );
+
+	spin_unlock_irqrestore( &DeviceContext->SpinLockDmaRead, flags );
 }
 
 void
@@ -147,10 +436,8 @@ MESSAGE_HandleMessage_EMBEDDED_REGISTER_READ_COMPLETION(
 
 	embeddedRegisterTransfer = ( PEMBEDDED_REGISTER_DATA_RESPONSE )EmbeddedGenericHeader;
 
-	DeviceContext->DataEmbeddedRegisterRead = embeddedRegisterTransfer->Data;
-
 	dev_dbg(dev_ctx_to_dev(DeviceContext), "Read 0x%0X from 0x%X\n",
-			DeviceContext->DataEmbeddedRegisterRead,
+			embeddedRegisterTransfer->Data,
 			embeddedRegisterTransfer->Dwords[1]);
 
 	if (EMBEDDED_HOST_MFINDEX_REG_ADDRESS == embeddedRegisterTransfer->Dwords[1]) {
@@ -175,9 +462,9 @@ MESSAGE_HandleMessage_EMBEDDED_REGISTER_READ_COMPLETION(
 		DeviceContext->last_uframe_cnt = embeddedRegisterTransfer->Data;
 	}
 
-
-	NOTIFICATION_Notify( DeviceContext,
-						 &DeviceContext->CompletionEventEmbeddedRegisterRead );
+	EMBEDDED_REGISTER_ReadComplete( DeviceContext,
+									embeddedRegisterTransfer->Dwords[1],
+									embeddedRegisterTransfer->Data );
 
 //    FUNCTION_LEAVE;
 }
@@ -189,7 +476,7 @@ MESSAGE_HandleMessage_EMBEDDED_MEMORY_WRITE_COMPLETION(
 	)
 {
 	PEMBEDDED_MEMORY_TRANSFER embeddedMemoryTransfer;
-	u8* addressTarget;
+	u64 addressTarget;
 	u8* addressSource;
 	int length;
 	int status;
@@ -197,27 +484,24 @@ MESSAGE_HandleMessage_EMBEDDED_MEMORY_WRITE_COMPLETION(
 	//FUNCTION_ENTRY;
 
 	embeddedMemoryTransfer = ( PEMBEDDED_MEMORY_TRANSFER )EmbeddedGenericHeader;
-	addressTarget = (u8*)trb_ptr_to_addr(embeddedMemoryTransfer->AddressLow,(u64)embeddedMemoryTransfer->AddressHigh );
+	addressTarget = trb_ptr_to_addr(embeddedMemoryTransfer->AddressLow,(u64)embeddedMemoryTransfer->AddressHigh );
 
 	length = embeddedMemoryTransfer->EmbeddedMemoryCommand.Length;
 
 	addressSource = ( u8* )embeddedMemoryTransfer + sizeof( EMBEDDED_MEMORY_TRANSFER );
 
-	if (((u64)addressTarget < EHUB_MIN_VALID_VADDR ) || (addressSource == NULL)) {
+	status = IOVA_Write(DeviceContext,
+						addressTarget,
+						addressSource,
+						length);
+	if (status < 0) {
 		dev_warn(dev_ctx_to_dev(DeviceContext),
-				 "WARNING: Mem Write Completion source=0x%p target=0x%p length=0x%X\n",
-				 addressSource, addressTarget, length);
+				 "WARNING: Mem Write Completion target=0x%llx length=0x%X failed %d\n",
+				 addressTarget, length, status);
 		return;
 	}
 
-	status = probe_kernel_write(addressTarget,
-								addressSource,
-								length);
-	if (status < 0) {
-		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR: probe_kernel_write returned %d\n", status);
-	}
-
-	dev_dbg(dev_ctx_to_dev(DeviceContext), "0x%0X bytes @0x%p\n", length, addressSource );
+	dev_dbg(dev_ctx_to_dev(DeviceContext), "0x%0X bytes @0x%llx\n", length, addressTarget );
 
 	//FUNCTION_LEAVE;
 }
@@ -239,8 +523,8 @@ MESSAGE_Handle(
 		}
 		case MESSAGE_TYPE_EMBEDDED_MEMORY_READ_COMPLETION:
 		{
-			MESSAGE_HandleMessage_EMBEDDED_MEMORY_READ_COMPLETION(DeviceContext,
-																  EmbeddedGenericHeader);
+			MESSAGE_QueueDmaRead(DeviceContext,
+								 EmbeddedGenericHeader);
 			break;
 		}
 		case MESSAGE_TYPE_EMBEDDED_EVENT_TRB:
@@ -313,6 +597,48 @@ MESSAGE_GetType(
 	*MessageLength = messageLength;
 }
 
+static bool
+MESSAGE_IsTransferEvent(
+	PEMBEDDED_GENERIC_HEADER EmbeddedGenericHeader,
+	int MessageType
+	)
+{
+	struct xhci_generic_trb *eventTrb;
+
+	if (MESSAGE_TYPE_EMBEDDED_EVENT_TRB != MessageType)
+		return false;
+
+	eventTrb = ( struct xhci_generic_trb * )( ( u8* )EmbeddedGenericHeader + sizeof( EMBEDDED_MEMORY_TRANSFER ) );
+
+	return ( le32_to_cpu( eventTrb->field[3] ) & TRB_TYPE_BITMASK ) == TRB_TYPE( TRB_TRANSFER );
+}
+
+/*
+ * Consecutive transfer events in a message buffer are handled as one xhci
+ * event batch, under one xhci->lock hold with the givebacks after it.  Any
+ * other message ends the batch first, so ordering is unchanged.
+ */
+static void
+MESSAGE_EventBatchUpdate(
+	PDEVICE_CONTEXT DeviceContext,
+	struct xhci_event_batch* Batch,
+	bool* Batching,
+	bool TransferEvent
+	)
+{
+	struct xhci_hcd* xhci = DeviceContext->UsbContext.xhci_hcd;
+
+	if (TransferEvent && DeviceContext->ControlFlags.IsEhubXhciInitReady) {
+		if (!*Batching) {
+			ehub_xhci_event_batch_begin( xhci, Batch );
+			*Batching = true;
+		}
+	} else if (*Batching) {
+		ehub_xhci_event_batch_end( xhci, Batch );
+		*Batching = false;
+	}
+}
+
 void
 MESSAGE_Parsing(
 	PDEVICE_CONTEXT DeviceContext,
@@ -325,6 +651,8 @@ MESSAGE_Parsing(
 	int messageType;
 	int messageLength;
 	int parsingLength;
+	struct xhci_event_batch batch;
+	bool batching = false;
 
 	messageType = MESSAGE_TYPE_UNKNOWN;
 	messageLength = 0;
@@ -355,55 +683,286 @@ MESSAGE_Parsing(
 			break;
 		}
 
+		MESSAGE_EventBatchUpdate( DeviceContext, &batch, &batching,
+								  MESSAGE_IsTransferEvent( embeddedGenericHeader, messageType ) );
+
 		MESSAGE_Handle( DeviceContext,
 						embeddedGenericHeader,
 						messageType );
 		parsingLength += roundup( messageLength, 4 );
 	} while (parsingLength < DataBufferLength );
+
+	MESSAGE_EventBatchUpdate( DeviceContext, &batch, &batching, false );
+}
+
+#ifdef USE_EVENT_FAST_PATH
+/*
+ * Transfer events only complete TDs and give back URBs, which never sleeps.
+ * Memory writes land IN data straight from the receive buffer into the
+ * mapped pages, as long as the whole payload is in this buffer.
+ */
+static bool
+MESSAGE_IsFastMessage(
+	PEMBEDDED_GENERIC_HEADER EmbeddedGenericHeader,
+	int MessageType,
+	int MessageLength,
+	int BufferRemaining
+	)
+{
+	if (MESSAGE_TYPE_EMBEDDED_MEMORY_WRITE_COMPLETION == MessageType)
+		return MessageLength <= BufferRemaining;
+
+	return MESSAGE_IsTransferEvent( EmbeddedGenericHeader, MessageType );
 }
+#endif /* USE_EVENT_FAST_PATH */
 
+/*
+ * Called from URB completion context.  Handle the transfer events and
+ * memory writes at the front of a received message buffer right away,
+ * unless older messages are still waiting on the WorkItemQueue.  Returns the offset of the first
+ * message that must be parsed from the WorkItemQueue, DataBufferLength if
+ * there is none; the caller must then queue the rest and it is counted in
+ * MessageDeferred until MESSAGE_ParsingDone.
+ */
 int
-MESSAGE_StartLoopBulk(
-	PDEVICE_CONTEXT DeviceContext
+MESSAGE_ParsingFast(
+	PDEVICE_CONTEXT DeviceContext,
+	u8* DataBuffer,
+	int DataBufferLength
 	)
 {
-	int indexOfMessage;
-	int status = 0;
-	PURB_CONTEXT urbContext;
+	int parsingLength = 0;
+#ifdef USE_EVENT_FAST_PATH
+	PEMBEDDED_GENERIC_HEADER embeddedGenericHeader;
+	int messageType;
+	int messageLength;
+	unsigned long flags;
+	struct xhci_event_batch batch;
+	bool batching = false;
 
-	FUNCTION_ENTRY;
+	spin_lock_irqsave( &DeviceContext->SpinLockMessageFast, flags );
 
-	for ( indexOfMessage = 0; indexOfMessage < NUMBER_OF_MESSAGE_BULK; indexOfMessage++ )
+	/* The handlers are not reentrant, so this also keeps the bulk,
+	 * interrupt and isoch completions from running them concurrently. */
+	if (DeviceContext->MessageDeferred == 0)
 	{
-		urbContext = URB_Create(DeviceContext,
-								DeviceContext->UsbContext.UsbDevice,
-								DeviceContext->UsbContext.UsbPipeBulkIn,
-								MESSAGE_DATA_BUFFER_SIZE_BULK,
-								URB_CompletionRoutine_GetMessage,
-								NULL,
-								GFP_KERNEL);
-		if ( NULL == urbContext )
+		do
 		{
-			status = -ENOMEM;
-			dev_err(dev_ctx_to_dev(DeviceContext), "ERROR URB_Create fail for Bulk! %d\n", status );
-			goto Exit;
+			embeddedGenericHeader = ( PEMBEDDED_GENERIC_HEADER )( DataBuffer + parsingLength );
+
+			if ( embeddedGenericHeader->Value == 0 )
+			{
+				parsingLength = DataBufferLength;
+				break;
+			}
+
+			MESSAGE_GetType( embeddedGenericHeader,
+							 &messageType,
+							 &messageLength );
+			if (!MESSAGE_IsFastMessage( embeddedGenericHeader, messageType, messageLength,
+										DataBufferLength - parsingLength ))
+				break;
+
+			if (DEVICECONTEXT_ErrorCheck( DeviceContext ) < 0)
+				break;
+
+			MESSAGE_EventBatchUpdate( DeviceContext, &batch, &batching,
+									  MESSAGE_IsTransferEvent( embeddedGenericHeader, messageType ) );
+
+			MESSAGE_Handle( DeviceContext,
+							embeddedGenericHeader,
+							messageType );
+			parsingLength += roundup( messageLength, 4 );
+		} while (parsingLength < DataBufferLength );
+
+		MESSAGE_EventBatchUpdate( DeviceContext, &batch, &batching, false );
+	}
+
+	if (parsingLength < DataBufferLength)
+		DeviceContext->MessageDeferred++;
+
+	spin_unlock_irqrestore( &DeviceContext->SpinLockMessageFast, flags );
+#endif /* USE_EVENT_FAST_PATH */
+
+	return parsingLength;
+}
+
+/* A message buffer queued after MESSAGE_ParsingFast has been parsed. */
+void
+MESSAGE_ParsingDone(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+#ifdef USE_EVENT_FAST_PATH
+	unsigned long flags;
+
+	spin_lock_irqsave( &DeviceContext->SpinLockMessageFast, flags );
+	DeviceContext->MessageDeferred--;
+	spin_unlock_irqrestore( &DeviceContext->SpinLockMessageFast, flags );
+#endif /* USE_EVENT_FAST_PATH */
+}
+
+/*
+ * Wait until no message IN buffer is queued for parsing.  The URBs must
+ * already be poisoned so parsing cannot resubmit them.
+ */
+static void
+MESSAGE_FlushParsing(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	if (DeviceContext->WorkItemQueue)
+		flush_workqueue(DeviceContext->WorkItemQueue);
+}
+
+/*
+ * Create the URB at Index of a message loop.  It starts out parked, MESSAGE_LoopUnpark submits it once the depth
+ * covers it.
+ */
+static PURB_CONTEXT
+MESSAGE_LoopCreateUrb(
+	PDEVICE_CONTEXT DeviceContext,
+	PMESSAGE_LOOP Loop,
+	int Index
+	)
+{
+	PURB_CONTEXT urbContext;
+
+	urbContext = URB_Create(DeviceContext,
+							DeviceContext->UsbContext.UsbDevice,
+							Loop->UsbPipe,
+							Loop->BufferSize,
+							URB_CompletionRoutine_GetMessage,
+							NULL,
+							GFP_KERNEL);
+	if ( NULL == urbContext )
+	{
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR URB_Create fail for %s!\n", Loop->Name );
+		return NULL;
+	}
+
+	URB_CreateMessageBuffer( urbContext, GFP_KERNEL );
+
+	urbContext->MessageLoop = Loop;
+	urbContext->MessageLoopIndex = Index;
+	urbContext->MessageLoopParked = true;
+
+	Loop->UrbContext[ Index ] = urbContext;
+	Loop->Created = Index + 1;
+
+	return urbContext;
+}
+
+/*
+ * Submit the parked URBs the loop's depth now covers.  One that fails to go
+ * out is parked again for the next resize to retry.
+ */
+static int
+MESSAGE_LoopUnpark(
+	PDEVICE_CONTEXT DeviceContext,
+	PMESSAGE_LOOP Loop
+	)
+{
+	PURB_CONTEXT unparked[ NUMBER_OF_MESSAGE_LOOP_MAX ];
+	PURB_CONTEXT urbContext;
+	unsigned long flags;
+	int count = 0;
+	int index;
+	int status = 0;
+
+	spin_lock_irqsave( &Loop->SpinLock, flags );
+	for (index = 0; index < min( Loop->Depth, Loop->Created ); index++) {
+		urbContext = Loop->UrbContext[ index ];
+		if (urbContext->MessageLoopParked) {
+			urbContext->MessageLoopParked = false;
+			unparked[ count++ ] = urbContext;
 		}
-		else
-		{
-			DeviceContext->UrbContextMessageBulk[ indexOfMessage ] = urbContext;
+	}
+	spin_unlock_irqrestore( &Loop->SpinLock, flags );
+
+	for (index = 0; index < count; index++) {
+		status = URB_SubmitMessage( unparked[ index ] );
+		if (status < 0) {
+			dev_err(dev_ctx_to_dev(DeviceContext), "ERROR URB_Submit fail for %s! %d\n", Loop->Name, status );
+			spin_lock_irqsave( &Loop->SpinLock, flags );
+			for (; index < count; index++)
+				unparked[ index ]->MessageLoopParked = true;
+			spin_unlock_irqrestore( &Loop->SpinLock, flags );
+			break;
 		}
+	}
 
-		status = URB_Submit( urbContext );
-		if (status < 0)
+	return status;
+}
+
+static int
+MESSAGE_LoopStart(
+	PDEVICE_CONTEXT DeviceContext,
+	PMESSAGE_LOOP Loop,
+	const char* Name,
+	unsigned int UsbPipe,
+	int BufferSize,
+	int Depth
+	)
+{
+	int indexOfMessage;
+	int status = 0;
+
+	down( &DeviceContext->MessageLoopLock );
+
+	Loop->Name = Name;
+	Loop->UsbPipe = UsbPipe;
+	Loop->BufferSize = BufferSize;
+	Loop->DepthMax = clamp_t( int, message_depth_max, 1, NUMBER_OF_MESSAGE_LOOP_MAX );
+	Loop->DepthMin = clamp_t( int, message_depth_min, 1, Loop->DepthMax );
+	Loop->Depth = clamp( Depth, Loop->DepthMin, Loop->DepthMax );
+	Loop->Created = 0;
+	Loop->InFlight = 0;
+	Loop->Completions = 0;
+	Loop->FullCompletions = 0;
+	Loop->Starved = 0;
+	Loop->Bytes = 0;
+	Loop->Utilization = 0;
+
+	for ( indexOfMessage = 0; indexOfMessage < Loop->Depth; indexOfMessage++ )
+	{
+		if ( NULL == MESSAGE_LoopCreateUrb( DeviceContext, Loop, indexOfMessage ) )
 		{
-			dev_err(dev_ctx_to_dev(DeviceContext), "ERROR URB_Submit fail! %d\n", status );
-			URB_Destroy( urbContext );
+			status = -ENOMEM;
 			goto Exit;
 		}
 	}
 
+	Loop->Running = true;
+
+	status = MESSAGE_LoopUnpark( DeviceContext, Loop );
+
+	schedule_delayed_work( &DeviceContext->MessageLoopTuneWork,
+						   msecs_to_jiffies( EHUB_MESSAGE_LOOP_TUNE_MS ) );
+
 Exit:
 
+	up( &DeviceContext->MessageLoopLock );
+
+	return status;
+}
+
+int
+MESSAGE_StartLoopBulk(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	int status;
+
+	FUNCTION_ENTRY;
+
+	status = MESSAGE_LoopStart( DeviceContext,
+								&DeviceContext->MessageLoopBulk,
+								"bulk",
+								DeviceContext->UsbContext.UsbPipeBulkIn,
+								MESSAGE_DATA_BUFFER_SIZE_BULK,
+								NUMBER_OF_MESSAGE_BULK );
+
 	FUNCTION_LEAVE;
 
 	return status;
@@ -414,47 +973,115 @@ MESSAGE_StartLoopInterrupt(
 	PDEVICE_CONTEXT DeviceContext
 	)
 {
-	int indexOfMessage;
-	int status = 0;
-	PURB_CONTEXT urbContext;
+	int status;
 
 	FUNCTION_ENTRY;
 
-	for ( indexOfMessage = 0; indexOfMessage < NUMBER_OF_MESSAGE_INTERRUPT; indexOfMessage++ )
-	{
-		urbContext = URB_Create(DeviceContext,
-								DeviceContext->UsbContext.UsbDevice,
+	status = MESSAGE_LoopStart( DeviceContext,
+								&DeviceContext->MessageLoopInterrupt,
+								"interrupt",
 								DeviceContext->UsbContext.UsbPipeInterruptIn,
 								MESSAGE_DATA_BUFFER_SIZE_INTERRUPT,
-								URB_CompletionRoutine_GetMessage,
-								NULL,
-								GFP_KERNEL);
-		if ( NULL == urbContext )
-		{
-			status = -ENOMEM;
-			dev_err(dev_ctx_to_dev(DeviceContext), "ERROR URB_Create fail for Interrupt! %d\n", status );
-			goto Exit;
-		}
-		else
-		{
-			DeviceContext->UrbContextMessageInterrupt[ indexOfMessage ] = urbContext;
-		}
+								NUMBER_OF_MESSAGE_INTERRUPT );
 
-		dev_dbg(dev_ctx_to_dev(DeviceContext), "urbContext=0x%p\n", urbContext );
+	FUNCTION_LEAVE;
 
-		status = URB_Submit( urbContext );
-		if ( status < 0 ) {
-			dev_err(dev_ctx_to_dev(DeviceContext), "ERROR URB_Submit fail! %d\n", status );
-			URB_Destroy( urbContext );
-			goto Exit;
+	return status;
+}
+
+/*
+ * Resize one message loop from what its last interval saw.  Starvation or
+ * mostly full transfers add URBs; a loop filling less than a quarter of what
+ * it posts gives URBs back.  URBs past a shrunk depth park as they complete.
+ * The transfer size is not adapted, see MESSAGE_LOOP.
+ *
+ * MUST be called with MessageLoopLock held!
+ */
+static void
+MESSAGE_LoopResize(
+	PDEVICE_CONTEXT DeviceContext,
+	PMESSAGE_LOOP Loop
+	)
+{
+	u32 completions, full, starved;
+	u64 bytes;
+	int depth;
+	int index;
+	unsigned long flags;
+
+	if (!Loop->Running)
+		return;
+
+	spin_lock_irqsave( &Loop->SpinLock, flags );
+	completions = Loop->Completions;
+	full = Loop->FullCompletions;
+	starved = Loop->Starved;
+	bytes = Loop->Bytes;
+	Loop->Completions = 0;
+	Loop->FullCompletions = 0;
+	Loop->Starved = 0;
+	Loop->Bytes = 0;
+	depth = Loop->Depth;
+	spin_unlock_irqrestore( &Loop->SpinLock, flags );
+
+	/* An idle loop keeps its shape for the next burst. */
+	if (0 == completions)
+		return;
+
+	Loop->Utilization = div64_u64( bytes * 100, ( u64 )completions * Loop->BufferSize );
+	Loop->StarvedTotal += starved;
+
+	if (starved || full * 2 > completions) {
+		if (depth < Loop->DepthMax)
+			depth = min( depth * 2, Loop->DepthMax );
+	} else if (Loop->Utilization < 25) {
+		if (depth > Loop->DepthMin)
+			depth--;
+	}
+
+	if (depth == Loop->Depth)
+		return;
+
+	for (index = Loop->Created; index < depth; index++) {
+		if (NULL == MESSAGE_LoopCreateUrb( DeviceContext, Loop, index )) {
+			depth = index;
+			break;
 		}
 	}
 
-Exit:
+	spin_lock_irqsave( &Loop->SpinLock, flags );
+	Loop->Depth = depth;
+	spin_unlock_irqrestore( &Loop->SpinLock, flags );
 
-	FUNCTION_LEAVE;
+	Loop->Resized++;
 
-	return status;
+	dev_dbg(dev_ctx_to_dev(DeviceContext), "%s message loop depth %d utilization %u%% starved %u\n",
+			Loop->Name, depth, Loop->Utilization, starved);
+
+	MESSAGE_LoopUnpark( DeviceContext, Loop );
+}
+
+void
+MESSAGE_LoopTune(
+	struct work_struct* WorkItem
+	)
+{
+	PDEVICE_CONTEXT deviceContext;
+
+	deviceContext = container_of( to_delayed_work( WorkItem ), DEVICE_CONTEXT, MessageLoopTuneWork );
+
+	down( &deviceContext->MessageLoopLock );
+
+	if (DEVICECONTEXT_ErrorCheck( deviceContext ) >= 0) {
+		MESSAGE_LoopResize( deviceContext, &deviceContext->MessageLoopBulk );
+		MESSAGE_LoopResize( deviceContext, &deviceContext->MessageLoopInterrupt );
+
+		if (deviceContext->MessageLoopBulk.Running || deviceContext->MessageLoopInterrupt.Running)
+			schedule_delayed_work( &deviceContext->MessageLoopTuneWork,
+								   msecs_to_jiffies( EHUB_MESSAGE_LOOP_TUNE_MS ) );
+	}
+
+	up( &deviceContext->MessageLoopLock );
 }
 
 #ifdef EHUB_ISOCH_ENABLE
@@ -485,6 +1112,7 @@ MESSAGE_InitLoopIsoch(
 			goto Exit;
 		} else {
 			DeviceContext->UrbContextMessageIsoch[indexOfMessage] = urbContext;
+			URB_CreateMessageBuffer(urbContext, GFP_KERNEL);
 		}
 
 		dev_dbg(dev_ctx_to_dev(DeviceContext), "urbContext=0x%p\n", urbContext);
@@ -528,6 +1156,7 @@ MESSAGE_StartLoopIsoch(
 
 		dev_dbg(dev_ctx_to_dev(DeviceContext), "StartIsoch idx=%d urbContext=0x%p\n",indexOfMessage, urbContext);
 
+		usb_unpoison_urb(urbContext->Urb);
 		status = URB_Submit(urbContext);
 		if (status < 0) {
 			dev_err(dev_ctx_to_dev(DeviceContext), "ERROR URB_Submit fail! %d\n", status);
@@ -547,20 +1176,26 @@ Exit:
 }
 #endif /* EHUB_ISOCH_ENABLE */
 
-void
-MESSAGE_StopLoopBulk(
-	PDEVICE_CONTEXT DeviceContext
+static void
+MESSAGE_LoopStop(
+	PDEVICE_CONTEXT DeviceContext,
+	PMESSAGE_LOOP Loop
 	)
 {
 	int indexOfMessage;
 	PURB_CONTEXT urbContext;
 
-	FUNCTION_ENTRY;
+	down( &DeviceContext->MessageLoopLock );
+	Loop->Running = false;
+	up( &DeviceContext->MessageLoopLock );
+
+	if (!DeviceContext->MessageLoopBulk.Running && !DeviceContext->MessageLoopInterrupt.Running)
+		cancel_delayed_work_sync( &DeviceContext->MessageLoopTuneWork );
 
-	for ( indexOfMessage = 0; indexOfMessage < NUMBER_OF_MESSAGE_BULK; indexOfMessage++ )
+	for ( indexOfMessage = 0; indexOfMessage < Loop->Created; indexOfMessage++ )
 	{
-		urbContext = DeviceContext->UrbContextMessageBulk[ indexOfMessage ];
-		DeviceContext->UrbContextMessageBulk[indexOfMessage] = NULL;
+		urbContext = Loop->UrbContext[ indexOfMessage ];
+		Loop->UrbContext[ indexOfMessage ] = NULL;
 
 		dev_dbg(dev_ctx_to_dev(DeviceContext), "urbContext=0x%p\n", urbContext);
 
@@ -568,11 +1203,31 @@ MESSAGE_StopLoopBulk(
 		{
 			NOTIFICATION_Notify( DeviceContext,
 								 &urbContext->Event );
-			usb_kill_urb( urbContext->Urb );
+			urbContext->Status = URB_STATUS_COMPLETE;
+			usb_poison_urb( urbContext->Urb );
+			MESSAGE_FlushParsing( DeviceContext );
+			WORK_ITEM_CancelMessage( DeviceContext, urbContext );
 			URB_Destroy( urbContext );
 		}
 	}
 
+	if (Loop->Created)
+		dev_dbg(dev_ctx_to_dev(DeviceContext), "%s message loop depth %d of %d, buffer %d, starved %u, resized %u\n",
+				Loop->Name, Loop->Depth, Loop->Created, Loop->BufferSize,
+				Loop->StarvedTotal, Loop->Resized);
+
+	Loop->Created = 0;
+}
+
+void
+MESSAGE_StopLoopBulk(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	FUNCTION_ENTRY;
+
+	MESSAGE_LoopStop( DeviceContext, &DeviceContext->MessageLoopBulk );
+
 	FUNCTION_LEAVE;
 }
 
@@ -581,22 +1236,7 @@ MESSAGE_StopLoopInterrupt(
 	PDEVICE_CONTEXT DeviceContext
 	)
 {
-	int indexOfMessage;
-	PURB_CONTEXT urbContext;
-
-	for ( indexOfMessage = 0; indexOfMessage < NUMBER_OF_MESSAGE_INTERRUPT; indexOfMessage++ )
-	{
-		urbContext = DeviceContext->UrbContextMessageInterrupt[ indexOfMessage ];
-		DeviceContext->UrbContextMessageInterrupt[indexOfMessage] = NULL;
-		if ( NULL != urbContext )
-		{
-			NOTIFICATION_Notify( DeviceContext,
-								 &urbContext->Event );
-			urbContext->Status = URB_STATUS_COMPLETE;
-			usb_kill_urb( urbContext->Urb );
-			URB_Destroy( urbContext );
-		}
-	}
+	MESSAGE_LoopStop( DeviceContext, &DeviceContext->MessageLoopInterrupt );
 }
 
 #ifdef EHUB_ISOCH_ENABLE
@@ -620,9 +1260,16 @@ for (indexOfMessage = 0; indexOfMessage < NUMBER_OF_MESSAGE_ISOCH; indexOfMessag
 			NOTIFICATION_Notify(DeviceContext,
 								&urbContext->Event);
 			urbContext->Status = URB_STATUS_COMPLETE;
-			usb_kill_urb(urbContext->Urb);
+			usb_poison_urb(urbContext->Urb);
 		}
 	}
+	/* A buffer still being parsed would resubmit its URB afterwards. */
+	MESSAGE_FlushParsing(DeviceContext);
+	for (indexOfMessage = 0; indexOfMessage < NUMBER_OF_MESSAGE_ISOCH; indexOfMessage++) {
+		urbContext = DeviceContext->UrbContextMessageIsoch[indexOfMessage];
+		if (NULL != urbContext)
+			WORK_ITEM_CancelMessage(DeviceContext, urbContext);
+	}
 	dev_info(dev_ctx_to_dev(DeviceContext), "MESSAGE_StopLoopIsoch clear isoch_in_running false\n");
 	dev_ctx_to_xhci(DeviceContext)->isoch_in_running = false;
 }
@@ -678,3 +1325,71 @@ MESSAGE_FreeLoopIsoch(
 	}
 }
 #endif /* EHUB_ISOCH_ENABLE */
+
+/*
+ * Export the shape of the message loops under message_loop/ on the
+ * interface.  Utilization is the fill ratio of the last interval in percent.
+ */
+#define MESSAGE_LOOP_ATTR( _name_, _loop_, _field_ )								\
+static ssize_t																		\
+_name_##_show( struct device* dev, struct device_attribute* attr, char* buf )		\
+{																					\
+	PDEVICE_CONTEXT deviceContext = usb_get_intfdata( to_usb_interface( dev ) );	\
+																					\
+	return sprintf( buf, "%u\n", ( unsigned int )deviceContext->_loop_._field_ );	\
+}																					\
+static struct device_attribute dev_attr_##_name_ =									\
+	__ATTR( _name_, 0444, _name_##_show, NULL )
+
+MESSAGE_LOOP_ATTR( bulk_depth, MessageLoopBulk, Depth );
+MESSAGE_LOOP_ATTR( bulk_buffer_size, MessageLoopBulk, BufferSize );
+MESSAGE_LOOP_ATTR( bulk_utilization, MessageLoopBulk, Utilization );
+MESSAGE_LOOP_ATTR( bulk_starved, MessageLoopBulk, StarvedTotal );
+MESSAGE_LOOP_ATTR( interrupt_depth, MessageLoopInterrupt, Depth );
+MESSAGE_LOOP_ATTR( interrupt_buffer_size, MessageLoopInterrupt, BufferSize );
+MESSAGE_LOOP_ATTR( interrupt_utilization, MessageLoopInterrupt, Utilization );
+MESSAGE_LOOP_ATTR( interrupt_starved, MessageLoopInterrupt, StarvedTotal );
+
+static struct attribute* message_loop_attrs[] = {
+	&dev_attr_bulk_depth.attr,
+	&dev_attr_bulk_buffer_size.attr,
+	&dev_attr_bulk_utilization.attr,
+	&dev_attr_bulk_starved.attr,
+	&dev_attr_interrupt_depth.attr,
+	&dev_attr_interrupt_buffer_size.attr,
+	&dev_attr_interrupt_utilization.attr,
+	&dev_attr_interrupt_starved.attr,
+	NULL,
+};
+
+static const struct attribute_group message_loop_group = {
+	.name = "message_loop",
+	.attrs = message_loop_attrs,
+};
+
+int
+MESSAGE_LoopSysfsCreate(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	int status;
+
+	status = sysfs_create_group( &DeviceContext->InterfaceBackup->dev.kobj,
+								 &message_loop_group );
+	DeviceContext->MessageLoopSysfsCreated = (status == 0);
+
+	return status;
+}
+
+void
+MESSAGE_LoopSysfsRemove(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	if (!DeviceContext->MessageLoopSysfsCreated)
+		return;
+
+	sysfs_remove_group( &DeviceContext->InterfaceBackup->dev.kobj,
+						&message_loop_group );
+	DeviceContext->MessageLoopSysfsCreated = false;
+}
@@ -49,6 +49,35 @@ MESSAGE_Parsing(
 	int DataBufferLength
 	);
 
+PURB_CONTEXT
+MESSAGE_ReadResponseCreate(
+	PDEVICE_CONTEXT DeviceContext,
+	gfp_t flags
+	);
+
+void
+MESSAGE_ReadResponsePut(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext
+	);
+
+void
+MESSAGE_DmaReadProcess(
+	struct work_struct* WorkItem
+	);
+
+int
+MESSAGE_ParsingFast(
+	PDEVICE_CONTEXT DeviceContext,
+	u8* DataBuffer,
+	int DataBufferLength
+	);
+
+void
+MESSAGE_ParsingDone(
+	PDEVICE_CONTEXT DeviceContext
+	);
+
 int
 MESSAGE_StartLoopBulk(
 	PDEVICE_CONTEXT DeviceContext
@@ -102,4 +131,19 @@ MESSAGE_StopLoopInterrupt(
 	PDEVICE_CONTEXT DeviceContext
 	);
 
+void
+MESSAGE_LoopTune(
+	struct work_struct* WorkItem
+	);
+
+int
+MESSAGE_LoopSysfsCreate(
+	PDEVICE_CONTEXT DeviceContext
+	);
+
+void
+MESSAGE_LoopSysfsRemove(
+	PDEVICE_CONTEXT DeviceContext
+	);
+
 #endif
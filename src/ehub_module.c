@@ -23,6 +23,7 @@
 #include <linux/types.h>
 #include <linux/slab.h>
 #include <linux/pm.h>
+#include <linux/log2.h>
 
 #include "ehub_defines.h"
 
@@ -95,39 +96,41 @@ static int ehub_xhci_set_configuration(struct usb_device *udev, int configuratio
 }
 
 /**
- * ehub_xhci_cache_work_expand - add new entries to the cache work queue.
- * @xhci: xhci structure
- * @entries: number of entries to add
+ * ehub_xhci_doorbell_ring_create - preallocate the doorbell URB ring.
+ * @DeviceContext: device context
  *
- * Create new cache work entries and add
- * them to xhci->cache_wq_list_free.
- *
- * MUST be called with SpinLockEmbeddedDoorbellWrite held!
+ * Create NUMBER_OF_MESSAGE_DOORBELL doorbell URBs and place them all
+ * in the free ring.  The ring never grows afterwards.
  */
-int
-ehub_xhci_doorbell_expand(
-	PDEVICE_CONTEXT DeviceContext,
-	ulong entries,
-	gfp_t flags
+static int
+ehub_xhci_doorbell_ring_create(
+	PDEVICE_CONTEXT DeviceContext
 )
 {
 	int index = 0;
 	PURB_CONTEXT urbContext;
 
-	dev_dbg(dev_ctx_to_dev(DeviceContext), "expand doorbell entries: %lu\n", entries);
-	for (index = 0; index < entries; index++) {
+	BUILD_BUG_ON(!is_power_of_2(NUMBER_OF_MESSAGE_DOORBELL));
+	BUILD_BUG_ON(NUMBER_OF_DOORBELL_STAGED < MAX_HC_SLOTS * 32);
+
+	for (index = 0; index < NUMBER_OF_MESSAGE_DOORBELL; index++) {
 		urbContext = URB_Create(DeviceContext,
 								DeviceContext->UsbContext.UsbDevice,
 								DeviceContext->UsbContext.UsbPipeDoorbellOut,
-								sizeof(EMBEDDED_REGISTER_DATA_TRANSFER),
+								sizeof(EMBEDDED_REGISTER_DATA_TRANSFER) * NUMBER_OF_DOORBELL_COALESCE,
 								URB_CompletionRoutine_Doorbell,
 								NULL,
-								flags);
+								GFP_KERNEL);
 		if (NULL == urbContext)
 			break;
-		list_add_tail(&urbContext->list, &DeviceContext->doorbell_list_free);
+		DeviceContext->DoorbellUrb[ index ] = urbContext;
+		DeviceContext->DoorbellRing[ index ] = urbContext;
 	}
 
+	atomic_set(&DeviceContext->DoorbellRingHead, index);
+	atomic_set(&DeviceContext->DoorbellRingTail, 0);
+	atomic_set(&DeviceContext->DoorbellInFlight, 0);
+
 	return index;
 }
 
@@ -252,30 +255,30 @@ MODULE_UsbInterfaceConnect(
 	dev_dbg(&interface->dev, "UsbPipeCacheOut     : 0x%X \n", deviceContext->UsbContext.UsbPipeCacheOut);
 	dev_dbg(&interface->dev, "UsbPipeDoorbellOut  : 0x%X \n", deviceContext->UsbContext.UsbPipeDoorbellOut);
 
-	/* Set endpoint used for cache writes here. */
-	deviceContext->UsbContext.UsbPipeCacheOut = deviceContext->UsbContext.UsbPipeInterruptOut;
-	//deviceContext->UsbContext.UsbPipeCacheOut = deviceContext->UsbContext.UsbPipeBulkOut;
-
-	/* Set endpoint used for doorbell writes here. */
-	deviceContext->UsbContext.UsbPipeDoorbellOut = deviceContext->UsbContext.UsbPipeInterruptOut;
-	//deviceContext->UsbContext.UsbPipeDoorbellOut = deviceContext->UsbContext.UsbPipeBulkOut;
+	/* Cache writes and doorbells start out on interrupt OUT; the transport
+	 * is chosen once both interfaces are up, see USB_OutTransportConnect. */
+	USB_OutTransportSet( deviceContext, EHUB_OUT_TRANSPORT_INTERRUPT );
 
 	// URB_CONTEXT for dedicate embedded register read/write/cache write.
+	// One read URB per tag so reads can be pipelined.
 	//
-	urbContext = URB_Create(deviceContext,
-							deviceContext->UsbContext.UsbDevice,
-							deviceContext->UsbContext.UsbPipeBulkOut,
-							sizeof(EMBEDDED_REGISTER_DATA_TRANSFER),
-							URB_CompletionRoutine_Simple,
-							NULL,
-							GFP_KERNEL);
-	ASSERT( NULL != urbContext );
-	deviceContext->UrbContextEmbeddedRegisterRead = urbContext;
+	for ( indexOfUrbContext = 0; indexOfUrbContext < NUMBER_OF_EMBEDDED_REGISTER_READ; indexOfUrbContext++ )
+	{
+		urbContext = URB_Create(deviceContext,
+								deviceContext->UsbContext.UsbDevice,
+								deviceContext->UsbContext.UsbPipeBulkOut,
+								sizeof(EMBEDDED_REGISTER_DATA_TRANSFER),
+								URB_CompletionRoutine_RegisterRead,
+								NULL,
+								GFP_KERNEL);
+		ASSERT( NULL != urbContext );
+		deviceContext->EmbeddedRegisterRead[ indexOfUrbContext ].UrbContext = urbContext;
+	}
 
 	urbContext = URB_Create(deviceContext,
 							deviceContext->UsbContext.UsbDevice,
 							deviceContext->UsbContext.UsbPipeBulkOut,
-							sizeof(EMBEDDED_REGISTER_DATA_TRANSFER),
+							sizeof(EMBEDDED_REGISTER_DATA_TRANSFER) * NUMBER_OF_EMBEDDED_REGISTER_WRITE_BATCH,
 							URB_CompletionRoutine_Simple,
 							NULL,
 							GFP_KERNEL);
@@ -284,26 +287,18 @@ MODULE_UsbInterfaceConnect(
 
 	dataBufferLength = sizeof( EMBEDDED_REGISTER_DATA_TRANSFER );
 
-	ehub_xhci_doorbell_expand(deviceContext, NUMBER_OF_MESSAGE_DOORBELL, GFP_KERNEL);
+	indexOfUrbContext = ehub_xhci_doorbell_ring_create(deviceContext);
+	ASSERT( NUMBER_OF_MESSAGE_DOORBELL == indexOfUrbContext );
 
 	// Default index is zero.
 	//
-	dataBufferLength = MESSAGE_DATA_BUFFER_SIZE_BULK;
-	for ( indexOfUrbContext = 0; indexOfUrbContext < NUMBER_OF_MESSAGE_BULK; indexOfUrbContext++ )
+	for ( indexOfUrbContext = 0; indexOfUrbContext < NUMBER_OF_MEMORY_READ_RESPONSE; indexOfUrbContext++ )
 	{
-		urbContext = URB_Create(deviceContext,
-								deviceContext->UsbContext.UsbDevice,
-								deviceContext->UsbContext.UsbPipeBulkOut,
-								dataBufferLength,
-								URB_CompletionRoutine_Simple,
-								NULL,
-								GFP_KERNEL);
+		urbContext = MESSAGE_ReadResponseCreate(deviceContext, GFP_KERNEL);
 		ASSERT( NULL != urbContext );
-		deviceContext->UrbContextEmbeddedMemoryReadCompletion[ indexOfUrbContext ] = urbContext;
+		if (urbContext)
+			MESSAGE_ReadResponsePut(deviceContext, urbContext);
 	}
-	// Default index is zero.
-	//
-	deviceContext->CurrentEmbeddedMemoryReadCompletionUrbContextIndex = 0;
 
 	status = USB_InterfaceCreateBulk( deviceContext );
 	if (status < 0) {
@@ -325,6 +320,9 @@ MODULE_UsbInterfaceConnect(
 		dev_info(dev_ctx_to_dev(deviceContext), "USB_InterfaceCreateInterrupt success.\n" );
 	}
 
+	/* A failed probe leaves the interrupt transport in place. */
+	USB_OutTransportConnect( deviceContext );
+
 	// Add embedded host driver.
 	//
 	status = ehub_xhci_add( deviceContext );
@@ -347,6 +345,12 @@ MODULE_UsbInterfaceConnect(
 	}
 #endif /* EHUB_ISOCH_ENABLE */
 
+	if (MESSAGE_LoopSysfsCreate( deviceContext ) < 0)
+		dev_warn(dev_ctx_to_dev(deviceContext), "WARNING message loop attributes not created\n");
+
+	if (USB_OutTransportSysfsCreate( deviceContext ) < 0)
+		dev_warn(dev_ctx_to_dev(deviceContext), "WARNING out_transport attribute not created\n");
+
 	dev_dbg(&interface->dev, "\n");
 
 Exit:
@@ -370,7 +374,6 @@ MODULE_UsbInterfaceDisconnect(
 	int interfaceProtocol;
 	PDEVICE_CONTEXT deviceContext;
 	int indexOfUrbContext;
-	URB_CONTEXT *q, *urbContext;
 	struct device *dev;
 	struct usb_hcd  *hcd;
 
@@ -401,6 +404,9 @@ MODULE_UsbInterfaceDisconnect(
 	dev = &deviceContext->UsbContext.UsbDevice->dev;
 	hcd = dev_get_drvdata(dev);
 
+	MESSAGE_LoopSysfsRemove( deviceContext );
+	USB_OutTransportSysfsRemove( deviceContext );
+
 	usb_hc_died(hcd);
 
 	if (deviceContext->InterfaceBackup->condition != USB_INTERFACE_UNBINDING) {
@@ -414,6 +420,18 @@ MODULE_UsbInterfaceDisconnect(
 		deviceContext->WorkItemQueue = NULL;
 	}
 
+	/* The WorkItemQueue feeds the DMA read lane, so it goes second. */
+	if (deviceContext->DmaReadQueue) {
+		destroy_workqueue(deviceContext->DmaReadQueue);
+		deviceContext->DmaReadQueue = NULL;
+	}
+
+	dev_dbg(dev_ctx_to_dev(deviceContext), "DMA read lane high water %u, waits for a full lane %u\n",
+			deviceContext->DmaReadHighWater, deviceContext->DmaReadFullWaits);
+
+	/* No more read completions can arrive, fail the async ones. */
+	EMBEDDED_REGISTER_ReadAbort( deviceContext );
+
 #ifdef EHUB_ISOCH_ENABLE
 	status = USB_InterfaceDestroyIsoch(deviceContext);
 	if (status < 0) {
@@ -473,25 +491,26 @@ MODULE_UsbInterfaceDisconnect(
 
 Cleanup:
 
-	list_for_each_entry_safe(urbContext, q, &deviceContext->doorbell_list_busy, list)
-	{
-		if (NULL != urbContext) {
-			list_del_init(&urbContext->list);
-			if (NULL != urbContext)
-				URB_Destroy(urbContext);
-		}
-	}
+	dev_dbg(dev_ctx_to_dev(deviceContext), "doorbell ring high water %u stalls %u\n",
+			deviceContext->DoorbellRingHighWater,
+			deviceContext->DoorbellRingStalls);
 
-	list_for_each_entry_safe(urbContext, q, &deviceContext->doorbell_list_free, list)
+	for ( indexOfUrbContext = 0; indexOfUrbContext < NUMBER_OF_MESSAGE_DOORBELL; indexOfUrbContext++ )
 	{
-		if (NULL != urbContext) {
-			list_del_init(&urbContext->list);
-			if (NULL != urbContext)
-				URB_Destroy(urbContext);
+		if ( NULL != deviceContext->DoorbellUrb[ indexOfUrbContext ] )
+		{
+			URB_Destroy( deviceContext->DoorbellUrb[ indexOfUrbContext ] );
+			deviceContext->DoorbellUrb[ indexOfUrbContext ] = NULL;
+			deviceContext->DoorbellRing[ indexOfUrbContext ] = NULL;
 		}
 	}
 
-	for ( indexOfUrbContext = 0; indexOfUrbContext < NUMBER_OF_MESSAGE_BULK; indexOfUrbContext++ )
+	dev_dbg(dev_ctx_to_dev(deviceContext), "memory read responses: %d URBs, stalls %u, coalesced %u\n",
+			deviceContext->NumberOfEmbeddedMemoryReadCompletion,
+			deviceContext->EmbeddedMemoryReadCompletionStalls,
+			deviceContext->EmbeddedMemoryReadCompletionCoalesced);
+
+	for ( indexOfUrbContext = 0; indexOfUrbContext < NUMBER_OF_MEMORY_READ_RESPONSE_MAX; indexOfUrbContext++ )
 	{
 		if ( NULL != deviceContext->UrbContextEmbeddedMemoryReadCompletion[ indexOfUrbContext ] )
 		{
@@ -500,10 +519,13 @@ Cleanup:
 		}
 	}
 
-	if ( NULL != deviceContext->UrbContextEmbeddedRegisterRead )
+	for ( indexOfUrbContext = 0; indexOfUrbContext < NUMBER_OF_EMBEDDED_REGISTER_READ; indexOfUrbContext++ )
 	{
-		URB_Destroy( deviceContext->UrbContextEmbeddedRegisterRead );
-		deviceContext->UrbContextEmbeddedRegisterRead = NULL;
+		if ( NULL != deviceContext->EmbeddedRegisterRead[ indexOfUrbContext ].UrbContext )
+		{
+			URB_Destroy( deviceContext->EmbeddedRegisterRead[ indexOfUrbContext ].UrbContext );
+			deviceContext->EmbeddedRegisterRead[ indexOfUrbContext ].UrbContext = NULL;
+		}
 	}
 
 	if ( NULL != deviceContext->UrbContextEmbeddedRegisterWrite )
@@ -24,11 +24,4 @@
 #define STRING_MODULE_LICENSE       "GPL"
 #define STRING_MODULE_DESCRIPTION   "Fresco Logic eHub device driver - Version 0.6.0.0"
 #define STRING_MODULE_AUTHOR        "Fresco Logic"
-
-int
-ehub_xhci_doorbell_expand(
-	PDEVICE_CONTEXT DeviceContext,
-	ulong entries,
-	gfp_t flags
-);
 #endif
@@ -47,6 +47,7 @@
 //
 #include "ehub_embedded_register.h"
 #include "ehub_embedded_cache.h"
+#include "ehub_iova.h"
 #include "ehub_message.h"
 #include "ehub_module.h"
 #include "ehub_notification.h"
@@ -29,6 +29,8 @@
 #include "ehub_utility.h"
 #include "ehub_notification.h"
 #include "ehub_work_item.h"
+#include "ehub_message.h"
+#include "ehub_usb.h"
 #include "xhci.h"
 
 PURB_CONTEXT
@@ -228,6 +230,167 @@ Exit:
 	return urbContext;
 }
 
+static void
+URB_MessageBufferProcess(
+	struct work_struct* WorkItem
+	);
+
+/*
+ * Give a message IN URB a second receive buffer so received messages can be
+ * parsed in place.  Without it URB_CompletionRoutine_GetMessage copies each
+ * message into a work item instead.
+ */
+int
+URB_CreateMessageBuffer(
+	PURB_CONTEXT UrbContext,
+	gfp_t flags
+)
+{
+	int index;
+
+	UrbContext->MessageBuffer[ 1 ].DataBuffer = usb_alloc_coherent(UrbContext->Dev,
+																	UrbContext->DataBufferLength,
+																	flags,
+																	&UrbContext->MessageBuffer[ 1 ].DataBufferDma);
+	if (NULL == UrbContext->MessageBuffer[ 1 ].DataBuffer) {
+		dev_warn(dev_ctx_to_dev(UrbContext->DeviceContextPvoid), "WARNING no spare message buffer, copying messages\n");
+		return -ENOMEM;
+	}
+
+	UrbContext->MessageBuffer[ 0 ].DataBuffer = UrbContext->DataBuffer;
+	UrbContext->MessageBuffer[ 0 ].DataBufferDma = UrbContext->DataBufferDma;
+
+	for (index = 0; index < 2; index++) {
+		INIT_WORK(&UrbContext->MessageBuffer[ index ].WorkItem, URB_MessageBufferProcess);
+		UrbContext->MessageBuffer[ index ].UrbContext = UrbContext;
+	}
+
+	UrbContext->MessageBufferInUrb = 0;
+	UrbContext->MessageBufferSpareFree = true;
+	UrbContext->MessageBufferHeld = false;
+
+	return 0;
+}
+
+/*
+ * Put the spare buffer on the URB.
+ *
+ * MUST be called with SpinLockMessageBuffer held!
+ */
+static void
+URB_MessageBufferSwap(
+	PURB_CONTEXT UrbContext
+)
+{
+	PMESSAGE_BUFFER messageBuffer;
+
+	UrbContext->MessageBufferSpareFree = false;
+	UrbContext->MessageBufferInUrb ^= 1;
+
+	messageBuffer = &UrbContext->MessageBuffer[ UrbContext->MessageBufferInUrb ];
+	UrbContext->Urb->transfer_buffer = messageBuffer->DataBuffer;
+	UrbContext->Urb->transfer_dma = messageBuffer->DataBufferDma;
+}
+
+/*
+ * Queue the buffer the URB just filled for parsing.  Returns true if the URB
+ * may be resubmitted now, on the spare buffer; otherwise it is held until a
+ * buffer has been parsed.
+ */
+static bool
+URB_MessageBufferQueue(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext,
+	int DataOffset,
+	int DataLength,
+	bool Resubmit
+)
+{
+	PMESSAGE_BUFFER messageBuffer;
+	unsigned long flags;
+
+	spin_lock_irqsave(&DeviceContext->SpinLockMessageBuffer, flags);
+
+	messageBuffer = &UrbContext->MessageBuffer[ UrbContext->MessageBufferInUrb ];
+	messageBuffer->DataOffset = DataOffset;
+	messageBuffer->DataLength = DataLength;
+	queue_work(DeviceContext->WorkItemQueue, &messageBuffer->WorkItem);
+
+	if (UrbContext->MessageBufferSpareFree)
+		URB_MessageBufferSwap(UrbContext);
+	else if (Resubmit) {
+		UrbContext->MessageBufferHeld = true;
+		Resubmit = false;
+	}
+
+	spin_unlock_irqrestore(&DeviceContext->SpinLockMessageBuffer, flags);
+
+	return Resubmit;
+}
+
+static void
+URB_MessageBufferProcess(
+	struct work_struct* WorkItem
+)
+{
+	PMESSAGE_BUFFER messageBuffer;
+	PURB_CONTEXT urbContext;
+	PDEVICE_CONTEXT deviceContext;
+	unsigned long flags;
+	bool resubmit = false;
+
+	messageBuffer = container_of(WorkItem, MESSAGE_BUFFER, WorkItem);
+	urbContext = messageBuffer->UrbContext;
+	deviceContext = ( PDEVICE_CONTEXT )urbContext->DeviceContextPvoid;
+
+	MESSAGE_Parsing(deviceContext,
+					messageBuffer->DataBuffer + messageBuffer->DataOffset,
+					messageBuffer->DataLength - messageBuffer->DataOffset);
+	MESSAGE_ParsingDone(deviceContext);
+
+	spin_lock_irqsave(&deviceContext->SpinLockMessageBuffer, flags);
+
+	if (messageBuffer != &urbContext->MessageBuffer[ urbContext->MessageBufferInUrb ]) {
+		urbContext->MessageBufferSpareFree = true;
+		if (urbContext->MessageBufferHeld)
+			URB_MessageBufferSwap(urbContext);
+	}
+
+	if (urbContext->MessageBufferHeld) {
+		urbContext->MessageBufferHeld = false;
+		resubmit = true;
+	}
+
+	spin_unlock_irqrestore(&deviceContext->SpinLockMessageBuffer, flags);
+
+	if (resubmit && DEVICECONTEXT_ErrorCheck(deviceContext) >= 0)
+		URB_SubmitMessage(urbContext);
+}
+
+/*
+ * Pack the received isoch packets together at the start of the buffer so
+ * they can be processed as one big transfer.  Returns the packed length.
+ */
+static int
+URB_PackIsoch(
+	struct urb *Urb
+)
+{
+	u8* data_buf = Urb->transfer_buffer;
+	int length = 0;
+	int pkt_idx;
+
+	for (pkt_idx = 0; pkt_idx < Urb->number_of_packets; pkt_idx++)
+		if (!Urb->iso_frame_desc[pkt_idx].status) {
+			memmove(data_buf + length,
+					Urb->transfer_buffer + Urb->iso_frame_desc[pkt_idx].offset,
+					Urb->iso_frame_desc[pkt_idx].actual_length);
+			length += Urb->iso_frame_desc[pkt_idx].actual_length;
+		}
+
+	return length;
+}
+
 void
 URB_Destroy(
 	PURB_CONTEXT UrbContext
@@ -253,9 +416,17 @@ URB_Destroy(
 		usb_free_coherent(UrbContext->Dev, UrbContext->DataBufferLength,
 						  UrbContext->DataBuffer, UrbContext->DataBufferDma);
 		UrbContext->DataBuffer = NULL;
-		UrbContext->DataBufferLength = 0;
 		UrbContext->DataBufferDma = 0;
 	}
+
+	if (NULL != UrbContext->MessageBuffer[ 1 ].DataBuffer) {
+		usb_free_coherent(UrbContext->Dev, UrbContext->DataBufferLength,
+						  UrbContext->MessageBuffer[ 1 ].DataBuffer,
+						  UrbContext->MessageBuffer[ 1 ].DataBufferDma);
+		UrbContext->MessageBuffer[ 1 ].DataBuffer = NULL;
+	}
+	UrbContext->DataBufferLength = 0;
+
 	list_del_init(&UrbContext->list);
 
 	if (NULL != UrbContext->DeviceContextPvoid) {
@@ -295,7 +466,76 @@ URB_Submit(
 	return status;
 }
 
-/* TODO: EHUB pass URB to message handler to avoid this extra memory copy. */
+/*
+ * Resubmit a message IN URB.  One of an adaptive loop whose index is past
+ * the loop's depth is parked instead, and goes out at the loop's current
+ * transfer size otherwise.
+ */
+int
+URB_SubmitMessage(
+	PURB_CONTEXT UrbContext
+	)
+{
+	PMESSAGE_LOOP loop = UrbContext->MessageLoop;
+	unsigned long flags;
+	int status;
+
+	if (NULL == loop)
+		return URB_Submit( UrbContext );
+
+	spin_lock_irqsave( &loop->SpinLock, flags );
+	if (UrbContext->MessageLoopIndex >= loop->Depth) {
+		UrbContext->MessageLoopParked = true;
+		spin_unlock_irqrestore( &loop->SpinLock, flags );
+		return 0;
+	}
+	UrbContext->Urb->transfer_buffer_length = loop->BufferSize;
+	loop->InFlight++;
+	spin_unlock_irqrestore( &loop->SpinLock, flags );
+
+	status = URB_Submit( UrbContext );
+	if (status < 0) {
+		spin_lock_irqsave( &loop->SpinLock, flags );
+		loop->InFlight--;
+		spin_unlock_irqrestore( &loop->SpinLock, flags );
+	}
+
+	return status;
+}
+
+/*
+ * Account a completed message IN URB to its loop for MESSAGE_LoopResize.
+ */
+static void
+URB_MessageLoopComplete(
+	PURB_CONTEXT UrbContext
+	)
+{
+	PMESSAGE_LOOP loop = UrbContext->MessageLoop;
+	struct urb *urb = UrbContext->Urb;
+	unsigned long flags;
+
+	spin_lock_irqsave( &loop->SpinLock, flags );
+	loop->InFlight--;
+	if (likely(0 == urb->status)) {
+		loop->Completions++;
+		loop->Bytes += urb->actual_length;
+		if (urb->actual_length == urb->transfer_buffer_length)
+			loop->FullCompletions++;
+		if (0 == loop->InFlight)
+			loop->Starved++;
+	}
+	spin_unlock_irqrestore( &loop->SpinLock, flags );
+}
+
+/*
+ * Transfer events and memory writes at the front of a message buffer may be
+ * handled right here (MESSAGE_ParsingFast), so IN data is copied once, from
+ * this buffer to its pages.  The rest is parsed in place in the URB's own
+ * buffer when it has a spare (URB_CreateMessageBuffer), otherwise copied
+ * into a pooled work item.  Both go to
+ * the ordered WorkItemQueue, so messages are parsed in completion order.
+ */
 void
 URB_CompletionRoutine_GetMessage(
 	struct urb *Urb
@@ -305,6 +545,8 @@ URB_CompletionRoutine_GetMessage(
 	PURB_CONTEXT urbContext;
 	u8* xfer_buf;
 	int xfer_buf_len;
+	int xfer_buf_offset;
+	bool resubmit;
 	int status;
 
 	//FUNCTION_ENTRY;
@@ -331,35 +573,37 @@ URB_CompletionRoutine_GetMessage(
 
 	urbContext->Status = URB_STATUS_COMPLETE;
 
+	if (urbContext->MessageLoop)
+		URB_MessageLoopComplete( urbContext );
+
+	resubmit = likely(Urb->status == 0);
+
 	if ( NULL != xfer_buf )
 	{
+		if ( Urb->number_of_packets && xfer_buf_len > 0 )
+			xfer_buf_len = URB_PackIsoch( Urb );
+
 		if ( xfer_buf_len > 0 )
 		{
-			PWORK_ITEM_CONTEXT workItemContext;
-			int pkt_idx;
-
-			workItemContext = WORK_ITEM_Create( deviceContext,
-												WORK_ITEM_Process_MessageHandle,
-												xfer_buf_len );
-			ASSERT( NULL != workItemContext );
-
-			if (!Urb->number_of_packets) {
-				memcpy(workItemContext->DataBuffer,
-					   xfer_buf,
-					   xfer_buf_len);
-			} else {
-				/* Combine isoch data so it can be processed as one big transfer. */
-				u8* data_buf = workItemContext->DataBuffer;
-				for (pkt_idx = 0; pkt_idx < Urb->number_of_packets; pkt_idx++)
-					if (!Urb->iso_frame_desc[pkt_idx].status) {
-						memcpy(data_buf,
-							Urb->transfer_buffer + Urb->iso_frame_desc[pkt_idx].offset,
-							   Urb->iso_frame_desc[pkt_idx].actual_length);
-						data_buf += Urb->iso_frame_desc[pkt_idx].actual_length;
-					}
+			/* Transfer events may be handled right here. */
+			xfer_buf_offset = MESSAGE_ParsingFast( deviceContext,
+												   xfer_buf,
+												   xfer_buf_len );
+			if (xfer_buf_offset == xfer_buf_len) {
+				/* Nothing left to parse, the buffer is free again. */
+			} else if (likely(NULL != urbContext->MessageBuffer[ 1 ].DataBuffer)) {
+				resubmit = URB_MessageBufferQueue( deviceContext,
+												   urbContext,
+												   xfer_buf_offset,
+												   xfer_buf_len,
+												   resubmit );
+			} else if (!WORK_ITEM_QueueMessage( deviceContext,
+												urbContext,
+												xfer_buf_offset,
+												xfer_buf_len )) {
+				/* Resubmitted when a work item frees up. */
+				resubmit = false;
 			}
-
-			WORK_ITEM_Submit( workItemContext );
 		}
 		else
 		{
@@ -374,15 +618,15 @@ URB_CompletionRoutine_GetMessage(
 		goto Exit;
 	}
 
-	if (likely(Urb->status == 0 ))
+	if (likely(resubmit))
 	{
-		status = URB_Submit( urbContext );
+		status = URB_SubmitMessage( urbContext );
 		if (unlikely(status < 0 ))
 		{
 			goto Exit;
 		}
 	}
-	else
+	else if ( Urb->status != 0 )
 	{
 		if ( -ESHUTDOWN != Urb->status )
 			dev_err(dev_ctx_to_dev(deviceContext), "ERROR Urb status code is not zero : %d \n", Urb->status);
@@ -435,6 +679,75 @@ URB_CompletionRoutine_Simple(
 	//FUNCTION_LEAVE;
 }
 
+/*
+ * Register read commands report back whatever their status, so the read
+ * tag is only reused once the USB core is done with its URB.
+ */
+void
+URB_CompletionRoutine_RegisterRead(
+	struct urb *Urb
+	)
+{
+	PDEVICE_CONTEXT deviceContext;
+	PURB_CONTEXT urbContext;
+
+	if (!Urb)
+		return;
+
+	urbContext = ( PURB_CONTEXT )Urb->context;
+	if (!urbContext)
+		return;
+
+	deviceContext = ( PDEVICE_CONTEXT )urbContext->DeviceContextPvoid;
+	if (!deviceContext)
+		return;
+
+	urbContext->ActualLength = Urb->actual_length;
+	urbContext->UrbCompletionStatus = Urb->status;
+	if (Urb->status < 0 && Urb->status != -ESHUTDOWN && Urb->status != -ENOENT)
+		dev_err(dev_ctx_to_dev(deviceContext), "Cmp_RegRead: Error status %d\n", Urb->status);
+
+	urbContext->Status = URB_STATUS_COMPLETE;
+
+	NOTIFICATION_Notify( deviceContext,
+						 &urbContext->Event );
+
+	EMBEDDED_REGISTER_ReadUrbDone( deviceContext, urbContext );
+}
+
+/*
+ * Memory read responses go back to the pool whatever their status, so a
+ * failed transfer never strands a URB.
+ */
+void
+URB_CompletionRoutine_MemoryReadResponse(
+	struct urb *Urb
+	)
+{
+	PDEVICE_CONTEXT deviceContext;
+	PURB_CONTEXT urbContext;
+
+	if (!Urb)
+		return;
+
+	urbContext = ( PURB_CONTEXT )Urb->context;
+	if (!urbContext)
+		return;
+
+	deviceContext = ( PDEVICE_CONTEXT )urbContext->DeviceContextPvoid;
+	if (!deviceContext)
+		return;
+
+	urbContext->ActualLength = Urb->actual_length;
+	urbContext->UrbCompletionStatus = Urb->status;
+	if (Urb->status < 0 && Urb->status != -ESHUTDOWN)
+		dev_err(dev_ctx_to_dev(deviceContext), "Cmp_MemRead: Error status %d\n", Urb->status);
+
+	urbContext->Status = URB_STATUS_COMPLETE;
+
+	MESSAGE_ReadResponsePut(deviceContext, urbContext);
+}
+
 void
 URB_CompletionRoutine_Doorbell(
 	struct urb *Urb
@@ -459,6 +772,8 @@ URB_CompletionRoutine_Doorbell(
 	if (!deviceContext)
 		return;
 
+	USB_OutPipeDone(deviceContext, Urb);
+
 	if (unlikely(DEVICECONTEXT_ErrorCheck(deviceContext) < 0))
 		return;
 
@@ -474,7 +789,7 @@ URB_CompletionRoutine_Doorbell(
 	NOTIFICATION_Notify(deviceContext,
 						&urbContext->Event);
 
-	list_move_tail(&urbContext->list, &deviceContext->doorbell_list_free);
+	EMBEDDED_REGISTER_DoorbellFlush(deviceContext, urbContext);
 
 	//FUNCTION_LEAVE;
 }
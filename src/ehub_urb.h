@@ -48,6 +48,12 @@ URB_CreateIsoch(
 	gfp_t flags
 );
 
+int
+URB_CreateMessageBuffer(
+	PURB_CONTEXT UrbContext,
+	gfp_t flags
+	);
+
 void
 URB_Destroy(
 	PURB_CONTEXT UrbContext
@@ -58,6 +64,11 @@ URB_Submit(
 	PURB_CONTEXT UrbContext
 	);
 
+int
+URB_SubmitMessage(
+	PURB_CONTEXT UrbContext
+	);
+
 void
 URB_CompletionRoutine_GetMessage(
 	struct urb *Urb
@@ -68,9 +79,19 @@ URB_CompletionRoutine_Simple(
 	struct urb *Urb
 	);
 
+void
+URB_CompletionRoutine_MemoryReadResponse(
+	struct urb *Urb
+	);
+
 void
 URB_CompletionRoutine_Doorbell(
 	struct urb *Urb
 	);
 
+void
+URB_CompletionRoutine_RegisterRead(
+	struct urb *Urb
+	);
+
 #endif
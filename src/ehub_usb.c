@@ -18,15 +18,30 @@
  *
  */
 
+#include <linux/ktime.h>
+
 #include "xhci.h"
 
 #include "ehub_defines.h"
 
 #include "ehub_device_context.h"
+#include "ehub_embedded_cache.h"
 #include "ehub_message.h"
+#include "ehub_notification.h"
+#include "ehub_urb.h"
 #include "ehub_utility.h"
 #include "ehub_usb.h"
 
+static int out_transport = EHUB_OUT_TRANSPORT_PROBE;
+module_param(out_transport, int, S_IRUGO);
+MODULE_PARM_DESC(out_transport, "Cache write and doorbell transport: 0=interrupt 1=bulk 2=hybrid 3=probe at connect");
+
+static const char* const out_transport_names[] = {
+	[ EHUB_OUT_TRANSPORT_INTERRUPT ] = "interrupt",
+	[ EHUB_OUT_TRANSPORT_BULK ] = "bulk",
+	[ EHUB_OUT_TRANSPORT_HYBRID ] = "hybrid",
+};
+
 /* TODO remove all the pointless functions */
 
 int
@@ -202,3 +217,336 @@ USB_InterfaceResumeIsoch(
 	return status;
 }
 #endif /* EHUB_ISOCH_ENABLE */
+
+/*
+ * Point the cache write and doorbell pipes at the transport.  Hybrid keeps
+ * doorbells and short cache writes on interrupt, which is reserved bandwidth
+ * at one transfer per interval, and sends long cache writes on bulk.
+ */
+void
+USB_OutTransportSet(
+	PDEVICE_CONTEXT DeviceContext,
+	int Transport
+	)
+{
+	PUSB_CONTEXT usbContext = &DeviceContext->UsbContext;
+	unsigned long flags;
+
+	spin_lock_irqsave( &DeviceContext->SpinLockOutTransport, flags );
+
+	switch (Transport) {
+	case EHUB_OUT_TRANSPORT_BULK:
+		usbContext->UsbPipeCacheOut = usbContext->UsbPipeBulkOut;
+		usbContext->UsbPipeDoorbellOut = usbContext->UsbPipeBulkOut;
+		break;
+	case EHUB_OUT_TRANSPORT_HYBRID:
+		usbContext->UsbPipeCacheOut = usbContext->UsbPipeBulkOut;
+		usbContext->UsbPipeDoorbellOut = usbContext->UsbPipeInterruptOut;
+		break;
+	default:
+		Transport = EHUB_OUT_TRANSPORT_INTERRUPT;
+		usbContext->UsbPipeCacheOut = usbContext->UsbPipeInterruptOut;
+		usbContext->UsbPipeDoorbellOut = usbContext->UsbPipeInterruptOut;
+		break;
+	}
+
+	DeviceContext->OutTransport = Transport;
+
+	spin_unlock_irqrestore( &DeviceContext->SpinLockOutTransport, flags );
+}
+
+/*
+ * Pick the pipe for a cache write or doorbell transfer of Length bytes.
+ *
+ * The device applies what arrives on one endpoint in order, but nothing
+ * orders one endpoint against the other, and a doorbell must not overtake
+ * the TRBs or data it points at.  So a transfer only goes to its preferred
+ * pipe when nothing is in flight on the other one; otherwise it follows the
+ * traffic already there.  Every call must be matched by USB_OutPipeDone.
+ */
+void
+USB_OutPipeSelect(
+	PDEVICE_CONTEXT DeviceContext,
+	struct urb* Urb,
+	u32 Length
+	)
+{
+	PUSB_CONTEXT usbContext = &DeviceContext->UsbContext;
+	unsigned int pipe;
+	unsigned long flags;
+	int lane;
+
+	spin_lock_irqsave( &DeviceContext->SpinLockOutTransport, flags );
+
+	if (Length > EHUB_OUT_HYBRID_THRESHOLD)
+		pipe = usbContext->UsbPipeCacheOut;
+	else
+		pipe = usbContext->UsbPipeDoorbellOut;
+
+	lane = usb_pipebulk( pipe ) ? EHUB_OUT_TRANSPORT_BULK : EHUB_OUT_TRANSPORT_INTERRUPT;
+	if (DeviceContext->OutInFlight[ !lane ]) {
+		lane = !lane;
+		pipe = ( EHUB_OUT_TRANSPORT_BULK == lane ) ?
+			usbContext->UsbPipeBulkOut : usbContext->UsbPipeInterruptOut;
+		DeviceContext->OutTransportHeld++;
+	}
+
+	DeviceContext->OutInFlight[ lane ]++;
+	DeviceContext->OutTransfers[ lane ]++;
+
+	spin_unlock_irqrestore( &DeviceContext->SpinLockOutTransport, flags );
+
+	Urb->pipe = pipe;
+	if (usb_pipeint( pipe ))
+		Urb->interval = 1;
+}
+
+void
+USB_OutPipeDone(
+	PDEVICE_CONTEXT DeviceContext,
+	struct urb* Urb
+	)
+{
+	unsigned long flags;
+	int lane;
+
+	lane = usb_pipebulk( Urb->pipe ) ? EHUB_OUT_TRANSPORT_BULK : EHUB_OUT_TRANSPORT_INTERRUPT;
+
+	spin_lock_irqsave( &DeviceContext->SpinLockOutTransport, flags );
+	if (DeviceContext->OutInFlight[ lane ])
+		DeviceContext->OutInFlight[ lane ]--;
+	spin_unlock_irqrestore( &DeviceContext->SpinLockOutTransport, flags );
+}
+
+static void
+USB_OutTransportProbeCompletion(
+	struct urb *Urb
+	)
+{
+	PURB_CONTEXT urbContext = ( PURB_CONTEXT )Urb->context;
+	PDEVICE_CONTEXT deviceContext = ( PDEVICE_CONTEXT )urbContext->DeviceContextPvoid;
+
+	USB_OutPipeDone( deviceContext, Urb );
+
+	urbContext->UrbCompletionStatus = Urb->status;
+	urbContext->Status = URB_STATUS_COMPLETE;
+
+	NOTIFICATION_Notify( deviceContext, &urbContext->Event );
+}
+
+/*
+ * Time EHUB_OUT_PROBE_TRANSFERS back to back cache writes of Length bytes
+ * over Transport.  Returns nanoseconds, or < 0 on failure.  The writes are
+ * submitted here rather than with EMBEDDED_CACHE_Write, whose failures mark
+ * the device dead; a failed probe only falls back to interrupt.
+ */
+static s64
+USB_OutTransportTime(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext,
+	int Transport,
+	u32 Length
+	)
+{
+	ktime_t start;
+	int index;
+	int status;
+
+	USB_OutTransportSet( DeviceContext, Transport );
+
+	start = ktime_get();
+
+	for (index = 0; index < EHUB_OUT_PROBE_TRANSFERS; index++) {
+		status = EMBEDDED_CACHE_FillRecord( DeviceContext,
+											( u8* )UrbContext->DataBuffer,
+											EHUB_CACHE_START_ADDRESS,
+											NULL,
+											Length,
+											1 );
+		if (status < 0)
+			return status;
+
+		UrbContext->Urb->transfer_buffer_length = status;
+		USB_OutPipeSelect( DeviceContext, UrbContext->Urb, status );
+
+		status = URB_Submit( UrbContext );
+		if (status < 0) {
+			USB_OutPipeDone( DeviceContext, UrbContext->Urb );
+			return status;
+		}
+
+		status = NOTIFICATION_Wait( DeviceContext,
+									&UrbContext->Event,
+									NOTIFICATION_EVENT_TIMEOUT );
+		if (status < 0)
+			return status;
+
+		if (UrbContext->UrbCompletionStatus < 0)
+			return UrbContext->UrbCompletionStatus;
+	}
+
+	return ktime_to_ns( ktime_sub( ktime_get(), start ) );
+}
+
+/*
+ * Measure short and long cache writes over both pipes and keep the faster
+ * transport.  Runs at connect, before the embedded host owns the cache, so
+ * the writes land in the first cache block harmlessly.  Falls back to
+ * interrupt, the historical choice, if anything fails.
+ */
+static int
+USB_OutTransportProbe(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	static const u32 length[ 2 ] = { EHUB_OUT_PROBE_SMALL, MESSAGE_DATA_BUFFER_SIZE_CACHE };
+	s64 elapsed[ 2 ][ 2 ];
+	PURB_CONTEXT urbContext;
+	int transport = EHUB_OUT_TRANSPORT_INTERRUPT;
+	int lane, size;
+	int status = 0;
+
+	urbContext = URB_Create(DeviceContext,
+							DeviceContext->UsbContext.UsbDevice,
+							DeviceContext->UsbContext.UsbPipeBulkOut,
+							sizeof( EMBEDDED_CACHE_TRANSFER ) + MESSAGE_DATA_BUFFER_SIZE_CACHE,
+							USB_OutTransportProbeCompletion,
+							NULL,
+							GFP_KERNEL);
+	if (NULL == urbContext) {
+		status = -ENOMEM;
+		goto Exit;
+	}
+
+	for (lane = EHUB_OUT_TRANSPORT_INTERRUPT; lane <= EHUB_OUT_TRANSPORT_BULK; lane++) {
+		for (size = 0; size < 2; size++) {
+			elapsed[ lane ][ size ] = USB_OutTransportTime( DeviceContext,
+															urbContext,
+															lane,
+															length[ size ] );
+			if (elapsed[ lane ][ size ] < 0) {
+				status = ( int )elapsed[ lane ][ size ];
+				goto Exit;
+			}
+		}
+	}
+
+	if (elapsed[ EHUB_OUT_TRANSPORT_BULK ][ 1 ] < elapsed[ EHUB_OUT_TRANSPORT_INTERRUPT ][ 1 ]) {
+		if (elapsed[ EHUB_OUT_TRANSPORT_INTERRUPT ][ 0 ] < elapsed[ EHUB_OUT_TRANSPORT_BULK ][ 0 ])
+			transport = EHUB_OUT_TRANSPORT_HYBRID;
+		else
+			transport = EHUB_OUT_TRANSPORT_BULK;
+	}
+
+	dev_info(dev_ctx_to_dev(DeviceContext), "OUT probe ns per %d writes: short interrupt %lld bulk %lld, long interrupt %lld bulk %lld\n",
+			 EHUB_OUT_PROBE_TRANSFERS,
+			 elapsed[ EHUB_OUT_TRANSPORT_INTERRUPT ][ 0 ], elapsed[ EHUB_OUT_TRANSPORT_BULK ][ 0 ],
+			 elapsed[ EHUB_OUT_TRANSPORT_INTERRUPT ][ 1 ], elapsed[ EHUB_OUT_TRANSPORT_BULK ][ 1 ]);
+
+Exit:
+
+	if (NULL != urbContext) {
+		usb_kill_urb( urbContext->Urb );
+		URB_Destroy( urbContext );
+	}
+
+	if (status < 0)
+		dev_warn(dev_ctx_to_dev(DeviceContext), "WARNING OUT probe failed %d\n", status);
+
+	USB_OutTransportSet( DeviceContext, transport );
+
+	return status;
+}
+
+/*
+ * Choose the cache write and doorbell transport once both interfaces are
+ * up: the out_transport parameter if it names one, otherwise by probing.
+ */
+int
+USB_OutTransportConnect(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	int status = 0;
+
+	if (out_transport >= EHUB_OUT_TRANSPORT_INTERRUPT && out_transport < EHUB_OUT_TRANSPORT_PROBE)
+		USB_OutTransportSet( DeviceContext, out_transport );
+	else
+		status = USB_OutTransportProbe( DeviceContext );
+
+	dev_info(dev_ctx_to_dev(DeviceContext), "OUT transport %s\n",
+			 out_transport_names[ DeviceContext->OutTransport ]);
+
+	return status;
+}
+
+/*
+ * out_transport on the interface shows the transport and switches it at
+ * runtime.  The probe is only run at connect, it would overwrite live cache.
+ */
+static ssize_t
+out_transport_show(
+	struct device* dev,
+	struct device_attribute* attr,
+	char* buf
+	)
+{
+	PDEVICE_CONTEXT deviceContext = usb_get_intfdata( to_usb_interface( dev ) );
+
+	return sprintf( buf, "%s\n", out_transport_names[ deviceContext->OutTransport ] );
+}
+
+static ssize_t
+out_transport_store(
+	struct device* dev,
+	struct device_attribute* attr,
+	const char* buf,
+	size_t count
+	)
+{
+	PDEVICE_CONTEXT deviceContext = usb_get_intfdata( to_usb_interface( dev ) );
+	int transport;
+
+	for (transport = 0; transport < ARRAY_SIZE( out_transport_names ); transport++) {
+		if (sysfs_streq( buf, out_transport_names[ transport ] )) {
+			USB_OutTransportSet( deviceContext, transport );
+			return count;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static struct device_attribute dev_attr_out_transport =
+	__ATTR( out_transport, 0644, out_transport_show, out_transport_store );
+
+int
+USB_OutTransportSysfsCreate(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	int status;
+
+	status = device_create_file( &DeviceContext->InterfaceBackup->dev,
+								 &dev_attr_out_transport );
+	DeviceContext->OutTransportSysfsCreated = (status == 0);
+
+	return status;
+}
+
+void
+USB_OutTransportSysfsRemove(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	if (DeviceContext->OutTransportSysfsCreated) {
+		device_remove_file( &DeviceContext->InterfaceBackup->dev,
+							&dev_attr_out_transport );
+		DeviceContext->OutTransportSysfsCreated = false;
+	}
+
+	dev_dbg(dev_ctx_to_dev(DeviceContext), "OUT transfers interrupt %u bulk %u, held to order %u\n",
+			DeviceContext->OutTransfers[ EHUB_OUT_TRANSPORT_INTERRUPT ],
+			DeviceContext->OutTransfers[ EHUB_OUT_TRANSPORT_BULK ],
+			DeviceContext->OutTransportHeld);
+}
@@ -52,6 +52,17 @@
 #define BULK_TRANSFER_TIMEOUT_WAIT_FOREVER  ( 0 )
 #define BULK_TRANSFER_TIMEOUT_IM_MS         ( 500 )
 
+/* Where cache writes and doorbells go.  Hybrid sends transfers longer than
+ * EHUB_OUT_HYBRID_THRESHOLD on bulk and the rest on interrupt. */
+#define EHUB_OUT_TRANSPORT_INTERRUPT        ( 0 )
+#define EHUB_OUT_TRANSPORT_BULK             ( 1 )
+#define EHUB_OUT_TRANSPORT_HYBRID           ( 2 )
+#define EHUB_OUT_TRANSPORT_PROBE            ( 3 )
+#define EHUB_OUT_HYBRID_THRESHOLD           ( MAX_PACKET_SIZE_INTERRUPT )
+/* Cache writes timed per pipe and size by USB_OutTransportProbe. */
+#define EHUB_OUT_PROBE_TRANSFERS            ( 16 )
+#define EHUB_OUT_PROBE_SMALL                ( 8 )
+
 int
 USB_InterfaceCreateBulk(
 	PDEVICE_CONTEXT DeviceContext
@@ -112,4 +123,38 @@ USB_InterfaceResumeInterrupt(
 	PDEVICE_CONTEXT DeviceContext
 	);
 
+void
+USB_OutTransportSet(
+	PDEVICE_CONTEXT DeviceContext,
+	int Transport
+	);
+
+int
+USB_OutTransportConnect(
+	PDEVICE_CONTEXT DeviceContext
+	);
+
+void
+USB_OutPipeSelect(
+	PDEVICE_CONTEXT DeviceContext,
+	struct urb* Urb,
+	u32 Length
+	);
+
+void
+USB_OutPipeDone(
+	PDEVICE_CONTEXT DeviceContext,
+	struct urb* Urb
+	);
+
+int
+USB_OutTransportSysfsCreate(
+	PDEVICE_CONTEXT DeviceContext
+	);
+
+void
+USB_OutTransportSysfsRemove(
+	PDEVICE_CONTEXT DeviceContext
+	);
+
 #endif
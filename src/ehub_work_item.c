@@ -34,10 +34,57 @@
 #include "ehub_urb.h"
 #include "ehub_work_item.h"
 
-/* TODO: EHUB Allocate the work item context on connect and
- * reuse it instead of allocating and freeing repeatedly. */
-PWORK_ITEM_CONTEXT
-WORK_ITEM_Create(
+/*
+ * Preallocate the work items, each with a WORK_ITEM_DATA_BUFFER_SIZE inline
+ * buffer.  Returns the number of items created.
+ */
+int
+WORK_ITEM_PoolCreate(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	PWORK_ITEM_CONTEXT workItemContext;
+	int index;
+
+	for (index = 0; index < NUMBER_OF_WORK_ITEM; index++) {
+		workItemContext = kzalloc( sizeof( WORK_ITEM_CONTEXT ) + WORK_ITEM_DATA_BUFFER_SIZE,
+								   GFP_KERNEL );
+		if (NULL == workItemContext)
+			break;
+
+		INIT_LIST_HEAD( &workItemContext->list );
+		list_add_tail( &workItemContext->list, &DeviceContext->WorkItemFreeQueue );
+	}
+
+	return index;
+}
+
+/* The WorkItemQueue must already be destroyed. */
+void
+WORK_ITEM_PoolDestroy(
+	PDEVICE_CONTEXT DeviceContext
+	)
+{
+	PWORK_ITEM_CONTEXT workItemContext, next;
+
+	dev_dbg(dev_ctx_to_dev(DeviceContext), "work items high water %d exhausted %u oversize %u\n",
+			DeviceContext->WorkItemHighWater,
+			DeviceContext->WorkItemExhausted,
+			DeviceContext->WorkItemOversize);
+
+	list_for_each_entry_safe( workItemContext, next, &DeviceContext->WorkItemFreeQueue, list ) {
+		list_del( &workItemContext->list );
+		kfree( workItemContext );
+	}
+}
+
+/*
+ * Take a work item from the pool, NULL if none is free.
+ *
+ * MUST be called with SpinLockWorkItemQueue held!
+ */
+static PWORK_ITEM_CONTEXT
+WORK_ITEM_CreateLocked(
 	PDEVICE_CONTEXT DeviceContext,
 	void ( *WorkItemProcess )( struct work_struct * ),
 	int DataBufferLength
@@ -45,15 +92,135 @@ WORK_ITEM_Create(
 {
 	PWORK_ITEM_CONTEXT workItemContext;
 
-	workItemContext = kzalloc( sizeof( WORK_ITEM_CONTEXT ), GFP_ATOMIC );
-	ASSERT( NULL != workItemContext );
+	if (list_empty( &DeviceContext->WorkItemFreeQueue )) {
+		DeviceContext->WorkItemExhausted++;
+		return NULL;
+	}
+
+	workItemContext = list_first_entry( &DeviceContext->WorkItemFreeQueue,
+										WORK_ITEM_CONTEXT,
+										list );
+
+	if (DataBufferLength > WORK_ITEM_DATA_BUFFER_SIZE) {
+		/* Only a packed isoch URB can be this large. */
+		workItemContext->DataBuffer = kzalloc( DataBufferLength, GFP_ATOMIC );
+		if (NULL == workItemContext->DataBuffer)
+			return NULL;
+		DeviceContext->WorkItemOversize++;
+	} else {
+		workItemContext->DataBuffer = workItemContext->InlineBuffer;
+	}
+
+	list_del_init( &workItemContext->list );
 
 	workItemContext->DeviceContextPvoid = ( void* )DeviceContext;
 	workItemContext->DataBufferLength = DataBufferLength;
 	workItemContext->WorkItemProcess = WorkItemProcess;
+	workItemContext->FromWhere = WORK_ITEM_FROM_NOPLACE;
+
+	return workItemContext;
+}
+
+/*
+ * Queue a work item on the ordered WorkItemQueue.
+ *
+ * MUST be called with SpinLockWorkItemQueue held!
+ */
+static void
+WORK_ITEM_SubmitLocked(
+	PDEVICE_CONTEXT DeviceContext,
+	PWORK_ITEM_CONTEXT WorkItemContext
+)
+{
+	INIT_DELAYED_WORK(&WorkItemContext->WorkItem,
+					  WorkItemContext->WorkItemProcess);
+
+	list_add_tail(&WorkItemContext->list,
+				  &DeviceContext->WorkItemProcessingQueue);
+
+	DeviceContext->NumberOfWorkItemInProcessingQueue++;
+	if (DeviceContext->NumberOfWorkItemInProcessingQueue > DeviceContext->WorkItemHighWater)
+		DeviceContext->WorkItemHighWater = DeviceContext->NumberOfWorkItemInProcessingQueue;
+
+	queue_delayed_work(DeviceContext->WorkItemQueue, &WorkItemContext->WorkItem, 0 );
+}
+
+/*
+ * Copy the messages a message URB received, from DataOffset on, into a work
+ * item and queue it for MESSAGE_Parsing.  Returns true if the URB may be
+ * resubmitted; false if no work item is free or older messages are still
+ * waiting, in which case the URB waits on WorkItemPendingQueue and
+ * WORK_ITEM_Destroy queues its messages and resubmits it.
+ */
+bool
+WORK_ITEM_QueueMessage(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext,
+	int DataOffset,
+	int DataBufferLength
+	)
+{
+	PWORK_ITEM_CONTEXT workItemContext = NULL;
+	u8* data = ( u8* )UrbContext->Urb->transfer_buffer + DataOffset;
+	unsigned long flags;
+
+	DataBufferLength -= DataOffset;
+
+	spin_lock_irqsave( &DeviceContext->SpinLockWorkItemQueue, flags );
+
+	/* Keep completion order behind messages that are already waiting. */
+	if (list_empty( &DeviceContext->WorkItemPendingQueue ))
+		workItemContext = WORK_ITEM_CreateLocked( DeviceContext,
+												  WORK_ITEM_Process_MessageHandle,
+												  DataBufferLength );
+
+	if (NULL == workItemContext) {
+		memmove( UrbContext->Urb->transfer_buffer, data, DataBufferLength );
+		UrbContext->ActualLength = DataBufferLength;
+		list_add_tail( &UrbContext->list, &DeviceContext->WorkItemPendingQueue );
+		spin_unlock_irqrestore( &DeviceContext->SpinLockWorkItemQueue, flags );
+		return false;
+	}
 
-	workItemContext->DataBuffer = kzalloc( DataBufferLength, GFP_ATOMIC );
-	ASSERT( NULL != workItemContext->DataBuffer );
+	memcpy( workItemContext->DataBuffer, data, DataBufferLength );
+
+	WORK_ITEM_SubmitLocked( DeviceContext, workItemContext );
+
+	spin_unlock_irqrestore( &DeviceContext->SpinLockWorkItemQueue, flags );
+
+	return true;
+}
+
+/* Forget a message URB that is waiting for a work item before it is stopped. */
+void
+WORK_ITEM_CancelMessage(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext
+	)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave( &DeviceContext->SpinLockWorkItemQueue, flags );
+	list_del_init( &UrbContext->list );
+	spin_unlock_irqrestore( &DeviceContext->SpinLockWorkItemQueue, flags );
+}
+
+PWORK_ITEM_CONTEXT
+WORK_ITEM_Create(
+	PDEVICE_CONTEXT DeviceContext,
+	void ( *WorkItemProcess )( struct work_struct * ),
+	int DataBufferLength
+	)
+{
+	PWORK_ITEM_CONTEXT workItemContext;
+	unsigned long flags;
+
+	spin_lock_irqsave( &DeviceContext->SpinLockWorkItemQueue, flags );
+	workItemContext = WORK_ITEM_CreateLocked( DeviceContext, WorkItemProcess, DataBufferLength );
+	spin_unlock_irqrestore( &DeviceContext->SpinLockWorkItemQueue, flags );
+
+	if (NULL != workItemContext)
+		memset( workItemContext->DataBuffer, 0, DataBufferLength );
 
 	return workItemContext;
 }
@@ -64,7 +231,10 @@ WORK_ITEM_Destroy(
 	)
 {
 	PDEVICE_CONTEXT deviceContext;
+	PURB_CONTEXT urbContext, next;
+	PWORK_ITEM_CONTEXT workItemContext;
 	unsigned long flags;
+	LIST_HEAD( resubmit_list );
 
 	deviceContext = ( PDEVICE_CONTEXT )WorkItemContext->DeviceContextPvoid;
 	if (!deviceContext) {
@@ -74,7 +244,7 @@ WORK_ITEM_Destroy(
 
 	spin_lock_irqsave( &deviceContext->SpinLockWorkItemQueue , flags );
 
-	if ( NULL != WorkItemContext->DataBuffer )
+	if ( WorkItemContext->DataBuffer != WorkItemContext->InlineBuffer )
 		kfree( WorkItemContext->DataBuffer );
 
 	WorkItemContext->DataBuffer = NULL;
@@ -82,15 +252,32 @@ WORK_ITEM_Destroy(
 	WorkItemContext->WorkItemProcess = NULL;
 	WorkItemContext->DeviceContextPvoid = NULL;
 
-	list_del_init( &WorkItemContext->list );
+	list_move_tail( &WorkItemContext->list, &deviceContext->WorkItemFreeQueue );
 	deviceContext->NumberOfWorkItemInProcessingQueue--;
 
 	//dev_dbg(dev_ctx_to_dev(deviceContext), "NumberOfWorkItemInProcessingQueue : %d \n", deviceContext->NumberOfWorkItemInProcessingQueue );
 
-	if ( NULL != WorkItemContext)
-		kfree(WorkItemContext);
+	/* Hand freed items to the message URBs waiting for one, oldest first. */
+	list_for_each_entry_safe( urbContext, next, &deviceContext->WorkItemPendingQueue, list ) {
+		workItemContext = WORK_ITEM_CreateLocked( deviceContext,
+												  WORK_ITEM_Process_MessageHandle,
+												  urbContext->ActualLength );
+		if (NULL == workItemContext)
+			break;
+
+		memcpy( workItemContext->DataBuffer, urbContext->Urb->transfer_buffer, urbContext->ActualLength );
+		WORK_ITEM_SubmitLocked( deviceContext, workItemContext );
+
+		list_move_tail( &urbContext->list, &resubmit_list );
+	}
 
 	spin_unlock_irqrestore( &deviceContext->SpinLockWorkItemQueue , flags );
+
+	list_for_each_entry_safe( urbContext, next, &resubmit_list, list ) {
+		list_del_init( &urbContext->list );
+		if (DEVICECONTEXT_ErrorCheck( deviceContext ) >= 0)
+			URB_SubmitMessage( urbContext );
+	}
 }
 
 void
@@ -109,15 +296,7 @@ WORK_ITEM_Submit(
 
 	spin_lock_irqsave(&deviceContext->SpinLockWorkItemQueue, flags);
 
-	INIT_DELAYED_WORK(&WorkItemContext->WorkItem,
-					  WorkItemContext->WorkItemProcess);
-
-	list_add_tail(&WorkItemContext->list,
-				  &deviceContext->WorkItemProcessingQueue);
-
-	deviceContext->NumberOfWorkItemInProcessingQueue++;
-
-	queue_delayed_work(deviceContext->WorkItemQueue, &WorkItemContext->WorkItem, 0 );
+	WORK_ITEM_SubmitLocked(deviceContext, WorkItemContext);
 
 	spin_unlock_irqrestore(&deviceContext->SpinLockWorkItemQueue, flags);
 }
@@ -139,6 +318,7 @@ WORK_ITEM_Process_MessageHandle(
 	MESSAGE_Parsing( deviceContext,
 					 workItemContext->DataBuffer,
 					 workItemContext->DataBufferLength );
+	MESSAGE_ParsingDone( deviceContext );
 
 	WORK_ITEM_Destroy( workItemContext );
 }
@@ -223,35 +403,6 @@ Exit:
 	FUNCTION_LEAVE;
 }
 
-void
-WORK_ITEM_Process_MessageHandleEmbeddedEmbeddedRegisterRead(
-	struct work_struct* WorkItem
-	)
-{
-	PWORK_ITEM_CONTEXT workItemContext;
-	PDEVICE_CONTEXT deviceContext;
-	u32* data;
-
-	FUNCTION_ENTRY;
-
-	workItemContext = container_of( WorkItem,
-									WORK_ITEM_CONTEXT,
-									WorkItem.work );
-
-	deviceContext = ( PDEVICE_CONTEXT )workItemContext->DeviceContextPvoid;
-
-	data = ( u32* )workItemContext->DataBuffer;
-
-	deviceContext->DataEmbeddedRegisterRead = *data;
-
-	NOTIFICATION_Notify( deviceContext,
-						 &deviceContext->CompletionEventEmbeddedRegisterRead );
-
-	WORK_ITEM_Destroy( workItemContext );
-
-	FUNCTION_LEAVE;
-}
-
 void
 WORK_ITEM_Process_MessageHandleEmbeddedEventTrb(
 	struct work_struct* WorkItem
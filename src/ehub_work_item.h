@@ -23,6 +23,30 @@
 
 #define MAX_NUMBER_OF_WORK_ITEM_PENDING_QUEUE_ITEM 64
 
+int
+WORK_ITEM_PoolCreate(
+	PDEVICE_CONTEXT DeviceContext
+	);
+
+void
+WORK_ITEM_PoolDestroy(
+	PDEVICE_CONTEXT DeviceContext
+	);
+
+bool
+WORK_ITEM_QueueMessage(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext,
+	int DataOffset,
+	int DataBufferLength
+	);
+
+void
+WORK_ITEM_CancelMessage(
+	PDEVICE_CONTEXT DeviceContext,
+	PURB_CONTEXT UrbContext
+	);
+
 PWORK_ITEM_CONTEXT
 WORK_ITEM_Create(
 	PDEVICE_CONTEXT DeviceContext,
@@ -31,6 +31,13 @@
 #include "ehub_urb.h"
 #include "ehub-xhci-trace.h"
 
+#ifdef USE_DELAYED_CACHE_MODE
+/* Longest wait for a cache write to share its transfer, see ehub_cache_flush_locked. */
+static unsigned int cache_flush_us = EHUB_CACHE_FLUSH_US;
+module_param(cache_flush_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cache_flush_us, "Longest time in microseconds a cache write waits to share a transfer");
+#endif /* USE_DELAYED_CACHE_MODE */
+
 static const struct hc_driver ehub_xhci_xhci_driver = {
 	.description        =   "ehub-xhci-hcd",
 	.product_desc       =   "Embedded xHCI Host Controller",
@@ -97,6 +104,171 @@ static const struct hc_driver ehub_xhci_xhci_driver = {
 	.find_raw_port_number = ehub_xhci_find_raw_port_number,
 };
 
+/*
+ * Register shadow.
+ *
+ * Every register access is a USB round trip, yet most reads on the control
+ * paths return values the driver wrote itself.  ehub_xhci_writel keeps a
+ * copy of the registers below and ehub_xhci_readl answers from it whenever
+ * none of the bits could have been changed by the controller.
+ *
+ * hw_mask     bits the controller owns and may change at any time.  A plain
+ *             read of such a register always goes to the device;
+ *             ehub_xhci_readl_sw returns the shadow with these bits as 0.
+ * self_clear  bits software sets and the controller clears when done.  The
+ *             shadow is bypassed until a device read sees them clear.
+ *
+ * USBSTS, CRCR, PORTSC and friends are hardware owned and not listed.
+ */
+enum {
+	EHUB_XHCI_SHADOW_OP,
+	EHUB_XHCI_SHADOW_IR,
+};
+
+static const struct ehub_xhci_shadow_desc {
+	u8 base;
+	u16 offset;
+	u32 hw_mask;
+	u32 self_clear;
+} ehub_xhci_shadow_table[ EHUB_XHCI_REG_SHADOW_COUNT ] = {
+	{ EHUB_XHCI_SHADOW_OP, offsetof(struct xhci_op_regs, command),
+	  0, CMD_RESET | CMD_LRESET | CMD_CSS | CMD_CRS },
+	{ EHUB_XHCI_SHADOW_OP, offsetof(struct xhci_op_regs, dev_notification), 0, 0 },
+	{ EHUB_XHCI_SHADOW_OP, offsetof(struct xhci_op_regs, dcbaa_ptr), 0, 0 },
+	{ EHUB_XHCI_SHADOW_OP, offsetof(struct xhci_op_regs, dcbaa_ptr) + 4, 0, 0 },
+	{ EHUB_XHCI_SHADOW_OP, offsetof(struct xhci_op_regs, config_reg), 0, 0 },
+	{ EHUB_XHCI_SHADOW_IR, offsetof(struct xhci_intr_reg, irq_pending), IMAN_IP, 0 },
+	{ EHUB_XHCI_SHADOW_IR, offsetof(struct xhci_intr_reg, irq_control), ER_IRQ_COUNTER_MASK, 0 },
+	{ EHUB_XHCI_SHADOW_IR, offsetof(struct xhci_intr_reg, erst_size), 0, 0 },
+	{ EHUB_XHCI_SHADOW_IR, offsetof(struct xhci_intr_reg, erst_base), 0, 0 },
+	{ EHUB_XHCI_SHADOW_IR, offsetof(struct xhci_intr_reg, erst_base) + 4, 0, 0 },
+	{ EHUB_XHCI_SHADOW_IR, offsetof(struct xhci_intr_reg, erst_dequeue), ERST_EHB, 0 },
+	{ EHUB_XHCI_SHADOW_IR, offsetof(struct xhci_intr_reg, erst_dequeue) + 4, 0, 0 },
+};
+
+static int
+ehub_xhci_shadow_index(
+	const struct xhci_hcd *xhci,
+	__le32 *regs
+	)
+{
+	unsigned long address = ( unsigned long )regs;
+	unsigned long base;
+	int index;
+
+	for (index = 0; index < EHUB_XHCI_REG_SHADOW_COUNT; index++) {
+		if (ehub_xhci_shadow_table[index].base == EHUB_XHCI_SHADOW_OP)
+			base = ( unsigned long )xhci->op_regs;
+		else
+			base = ( unsigned long )xhci->ir_set;
+
+		/* Not mapped yet, the address would alias the capability registers. */
+		if (!base)
+			continue;
+
+		if (address == base + ehub_xhci_shadow_table[index].offset)
+			return index;
+	}
+
+	return -1;
+}
+
+/*
+ * Serve a read from the shadow.  With SoftwareOnly set the hardware owned
+ * bits are not needed by the caller and read as 0.
+ */
+static bool
+ehub_xhci_shadow_read(
+	const struct xhci_hcd *xhci,
+	__le32 *regs,
+	bool SoftwareOnly,
+	u32 *val
+	)
+{
+	/* The shadow is bookkeeping, not controller state. */
+	struct xhci_hcd *shadow_xhci = ( struct xhci_hcd * )xhci;
+	const struct ehub_xhci_shadow_desc *desc;
+	unsigned long flags;
+	bool hit = false;
+	int index;
+
+	index = ehub_xhci_shadow_index(xhci, regs);
+	if (index < 0)
+		return false;
+	desc = &ehub_xhci_shadow_table[index];
+
+	if (desc->hw_mask && !SoftwareOnly)
+		return false;
+
+	spin_lock_irqsave(&shadow_xhci->reg_shadow_lock, flags);
+	if (test_bit(index, &shadow_xhci->reg_shadow_valid) &&
+		!(shadow_xhci->reg_shadow[index] & desc->self_clear)) {
+		*val = shadow_xhci->reg_shadow[index];
+		hit = true;
+	}
+	spin_unlock_irqrestore(&shadow_xhci->reg_shadow_lock, flags);
+
+	return hit;
+}
+
+/*
+ * Record a value that was read from or written to the device.  A failed
+ * access drops the entry.
+ */
+static void
+ehub_xhci_shadow_store(
+	const struct xhci_hcd *xhci,
+	__le32 *regs,
+	u32 val,
+	bool valid
+	)
+{
+	struct xhci_hcd *shadow_xhci = ( struct xhci_hcd * )xhci;
+	unsigned long flags;
+	int index;
+
+	index = ehub_xhci_shadow_index(xhci, regs);
+	if (index < 0)
+		return;
+
+	spin_lock_irqsave(&shadow_xhci->reg_shadow_lock, flags);
+	if (valid) {
+		shadow_xhci->reg_shadow[index] = val & ~ehub_xhci_shadow_table[index].hw_mask;
+		set_bit(index, &shadow_xhci->reg_shadow_valid);
+	} else {
+		clear_bit(index, &shadow_xhci->reg_shadow_valid);
+	}
+	spin_unlock_irqrestore(&shadow_xhci->reg_shadow_lock, flags);
+}
+
+/*
+ * Update the shadow after a register write reached the device.
+ */
+static void
+ehub_xhci_shadow_write(
+	struct xhci_hcd *xhci,
+	__le32 *regs,
+	u32 val,
+	int status
+	)
+{
+	unsigned long flags;
+
+	if (xhci->op_regs && regs >= &xhci->op_regs->port_status_base)
+		ehub_xhci_port_snapshot_invalidate(xhci);
+
+	/* Reset and restore reload every register behind our back. */
+	if (regs == &xhci->op_regs->command && (val & (CMD_RESET | CMD_CRS))) {
+		ehub_xhci_port_snapshot_invalidate(xhci);
+		spin_lock_irqsave(&xhci->reg_shadow_lock, flags);
+		xhci->reg_shadow_valid = 0;
+		spin_unlock_irqrestore(&xhci->reg_shadow_lock, flags);
+		return;
+	}
+
+	ehub_xhci_shadow_store(xhci, regs, val, status >= 0);
+}
+
 unsigned int
 ehub_xhci_readl(
 	const struct xhci_hcd *xhci,
@@ -117,6 +289,9 @@ ehub_xhci_readl(
 		goto Exit;
 	}
 
+	if (ehub_xhci_shadow_read(xhci, regs, false, &rdata))
+		goto Exit;
+
 	status = EMBEDDED_REGISTER_Read( deviceContext,
 									 ( unsigned long )regs,
 									 &rdata );
@@ -126,11 +301,106 @@ ehub_xhci_readl(
 		goto Exit;
 	}
 
+	ehub_xhci_shadow_store(xhci, regs, rdata, true);
+
 Exit:
 
 	return rdata;
 }
 
+/*
+ * Read only the software owned bits of a register; the bits the controller
+ * owns read as 0.  For read-modify-write sequences that discard or overwrite
+ * those bits anyway, so they can be served from the shadow.
+ */
+unsigned int
+ehub_xhci_readl_sw(
+	const struct xhci_hcd *xhci,
+	__le32 *regs
+	)
+{
+	u32 rdata;
+	int index;
+
+	if (ehub_xhci_shadow_read(xhci, regs, true, &rdata))
+		return rdata;
+
+	rdata = ehub_xhci_readl(xhci, regs);
+
+	index = ehub_xhci_shadow_index(xhci, regs);
+	if (index >= 0 && rdata != ~( u32 )0)
+		rdata &= ~ehub_xhci_shadow_table[index].hw_mask;
+
+	return rdata;
+}
+
+/*
+ * Read several registers with the reads pipelined on the wire instead of
+ * paying one USB round trip per register.
+ */
+int
+ehub_xhci_readl_multiple(
+	const struct xhci_hcd *xhci,
+	__le32 **regs,
+	u32 *vals,
+	int count
+	)
+{
+	PDEVICE_CONTEXT deviceContext;
+	u32 addresses[ NUMBER_OF_EMBEDDED_REGISTER_READ ];
+	u32 data[ NUMBER_OF_EMBEDDED_REGISTER_READ ];
+	int pending[ NUMBER_OF_EMBEDDED_REGISTER_READ ];
+	int index;
+	int chunk = 0;
+	int i;
+	int status = 0;
+
+	deviceContext = xhci->DeviceContext;
+
+	status = DEVICECONTEXT_ErrorCheck( deviceContext );
+	if (status < 0)
+	{
+		for (index = 0; index < count; index++)
+			vals[index] = ~(0);
+		goto Exit;
+	}
+
+	/* Only registers the shadow can't answer go on the wire. */
+	for (index = 0; index < count; index++) {
+		if (ehub_xhci_shadow_read(xhci, regs[index], false, &vals[index]))
+			continue;
+
+		pending[chunk] = index;
+		addresses[chunk] = ( unsigned long )regs[index];
+		chunk++;
+
+		if (chunk < NUMBER_OF_EMBEDDED_REGISTER_READ && index + 1 < count)
+			continue;
+
+		status = EMBEDDED_REGISTER_ReadMultiple( deviceContext,
+												 addresses,
+												 data,
+												 chunk );
+		for (i = 0; i < chunk; i++) {
+			vals[pending[i]] = data[i];
+			if (status >= 0)
+				ehub_xhci_shadow_store(xhci, regs[pending[i]], data[i], true);
+		}
+		chunk = 0;
+
+		if (status < 0)
+		{
+			for (i = index + 1; i < count; i++)
+				vals[i] = ~(0);
+			goto Exit;
+		}
+	}
+
+Exit:
+
+	return status;
+}
+
 void
 ehub_xhci_writel(
 	struct xhci_hcd *xhci,
@@ -149,9 +419,15 @@ ehub_xhci_writel(
 		goto Exit;
 	}
 
+#ifdef USE_DELAYED_CACHE_MODE
+	/* The write may point the controller at cached rings, send them first. */
+	ehub_cache_flush(xhci);
+#endif /* USE_DELAYED_CACHE_MODE */
+
 	status = EMBEDDED_REGISTER_Write( deviceContext,
 									  ( unsigned long )regs,
 									  ( u32 * )&val );
+	ehub_xhci_shadow_write(xhci, regs, val, status);
 	if (status < 0)
 	{
 		goto Exit;
@@ -161,6 +437,72 @@ Exit:
 	;
 }
 
+/*
+ * Queue a register write on a batch.  Nothing reaches the device until the
+ * batch fills up or ehub_xhci_write_batch_flush is called, so callers must
+ * flush before anything that depends on the write having landed.
+ */
+void
+ehub_xhci_writel_batch(
+	struct xhci_hcd *xhci,
+	struct ehub_xhci_write_batch *batch,
+	const unsigned int val,
+	__le32 *regs
+	)
+{
+	if (batch->count == NUMBER_OF_EMBEDDED_REGISTER_WRITE_BATCH)
+		ehub_xhci_write_batch_flush(xhci, batch);
+
+	batch->address[ batch->count ] = ( unsigned long )regs;
+	batch->data[ batch->count ] = val;
+	batch->count++;
+}
+
+void
+ehub_xhci_write_batch_flush(
+	struct xhci_hcd *xhci,
+	struct ehub_xhci_write_batch *batch
+	)
+{
+	PDEVICE_CONTEXT deviceContext;
+	int index;
+	int status;
+
+	deviceContext = xhci->DeviceContext;
+
+	if (batch->count == 0)
+		goto Exit;
+
+	status = DEVICECONTEXT_ErrorCheck( deviceContext );
+	if (status < 0)
+	{
+		goto Exit;
+	}
+
+#ifdef USE_DELAYED_CACHE_MODE
+	/* Same as ehub_xhci_writel, cached rings go ahead of the writes. */
+	ehub_cache_flush(xhci);
+#endif /* USE_DELAYED_CACHE_MODE */
+
+	status = EMBEDDED_REGISTER_WriteBatch( deviceContext,
+										   batch->address,
+										   batch->data,
+										   batch->count );
+	for (index = 0; index < batch->count; index++)
+		ehub_xhci_shadow_write(xhci,
+							   ( __le32 * )( unsigned long )batch->address[ index ],
+							   batch->data[ index ],
+							   status);
+	if (status < 0)
+	{
+		goto Exit;
+	}
+
+Exit:
+
+	batch->count = 0;
+}
+
 void
 ehub_xhci_writel_doorbell(
 	struct xhci_hcd *xhci,
@@ -179,6 +521,11 @@ ehub_xhci_writel_doorbell(
 		goto Exit;
 	}
 
+#ifdef USE_DELAYED_CACHE_MODE
+	/* The TRBs this doorbell starts must reach the cache ahead of it. */
+	ehub_cache_flush(xhci);
+#endif /* USE_DELAYED_CACHE_MODE */
+
 	status = EMBEDDED_REGISTER_Write_Doorbell( deviceContext,
 											   ( unsigned long )regs,
 											   ( u32 * )&val );
@@ -225,15 +572,30 @@ int ehub_xhci_reset_device(struct usb_hcd *hcd)
 
 	xhci->cap_regs = hcd->regs;
 
-	/* Cache read-only capability registers */
-	xhci->hc_capbase    = xhci_readl(xhci, &xhci->cap_regs->hc_capbase);
-	xhci->hci_version   = HC_VERSION(xhci->hc_capbase);
-	xhci->hcs_params1   = xhci_readl(xhci, &xhci->cap_regs->hcs_params1);
-	xhci->hcs_params2   = xhci_readl(xhci, &xhci->cap_regs->hcs_params2);
-	xhci->hcs_params3   = xhci_readl(xhci, &xhci->cap_regs->hcs_params3);
-	xhci->hcc_params    = xhci_readl(xhci, &xhci->cap_regs->hcc_params);
-	xhci->db_off        = xhci_readl(xhci, &xhci->cap_regs->db_off);
-	xhci->run_regs_off  = xhci_readl(xhci, &xhci->cap_regs->run_regs_off);
+	/* Cache read-only capability registers, all reads in flight at once. */
+	{
+		__le32 *cap_regs[] = {
+			&xhci->cap_regs->hc_capbase,
+			&xhci->cap_regs->hcs_params1,
+			&xhci->cap_regs->hcs_params2,
+			&xhci->cap_regs->hcs_params3,
+			&xhci->cap_regs->hcc_params,
+			&xhci->cap_regs->db_off,
+			&xhci->cap_regs->run_regs_off,
+		};
+		u32 cap_vals[ARRAY_SIZE(cap_regs)];
+
+		ehub_xhci_readl_multiple(xhci, cap_regs, cap_vals, ARRAY_SIZE(cap_regs));
+
+		xhci->hc_capbase    = cap_vals[0];
+		xhci->hci_version   = HC_VERSION(xhci->hc_capbase);
+		xhci->hcs_params1   = cap_vals[1];
+		xhci->hcs_params2   = cap_vals[2];
+		xhci->hcs_params3   = cap_vals[3];
+		xhci->hcc_params    = cap_vals[4];
+		xhci->db_off        = cap_vals[5];
+		xhci->run_regs_off  = cap_vals[6];
+	}
 
 	xhci->op_regs = hcd->regs +
 		HC_LENGTH(xhci->hc_capbase);
@@ -355,6 +717,8 @@ int ehub_xhci_add(
 
 	dev_dbg(dev, "xhci=0x%p\n", xhci );
 	xhci->DeviceContext = DeviceContext;
+	spin_lock_init(&xhci->reg_shadow_lock);
+	init_waitqueue_head(&xhci->handshake_wait);
 	dev_dbg(dev, "xhci->DeviceContext=0x%p\n", xhci->DeviceContext );
 	*((struct xhci_hcd **) hcd->hcd_priv) = xhci;
 	xhci->main_hcd = hcd;
@@ -418,6 +782,9 @@ ehub_xhci_remove(
 	dev_dbg(dev, "hcd=0x%p\n", hcd );
 	dev_dbg(dev, "xhci=0x%p\n", xhci );
 
+	dev_dbg(dev, "Transfer event batches %u, events %u, largest %u\n",
+			xhci->event_batches, xhci->event_batch_events, xhci->event_batch_largest);
+
 	hcd->rh_pollable = 0;
 	dev_warn(dev, "Calling usb_remove_hcd\n");
 	usb_remove_hcd( hcd );
@@ -439,13 +806,147 @@ ehub_xhci_remove(
 }
 
 #ifdef USE_TRB_CACHE_MODE
+/*
+ * Doorbell command to append to a cache write, or NULL when the doorbell is
+ * rung from URB_CompletionRoutine_Cache instead.
+ */
+static PEMBEDDED_REGISTER_DATA_TRANSFER
+ehub_cache_work_doorbell(
+	struct cache_write_context *ehub_cache_work,
+	PEMBEDDED_REGISTER_DATA_TRANSFER doorbell
+)
+{
+#ifdef USE_CACHE_WRITE_DOORBELL
+	if (ehub_cache_work->ring_doorbell) {
+		EMBEDDED_REGISTER_FillWrite(doorbell,
+									ehub_cache_work->doorbell_reg,
+									ehub_cache_work->doorbell_val);
+		return doorbell;
+	}
+#endif /* USE_CACHE_WRITE_DOORBELL */
+	return NULL;
+}
+
+#ifdef USE_DELAYED_CACHE_MODE
+/*
+ * Pack the pending cache writes, oldest first, into as few transfers as
+ * their records fit in.  Each record was built in its entry's own buffer
+ * when queued.  The first entry of a transfer carries it, the others are
+ * copied behind it and wait on its batch list until it completes.  A
+ * doorbell ends a transfer, riding behind the records of the ring it
+ * starts, so every ring sees its writes in queue order.  Called with
+ * cache_list_lock held.
+ */
+static int
+ehub_cache_flush_locked(
+	struct xhci_hcd *xhci
+)
+{
+	struct cache_write_context *carrier, *ehub_cache_work;
+	EMBEDDED_REGISTER_DATA_TRANSFER doorbell;
+	PEMBEDDED_REGISTER_DATA_TRANSFER doorbellRecord;
+	u32 transferLength;
+	u32 records;
+	u8 *buffer;
+	int status = 0;
+	int length;
+
+	while (!list_empty(&xhci->cache_queue_pending)) {
+		carrier = list_first_entry(&xhci->cache_queue_pending,
+								   struct cache_write_context,
+								   list);
+		buffer = (u8 *)carrier->UrbContext->DataBuffer;
+		transferLength = 0;
+		records = 0;
+
+		do {
+			ehub_cache_work = list_first_entry(&xhci->cache_queue_pending,
+											   struct cache_write_context,
+											   list);
+			if (ehub_cache_work != carrier &&
+				transferLength + EMBEDDED_CACHE_RECORD_LENGTH(ehub_cache_work->DataBufferLength) >
+				EHUB_CACHE_BATCH_LENGTH)
+				break;
+
+			xhci->cache_pending_length -= EMBEDDED_CACHE_RECORD_LENGTH(ehub_cache_work->DataBufferLength);
+			list_move_tail(&ehub_cache_work->list,
+						   ehub_cache_work == carrier ? &xhci->cache_queue_used : &carrier->batch);
+
+			if (ehub_cache_work != carrier)
+				memcpy(buffer + transferLength,
+					   ehub_cache_work->UrbContext->DataBuffer,
+					   ehub_cache_work->RecordLength);
+			transferLength += ehub_cache_work->RecordLength;
+			records++;
+
+			if (ehub_cache_work->ring_doorbell) {
+				doorbellRecord = ehub_cache_work_doorbell(ehub_cache_work, &doorbell);
+				if (NULL != doorbellRecord) {
+					memcpy(buffer + transferLength, doorbellRecord, sizeof(EMBEDDED_REGISTER_DATA_TRANSFER));
+					transferLength += sizeof(EMBEDDED_REGISTER_DATA_TRANSFER);
+				}
+				break;
+			}
+		} while (!list_empty(&xhci->cache_queue_pending));
+
+		dev_dbg(dev_ctx_to_dev(xhci->DeviceContext),
+				"d_cw cw=0x%p records=%u len=0x%0X pending=0x%0X\n",
+				carrier, records, transferLength, xhci->cache_pending_length);
+
+		length = EMBEDDED_CACHE_Submit(xhci->DeviceContext,
+									   carrier->UrbContext,
+									   transferLength);
+		if (length < 0) {
+			status = length;
+			list_move_tail(&carrier->list, &xhci->cache_queue_free);
+			list_splice_tail_init(&carrier->batch, &xhci->cache_queue_free);
+			continue;
+		}
+
+		xhci->cache_batches++;
+		xhci->cache_batch_records += records;
+		if (records > xhci->cache_batch_largest)
+			xhci->cache_batch_largest = records;
+	}
+
+	return status;
+}
+
+/*
+ * Send every pending cache write now, ahead of a register write that
+ * depends on them.
+ */
+int
+ehub_cache_flush(
+	struct xhci_hcd *xhci
+)
+{
+	unsigned long flags;
+	int status;
+
+	spin_lock_irqsave(&xhci->cache_list_lock, flags);
+	status = ehub_cache_flush_locked(xhci);
+	spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
+
+	return status;
+}
+
+static enum hrtimer_restart ehub_cache_flush_timeout(struct hrtimer *timer)
+{
+	struct xhci_hcd *xhci = container_of(timer, struct xhci_hcd, cache_flush_timer);
+
+	queue_work(xhci->ehub_cache_wq, &xhci->ehub_cache_work.work);
+
+	return HRTIMER_NORESTART;
+}
+#endif /* USE_DELAYED_CACHE_MODE */
+
 static void ehub_delayed_cache_write(struct work_struct *work)
 {
+#ifdef USE_DELAYED_CACHE_MODE
 	struct xhci_hcd *xhci;
+	struct cache_write_context *temp_context;
 	unsigned long flags;
-	unsigned long total_length = 0;
-	struct cache_write_context *ehub_cache_work, *temp_context, *next;
-	LIST_HEAD(tmp_list);
 
 	temp_context = container_of(work,
 								 struct cache_write_context,
@@ -453,42 +954,13 @@ static void ehub_delayed_cache_write(struct work_struct *work)
 
 	xhci = dev_ctx_to_xhci(temp_context->DeviceContext);
 
-	spin_lock_irqsave( &xhci->cache_list_lock, flags );
-
-	/* Cut all the pending entries from the list and put them in tmp_list so
-	 * there is no confusion about what we need to do.
-	 */
-	list_cut_position(&tmp_list, &xhci->cache_queue_used, xhci->cache_queue_used.prev);
-
-	spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
-
-	list_for_each_entry_safe(ehub_cache_work, next, &tmp_list, list) {
-
-		dev_dbg(dev_ctx_to_dev(temp_context->DeviceContext),
-				 "d_cw cw=0x%p CA=0x%0X Buf=0x%p len=0x%0X DB=%d SL=%d EP=%d Stream=0x%X\n",
-				 ehub_cache_work,
-				 ehub_cache_work->CacheAddress,
-				 ehub_cache_work->DataBuffer,
-				 ehub_cache_work->DataBufferLength,
-				 ehub_cache_work->ring_doorbell,
-				 ehub_cache_work->slot_id,
-				 ehub_cache_work->ep_index,
-				 ehub_cache_work->stream_id);
-		total_length += sizeof(EMBEDDED_CACHE_TRANSFER) + ehub_cache_work->DataBufferLength;
-
-		if (total_length > MESSAGE_DATA_BUFFER_SIZE_CACHE)
-			break;
-
-		list_del_init(&ehub_cache_work->list);
-
-		if (!EMBEDDED_CACHE_Write(ehub_cache_work->DeviceContext,
-								  ehub_cache_work->UrbContext,
-								  ehub_cache_work->CacheAddress,
-								  ehub_cache_work->DataBuffer,
-								  ehub_cache_work->DataBufferLength,
-								  ehub_cache_work->TrbCycleState)) {
-		}
+	spin_lock_irqsave(&xhci->cache_list_lock, flags);
+	if (!list_empty(&xhci->cache_queue_pending)) {
+		xhci->cache_flush_timer_count++;
+		ehub_cache_flush_locked(xhci);
 	}
+	spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
+#endif /* USE_DELAYED_CACHE_MODE */
 }
 
 struct cache_write_context *
@@ -552,6 +1024,11 @@ ehub_queue_cache_write(
 {
 	struct xhci_hcd *xhci;
 	struct cache_write_context *ehub_cache_work;
+#ifdef USE_DELAYED_CACHE_MODE
+	unsigned long flags;
+#else /* ! USE_DELAYED_CACHE_MODE */
+	EMBEDDED_REGISTER_DATA_TRANSFER doorbell;
+#endif /* ! USE_DELAYED_CACHE_MODE */
 	int status = 0;
 
 	xhci = dev_ctx_to_xhci(DeviceContext);
@@ -576,6 +1053,18 @@ ehub_queue_cache_write(
 	ehub_cache_work->ep_index = ep_index;
 	ehub_cache_work->stream_id = stream_id;
 
+#ifdef USE_CACHE_WRITE_DOORBELL
+	/* Decide under xhci->lock whether the doorbell may be rung; it is
+	 * then sent in the same transfer, right behind the TRBs. */
+	if (ring_doorbell)
+		ehub_cache_work->ring_doorbell = ehub_xhci_doorbell_value(xhci,
+																  slot_id,
+																  ep_index,
+																  stream_id,
+																  &ehub_cache_work->doorbell_reg,
+																  &ehub_cache_work->doorbell_val);
+#endif /* USE_CACHE_WRITE_DOORBELL */
+
 	dev_dbg(dev_ctx_to_dev(DeviceContext), "q_cw from %ps cw=0x%p CA=0x%0X Buf=0x%p len=0x%0X DB=%d SL=%d EP=%d Stream=0x%0X\n",
 			 __builtin_return_address(0),
 			 ehub_cache_work,
@@ -588,14 +1077,53 @@ ehub_queue_cache_write(
 			 ehub_cache_work->stream_id);
 
 #ifdef USE_DELAYED_CACHE_MODE
-	queue_work(xhci->ehub_cache_wq, &xhci->ehub_cache_work.work);
+	/* The caller's buffer may be freed before the flush, so build the
+	 * record now, in this entry's own buffer. */
+	status = EMBEDDED_CACHE_FillRecord(DeviceContext,
+									   (u8 *)ehub_cache_work->UrbContext->DataBuffer,
+									   CacheAddress,
+									   DataBuffer,
+									   DataBufferLength,
+									   TrbCycleState);
+	ehub_cache_work->DataBuffer = NULL;
+
+	/* Send at once when the records fill a transfer or a doorbell needs
+	 * them, otherwise give later writes cache_flush_us to join. */
+	spin_lock_irqsave(&xhci->cache_list_lock, flags);
+	if (status < 0) {
+		list_move_tail(&ehub_cache_work->list, &xhci->cache_queue_free);
+		spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
+		DeviceContext->ErrorFlags.EmbeddedCacheWriteError = 1;
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR: Cache Write failed %d\n", status);
+		return status;
+	}
+	ehub_cache_work->RecordLength = status;
+	status = 0;
+	list_move_tail(&ehub_cache_work->list, &xhci->cache_queue_pending);
+	ASSERT(EMBEDDED_CACHE_RECORD_LENGTH(DataBufferLength) <= EHUB_CACHE_BATCH_LENGTH);
+	xhci->cache_pending_length += EMBEDDED_CACHE_RECORD_LENGTH(DataBufferLength);
+	if (ehub_cache_work->ring_doorbell) {
+		xhci->cache_flush_doorbell_count++;
+		status = ehub_cache_flush_locked(xhci);
+	} else if (xhci->cache_pending_length >= EHUB_CACHE_BATCH_LENGTH) {
+		xhci->cache_flush_full_count++;
+		status = ehub_cache_flush_locked(xhci);
+	} else if (!hrtimer_active(&xhci->cache_flush_timer)) {
+		hrtimer_start(&xhci->cache_flush_timer,
+					  ns_to_ktime((u64)cache_flush_us * NSEC_PER_USEC),
+					  HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
+	if (status < 0)
+		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR: Cache Write failed %d\n", status);
 #else /* ! USE_DELAYED_CACHE_MODE */
 	status = EMBEDDED_CACHE_Write(ehub_cache_work->DeviceContext,
 								  ehub_cache_work->UrbContext,
 								  ehub_cache_work->CacheAddress,
 								  ehub_cache_work->DataBuffer,
 								  ehub_cache_work->DataBufferLength,
-								  ehub_cache_work->TrbCycleState);
+								  ehub_cache_work->TrbCycleState,
+								  ehub_cache_work_doorbell(ehub_cache_work, &doorbell));
 	if (status < 0)
 		dev_err(dev_ctx_to_dev(DeviceContext), "ERROR: Cache Write failed %d\n", status);
 #endif /* ! USE_DELAYED_CACHE_MODE */
@@ -610,38 +1138,49 @@ URB_CompletionRoutine_Cache(
 {
 	//struct cache_write_context *ehub_cache_work = (struct cache_write_context *)(Urb->context);
 	struct cache_write_context *ehub_cache_work = Urb->context;
+	struct cache_write_context *doorbell_work = ehub_cache_work;
 	struct xhci_hcd *xhci = dev_ctx_to_xhci(ehub_cache_work->DeviceContext);
 	unsigned long flags;
 
+	USB_OutPipeDone(ehub_cache_work->DeviceContext, Urb);
+
 	if (DEVICECONTEXT_ErrorCheck(ehub_cache_work->DeviceContext) < 0)
 		return;
 
-#ifndef USE_DELAYED_CACHE_MODE
 	spin_lock_irqsave(&xhci->cache_list_lock, flags);
 	list_del_init(&ehub_cache_work->list);
 	spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
-#endif /* ! USE_DELAYED_CACHE_MODE */
 
 	dev_dbg(dev_ctx_to_dev(ehub_cache_work->DeviceContext), "ehub_cache_work 0x%p\n", ehub_cache_work);
 
-	if (ehub_cache_work->ring_doorbell) {
-		if (~(0) != ehub_cache_work->stream_id) {
+#ifdef USE_DELAYED_CACHE_MODE
+	/* Only the last write of a batch can ask for a doorbell. */
+	if (!list_empty(&ehub_cache_work->batch))
+		doorbell_work = list_last_entry(&ehub_cache_work->batch,
+										struct cache_write_context,
+										list);
+#endif /* USE_DELAYED_CACHE_MODE */
+
+#ifndef USE_CACHE_WRITE_DOORBELL
+	if (doorbell_work->ring_doorbell) {
+		if (~(0) != doorbell_work->stream_id) {
 			dev_dbg(dev_ctx_to_dev(ehub_cache_work->DeviceContext), "d_cw Ring Doorbell cw=0x%p SL=%d EP=%d\n",
-					ehub_cache_work,
-					ehub_cache_work->slot_id,
-					ehub_cache_work->ep_index);
+					doorbell_work,
+					doorbell_work->slot_id,
+					doorbell_work->ep_index);
 
 			ehub_xhci_ring_ep_doorbell(xhci,
-									   ehub_cache_work->slot_id,
-									   ehub_cache_work->ep_index,
-									   ehub_cache_work->stream_id);
+									   doorbell_work->slot_id,
+									   doorbell_work->ep_index,
+									   doorbell_work->stream_id);
 		} else {
 			dev_dbg(dev_ctx_to_dev(ehub_cache_work->DeviceContext), "d_cw Ring Command Doorbell cw=0x%p\n",
-					ehub_cache_work);
+					doorbell_work);
 
 			ehub_xhci_ring_cmd_db_low(xhci);
 		}
 	}
+#endif /* ! USE_CACHE_WRITE_DOORBELL */
 
 	ehub_cache_work->UrbContext->Status = URB_STATUS_COMPLETE;
 
@@ -649,6 +1188,7 @@ URB_CompletionRoutine_Cache(
 
 	spin_lock_irqsave(&xhci->cache_list_lock, flags);
 	list_add_tail(&ehub_cache_work->list, &xhci->cache_queue_free);
+	list_splice_tail_init(&ehub_cache_work->batch, &xhci->cache_queue_free);
 	spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
 }
 
@@ -681,13 +1221,15 @@ ehub_xhci_cache_work_expand(
 		ehub_cache_work->DeviceContext = xhci->DeviceContext;
 
 		INIT_LIST_HEAD(&ehub_cache_work->list);
+		INIT_LIST_HEAD(&ehub_cache_work->batch);
 
 		INIT_WORK(&ehub_cache_work->work, ehub_delayed_cache_write);
 
 		ehub_cache_work->UrbContext = URB_Create(ehub_cache_work->DeviceContext,
 												 ehub_cache_work->DeviceContext->UsbContext.UsbDevice,
 												 ehub_cache_work->DeviceContext->UsbContext.UsbPipeCacheOut,
-												 sizeof(EMBEDDED_CACHE_TRANSFER) + MESSAGE_DATA_BUFFER_SIZE_CACHE,
+												 sizeof(EMBEDDED_CACHE_TRANSFER) + MESSAGE_DATA_BUFFER_SIZE_CACHE +
+												 sizeof(EMBEDDED_REGISTER_DATA_TRANSFER),
 												 URB_CompletionRoutine_Cache,
 												 ehub_cache_work,
 												 flags);
@@ -704,7 +1246,51 @@ ehub_xhci_cache_work_expand(
 }
 
 
-/* TODO: Use lib/genalloc.c for cache management. */
+/*
+ * The cache blocks are tracked in a bitmap, one bit per block, so a
+ * contiguous run of blocks is found with a single scan of a few words.
+ * Both helpers are called with cache_list_lock held.
+ */
+static PEHUB_CACHE_BLOCK
+ehub_xhci_cache_run_take(
+	struct xhci_hcd *xhci,
+	unsigned int count
+	)
+{
+	unsigned long start;
+
+	start = bitmap_find_next_zero_area(xhci->cache_map,
+									   EHUB_CACHE_NUMBER_OF_BLOCKS,
+									   0,
+									   count,
+									   0);
+	if (start >= EHUB_CACHE_NUMBER_OF_BLOCKS)
+		return NULL;
+
+	bitmap_set(xhci->cache_map, start, count);
+	xhci->number_of_caches_free -= count;
+	xhci->number_of_caches_used += count;
+
+	return &xhci->cache_blocks[start];
+}
+
+static void
+ehub_xhci_cache_run_put(
+	struct xhci_hcd *xhci,
+	PEHUB_CACHE_BLOCK EhubCacheBlock,
+	unsigned int count
+	)
+{
+	unsigned int index;
+
+	for (index = 0; index < count; index++)
+		EhubCacheBlock[index].urb = NULL;
+
+	bitmap_clear(xhci->cache_map, EhubCacheBlock->IndexOfBlock, count);
+	xhci->number_of_caches_used -= count;
+	xhci->number_of_caches_free += count;
+}
+
 int
 ehub_xhci_cache_create(
 	struct xhci_hcd *xhci
@@ -713,16 +1299,19 @@ ehub_xhci_cache_create(
 	u32* cacheControlRegisterOffset;
 	int indexOfBlock;
 
-	INIT_LIST_HEAD( &xhci->cache_list_free );
-	INIT_LIST_HEAD( &xhci->cache_list_used );
-
 	spin_lock_init( &xhci->cache_list_lock );
 
 	INIT_LIST_HEAD( &xhci->cache_queue_free );
 	INIT_LIST_HEAD( &xhci->cache_queue_used );
+	INIT_LIST_HEAD( &xhci->cache_queue_pending );
+	xhci->cache_pending_length = 0;
 
 	xhci->ehub_cache_work.DeviceContext = xhci->DeviceContext;
 	INIT_WORK(&xhci->ehub_cache_work.work, ehub_delayed_cache_write);
+#ifdef USE_DELAYED_CACHE_MODE
+	hrtimer_init(&xhci->cache_flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	xhci->cache_flush_timer.function = ehub_cache_flush_timeout;
+#endif /* USE_DELAYED_CACHE_MODE */
 
 	xhci->number_of_caches_free = 0;
 	xhci->number_of_caches_used = 0;
@@ -740,21 +1329,21 @@ ehub_xhci_cache_create(
 	if (0 > ehub_xhci_cache_work_expand(xhci, EHUB_CACHE_QUEUE_ENTRIES, GFP_KERNEL))
 		return -ENOMEM;
 
-	for (indexOfBlock = 0; indexOfBlock < EHUB_CACHE_NUMBER_OF_BLOCKS; indexOfBlock++) {
-		PEHUB_CACHE_BLOCK cacheBlock;
+	xhci->cache_blocks = kcalloc(EHUB_CACHE_NUMBER_OF_BLOCKS,
+								 sizeof(EHUB_CACHE_BLOCK),
+								 GFP_KERNEL);
+	if (NULL == xhci->cache_blocks)
+		return -ENOMEM;
 
-		cacheBlock = kmalloc(sizeof(EHUB_CACHE_BLOCK),
-							 GFP_KERNEL);
+	bitmap_zero(xhci->cache_map, EHUB_CACHE_NUMBER_OF_BLOCKS);
+
+	for (indexOfBlock = 0; indexOfBlock < EHUB_CACHE_NUMBER_OF_BLOCKS; indexOfBlock++) {
+		PEHUB_CACHE_BLOCK cacheBlock = &xhci->cache_blocks[indexOfBlock];
 
 		cacheBlock->IndexOfBlock = indexOfBlock;
 		cacheBlock->urb = NULL;
 		cacheBlock->Address = EHUB_CACHE_START_ADDRESS + (EHUB_CACHE_BLOCK_SIZE * indexOfBlock);
 
-		INIT_LIST_HEAD(&cacheBlock->list);
-
-		list_add_tail(&cacheBlock->list,
-					  &xhci->cache_list_free);
-
 		xhci->number_of_caches_free++;
 	}
 
@@ -766,27 +1355,34 @@ ehub_xhci_cache_destroy(
 	struct xhci_hcd *xhci
 	)
 {
-	PEHUB_CACHE_BLOCK p, ehubCacheBlock;
 	struct cache_write_context *q, *ehub_cache_work;
 
 	FUNCTION_ENTRY;
 
+#ifdef USE_DELAYED_CACHE_MODE
+	hrtimer_cancel(&xhci->cache_flush_timer);
+#endif /* USE_DELAYED_CACHE_MODE */
+
 	if (xhci->ehub_cache_wq)
 		destroy_workqueue(xhci->ehub_cache_wq);
 
-	list_for_each_entry_safe(ehubCacheBlock, p, &xhci->cache_list_free, list) {
-		if (NULL != ehubCacheBlock) {
-			list_del_init(&ehubCacheBlock->list);
-			kfree(ehubCacheBlock);
-		}
-	}
+	xhci_dbg(xhci, "CACHE: OUT payloads pushed %u, left to device reads %u\n",
+			 xhci->cache_push_count, xhci->cache_push_fallback);
+	xhci_dbg(xhci, "CACHE: URBs spilled to host memory %u, bytes %llu, TRBs %u\n",
+			 xhci->cache_spill_count, xhci->cache_spill_bytes, xhci->cache_spill_trbs);
+	xhci_dbg(xhci, "CACHE: endpoints rejected %u, data quotas denied %u\n",
+			 xhci->cache_admit_rejected, xhci->cache_quota_denied);
+	xhci_dbg(xhci, "CACHE: %u batched transfers, %u writes, largest %u, flushed full %u doorbell %u timer %u\n",
+			 xhci->cache_batches, xhci->cache_batch_records, xhci->cache_batch_largest,
+			 xhci->cache_flush_full_count, xhci->cache_flush_doorbell_count, xhci->cache_flush_timer_count);
 
-	list_for_each_entry_safe(ehubCacheBlock, p, &xhci->cache_list_used, list) {
-		if (NULL != ehubCacheBlock) {
-			list_del_init(&ehubCacheBlock->list);
-			kfree(ehubCacheBlock);
-		}
-	}
+	kfree(xhci->cache_blocks);
+	xhci->cache_blocks = NULL;
+
+	/* Writes still waiting, or riding on an unfinished transfer. */
+	list_splice_tail_init(&xhci->cache_queue_pending, &xhci->cache_queue_used);
+	list_for_each_entry(ehub_cache_work, &xhci->cache_queue_used, list)
+		list_splice_tail_init(&ehub_cache_work->batch, &xhci->cache_queue_free);
 
 	list_for_each_entry_safe(ehub_cache_work, q, &xhci->cache_queue_free, list)
 	{
@@ -823,27 +1419,16 @@ ehub_xhci_cache_block_allocate(
 
 	spin_lock_irqsave( &xhci->cache_list_lock, flags );
 
-	if ( list_empty( &xhci->cache_list_free ) )
+	cacheBlock = ehub_xhci_cache_run_take(xhci, 1);
+	if ( NULL == cacheBlock )
 	{
-		cacheBlock = NULL;
 		spin_unlock_irqrestore( &xhci->cache_list_lock, flags );
 		dev_warn(dev_ctx_to_dev(xhci->DeviceContext),
-				 "WARNING cache_list_free is empty. used=%d free=%d\n",
+				 "WARNING cache is full. used=%d free=%d\n",
 				 xhci->number_of_caches_used, xhci->number_of_caches_free);
 		goto Exit;
 	}
 
-	cacheBlock = list_first_entry( &xhci->cache_list_free,
-								   EHUB_CACHE_BLOCK,
-								   list );
-
-	cacheBlock->urb = NULL;
-
-	list_move_tail( &cacheBlock->list,
-				   &xhci->cache_list_used );
-	xhci->number_of_caches_free--;
-	xhci->number_of_caches_used++;
-
 	dev_dbg(dev_ctx_to_dev(xhci->DeviceContext), "Alloc Block : %d used=%d free=%d\n",
 			cacheBlock->IndexOfBlock, xhci->number_of_caches_used, xhci->number_of_caches_free);
 
@@ -854,42 +1439,45 @@ Exit:
 	return cacheBlock;
 }
 
+/*
+ * Cache block for a TRB segment.  Only its first TRB is uploaded here, so
+ * a ring that starts on it finds no stale TRB; the link TRB follows from
+ * xhci_link_segments and the other TRBs as they are written, see
+ * ehub_xhci_cache_copy_from_ring.
+ */
 PEHUB_CACHE_BLOCK
 ehub_xhci_cache_block_allocate_segment(
 	struct xhci_hcd *xhci,
 	int cycle_state,
-	void *start_addr
+	void *start_addr,
+	enum xhci_ring_type type
 	)
 {
-	PEHUB_CACHE_BLOCK cacheBlock;
+	PEHUB_CACHE_BLOCK cacheBlock = NULL;
 	unsigned long flags;
 	int status;
 
 	spin_lock_irqsave( &xhci->cache_list_lock, flags );
 
-	if ( list_empty( &xhci->cache_list_free ) )
+	/* The last blocks are kept for control rings. */
+	if (TYPE_CTRL == type ||
+		xhci->number_of_caches_free > EHUB_CACHE_CONTROL_RESERVE_BLOCKS)
+		cacheBlock = ehub_xhci_cache_run_take(xhci, 1);
+	if ( NULL == cacheBlock )
 	{
-		cacheBlock = NULL;
 		spin_unlock_irqrestore( &xhci->cache_list_lock, flags );
 		dev_warn(dev_ctx_to_dev(xhci->DeviceContext),
-				 "WARNING cache_list_free is empty. used=%d free=%d\n",
+				 "WARNING cache is full. used=%d free=%d\n",
 				 xhci->number_of_caches_used, xhci->number_of_caches_free);
 		goto Exit;
 	}
 
-	cacheBlock = list_first_entry( &xhci->cache_list_free,
-								   EHUB_CACHE_BLOCK,
-								   list );
-	list_move_tail( &cacheBlock->list,
-				   &xhci->cache_list_used );
-	xhci->number_of_caches_free--;
-	xhci->number_of_caches_used++;
 	spin_unlock_irqrestore( &xhci->cache_list_lock, flags );
 
 	status = ehub_queue_cache_write(xhci->DeviceContext,
 									cacheBlock->Address,
 									start_addr,
-									EHUB_CACHE_BLOCK_SIZE,
+									sizeof(union xhci_trb),
 									cycle_state,
 									false,
 									0,
@@ -898,10 +1486,7 @@ ehub_xhci_cache_block_allocate_segment(
 	if (status < 0) {
 		spin_lock_irqsave(&xhci->cache_list_lock, flags);
 		dev_err(dev_ctx_to_dev(xhci->DeviceContext), "ERROR EMBEDDED_CACHE_Write fail %d\n", status);
-		list_move_tail(&cacheBlock->list,
-					   &xhci->cache_list_free);
-		xhci->number_of_caches_used--;
-		xhci->number_of_caches_free++;
+		ehub_xhci_cache_run_put(xhci, cacheBlock, 1);
 		cacheBlock = NULL;
 		spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
 		goto Exit;
@@ -915,10 +1500,53 @@ Exit:
 	return cacheBlock;
 }
 
+/*
+ * Bytes of the URB data to place in a cache run of @room bytes.  An isoch
+ * URB is cut at a frame boundary, so none of its TRBs straddles the cache
+ * and host memory.
+ */
+static u32
+ehub_xhci_cache_urb_length(
+	struct urb *urb,
+	u32 room
+)
+{
+	u32 length = urb->transfer_buffer_length;
+	u32 end;
+	int i;
+
+	if (length <= room)
+		return length;
+
+	if (!usb_pipeisoc(urb->pipe))
+		return room;
+
+	length = 0;
+	for (i = 0; i < urb->number_of_packets; i++) {
+		end = urb->iso_frame_desc[i].offset + urb->iso_frame_desc[i].length;
+		if (end > room)
+			break;
+		length = max(length, end);
+	}
+
+	return length;
+}
+
+/*
+ * Take one contiguous run of cache blocks for the URB payload and write
+ * the payload into it, as few cache writes as the cache URB allows.
+ *
+ * With @spill set, a payload longer than EHUB_CACHE_MAX_DATA_BLOCKS, or a
+ * cache without a long enough free run, places only the start of the
+ * payload in the cache; the rest, possibly all of it, is read by the
+ * device from host memory.  Without it the whole payload is cached or the
+ * call fails with -ENOMEM.
+ */
 int
 ehub_xhci_cache_block_allocate_urb(
 	struct xhci_hcd *xhci,
-	struct urb *urb
+	struct urb *urb,
+	bool spill
 )
 {
 	unsigned long flags;
@@ -928,57 +1556,93 @@ ehub_xhci_cache_block_allocate_urb(
 	u32 length = urb->transfer_buffer_length;
 	struct urb_priv* urb_priv = urb->hcpriv;
 	int num_blocks_needed = DIV_ROUND_UP(urb->transfer_buffer_length, EHUB_CACHE_BLOCK_SIZE);
+	int num_blocks;
+	int limit;
+	PEHUB_CACHE_BLOCK cacheBlock = NULL;
+	struct xhci_virt_ep *virt_ep;
+	u32 cache_address;
 	u32 cache_length;
 
 	xhci_dbg(xhci, "CACHE: need %d blocks urb=0x%p\n", num_blocks_needed, urb);
-	ASSERT(num_blocks_needed < EHUB_CACHE_MAX_DATA_BLOCKS);
 
-	/* First, allocate all the blocks needed to make sure there are enough available. */
+	num_blocks = min(num_blocks_needed, EHUB_CACHE_MAX_DATA_BLOCKS);
+	if (!spill && num_blocks < num_blocks_needed)
+		return -ENOMEM;
+
+	virt_ep = &xhci->devs[urb->dev->slot_id]->eps[ehub_xhci_get_endpoint_index(&urb->ep->desc)];
+
 	spin_lock_irqsave(&xhci->cache_list_lock, flags);
 
-	if (xhci->number_of_caches_free < num_blocks_needed) {
-		status = -ENOMEM;
-		xhci_err(xhci,
-				 "ERROR not enough cache blocks. used=%d free=%d\n",
-				 xhci->number_of_caches_used, xhci->number_of_caches_free);
-		goto Exit;
+	/* Leave the TRB segment reserve alone, and keep an isoch OUT
+	 * endpoint within the quota it was admitted with. */
+	limit = xhci->number_of_caches_free - EHUB_CACHE_SEGMENT_RESERVE_BLOCKS;
+	if (virt_ep->cache_data)
+		limit = min(limit, (int)virt_ep->cache_quota - (int)virt_ep->cache_data_used);
+	if (num_blocks > limit)
+		num_blocks = spill ? max(limit, 0) : 0;
+
+	/* Take the longest run that is free, down to a single block. */
+	for (; num_blocks > 0; num_blocks--) {
+		cacheBlock = ehub_xhci_cache_run_take(xhci, num_blocks);
+		if (NULL != cacheBlock || !spill)
+			break;
 	}
 
-	for (i = 0; i < num_blocks_needed; i++) {
-		if (list_empty(&xhci->cache_list_free)) {
-			ASSERT(NULL == urb_priv->EhubDataCacheBlock[i]);
-			spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
-			status = -ENOMEM;
-			dev_warn(dev_ctx_to_dev(xhci->DeviceContext),
-					 "WARNING cache_list_free is empty. used=%d free=%d\n",
-					 xhci->number_of_caches_used, xhci->number_of_caches_free);
-			ehub_xhci_cache_block_free_by_urb(xhci, urb->hcpriv);
-			goto Exit;
+	if (NULL == cacheBlock) {
+		num_blocks = 0;
+		length = 0;
+	} else {
+		int num_blocks_used;
+
+		length = ehub_xhci_cache_urb_length(urb, num_blocks * EHUB_CACHE_BLOCK_SIZE);
+		num_blocks_used = DIV_ROUND_UP(length, EHUB_CACHE_BLOCK_SIZE);
+		if (num_blocks_used < num_blocks) {
+			ehub_xhci_cache_run_put(xhci, cacheBlock + num_blocks_used, num_blocks - num_blocks_used);
+			num_blocks = num_blocks_used;
 		}
+	}
 
-		urb_priv->EhubDataCacheBlock[i] = list_first_entry(&xhci->cache_list_free,
-									  EHUB_CACHE_BLOCK,
-									  list);
-		list_move_tail(&urb_priv->EhubDataCacheBlock[i]->list,
-					   &xhci->cache_list_used);
-		xhci->number_of_caches_free--;
-		xhci->number_of_caches_used++;
-		urb_priv->cache_block_cnt++;
-		urb_priv->EhubDataCacheBlock[i]->urb = urb;
-		dev_dbg(dev_ctx_to_dev(xhci->DeviceContext), "Alloc Block URB : %d used=%d free=%d urb=0x%p urb_priv=0x%p\n",
-				urb_priv->EhubDataCacheBlock[i]->IndexOfBlock, xhci->number_of_caches_used, xhci->number_of_caches_free, urb, urb_priv);
+	if (!spill && 0 == num_blocks) {
+		spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
+		xhci_dbg(xhci, "CACHE: no run of %d blocks. used=%d free=%d\n",
+				 num_blocks_needed, xhci->number_of_caches_used, xhci->number_of_caches_free);
+		return -ENOMEM;
+	}
 
+	if (length < urb->transfer_buffer_length) {
+		xhci->cache_spill_count++;
+		xhci->cache_spill_bytes += urb->transfer_buffer_length - length;
+	}
 
+	if (0 == num_blocks) {
+		spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
+		xhci_dbg(xhci, "CACHE: spill urb=0x%p to host memory. used=%d free=%d\n",
+				 urb, xhci->number_of_caches_used, xhci->number_of_caches_free);
+		return 0;
 	}
-	spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
 
+	for (i = 0; i < num_blocks; i++)
+		cacheBlock[i].urb = urb;
+
+	urb_priv->EhubDataCacheBlock = cacheBlock;
+	urb_priv->cache_block_cnt = num_blocks;
+	urb_priv->cache_length = length;
+	urb_priv->cache_ep = virt_ep;
+	virt_ep->cache_data_used += num_blocks;
+
+	dev_dbg(dev_ctx_to_dev(xhci->DeviceContext), "Alloc Blocks URB : %d-%d len=0x%X used=%d free=%d urb=0x%p urb_priv=0x%p\n",
+			cacheBlock->IndexOfBlock, cacheBlock->IndexOfBlock + num_blocks - 1, length,
+			xhci->number_of_caches_used, xhci->number_of_caches_free, urb, urb_priv);
 
-	for (i = 0; i < num_blocks_needed; i++) {
-		cache_length = min(length, (u32)EHUB_CACHE_BLOCK_SIZE);
+	spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
+
+	/* Write the data to device cache */
+	cache_address = cacheBlock->Address;
+	while (length) {
+		cache_length = min(length, (u32)MESSAGE_DATA_BUFFER_SIZE_CACHE);
 
-		/* Second, Write the data to device cache */
 		status = ehub_queue_cache_write(xhci->DeviceContext,
-										urb_priv->EhubDataCacheBlock[i]->Address,
+										cache_address,
 										(u32*)start_addr,
 										cache_length,
 										0,
@@ -989,17 +1653,143 @@ ehub_xhci_cache_block_allocate_urb(
 		if (status < 0) {
 			dev_err(dev_ctx_to_dev(xhci->DeviceContext), "ERROR EMBEDDED_CACHE_Write fail %d\n", status);
 			ehub_xhci_cache_block_free_by_urb(xhci, urb_priv);
-			goto Exit;
+			break;
 		}
+		cache_address += cache_length;
 		start_addr += cache_length;
 		length -= cache_length;
 	}
 
-Exit:
-
 	return status;
 }
 
+/*
+ * Admission control for a new endpoint: refuse it now, rather than fail
+ * mid-stream, when the cache cannot hold its ring next to the blocks kept
+ * for control rings.  The ring blocks stay promised to the device until its
+ * configure command completes, so endpoints added by the same command do not
+ * all pass against one free count; a ring already allocated meanwhile is
+ * counted twice, which errs toward refusal.
+ */
+int
+ehub_xhci_cache_admit_endpoint(
+	struct xhci_hcd *xhci,
+	struct xhci_virt_device *virt_dev,
+	struct usb_host_endpoint *ep
+	)
+{
+	/* Same ring size as ehub_xhci_endpoint_init */
+	int num_segs = usb_endpoint_xfer_isoc(&ep->desc) ? 4 : 2;
+	int free_blocks;
+	unsigned long flags;
+
+	spin_lock_irqsave(&xhci->cache_list_lock, flags);
+	free_blocks = xhci->number_of_caches_free - xhci->cache_blocks_admitted;
+	if (free_blocks >= num_segs + EHUB_CACHE_CONTROL_RESERVE_BLOCKS) {
+		xhci->cache_blocks_admitted += num_segs;
+		virt_dev->cache_blocks_admitted += num_segs;
+		spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
+		return 0;
+	}
+	xhci->cache_admit_rejected++;
+	spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
+
+	xhci_warn(xhci, "CACHE: no room for ep 0x%x ring, %d blocks free\n",
+			  ep->desc.bEndpointAddress, free_blocks);
+	return -ENOSPC;
+}
+
+/*
+ * Drop what ehub_xhci_cache_admit_endpoint promised to a device once its
+ * configure command is done with, whether it succeeded or not.  The rings
+ * are by then allocated or freed, so number_of_caches_free is exact again.
+ */
+void
+ehub_xhci_cache_admit_release(
+	struct xhci_hcd *xhci,
+	struct xhci_virt_device *virt_dev
+	)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&xhci->cache_list_lock, flags);
+	xhci->cache_blocks_admitted -= virt_dev->cache_blocks_admitted;
+	virt_dev->cache_blocks_admitted = 0;
+	spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
+}
+
+/*
+ * Data quota of an isoch OUT endpoint, sized from the max ESIT payload its
+ * bandwidth reservation is made with.  What the data pool cannot grant is
+ * read by the device from host memory, see ehub_xhci_cache_block_allocate_urb.
+ */
+void
+ehub_xhci_cache_quota_reserve(
+	struct xhci_hcd *xhci,
+	struct xhci_virt_ep *virt_ep,
+	u32 max_esit_payload
+	)
+{
+	unsigned long flags;
+	unsigned int quota;
+
+	quota = DIV_ROUND_UP(max_esit_payload * EHUB_CACHE_QUOTA_INTERVALS, EHUB_CACHE_BLOCK_SIZE);
+	quota = clamp_t(unsigned int, quota, EHUB_CACHE_MAX_DATA_BLOCKS, EHUB_CACHE_DATA_QUOTA_BLOCKS / 2);
+
+	spin_lock_irqsave(&xhci->cache_list_lock, flags);
+
+	/* An endpoint set up again without a drop gives back its old quota. */
+	xhci->cache_quota_granted -= virt_ep->cache_quota;
+	quota = min_t(unsigned int, quota, EHUB_CACHE_DATA_QUOTA_BLOCKS - xhci->cache_quota_granted);
+	if (0 == quota)
+		xhci->cache_quota_denied++;
+	virt_ep->cache_quota = quota;
+	xhci->cache_quota_granted += quota;
+
+	spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
+
+	xhci_dbg(xhci, "CACHE: isoch OUT data quota %u blocks, %u of %u granted\n",
+			  quota, xhci->cache_quota_granted, EHUB_CACHE_DATA_QUOTA_BLOCKS);
+}
+
+void
+ehub_xhci_cache_quota_release(
+	struct xhci_hcd *xhci,
+	struct xhci_virt_ep *virt_ep
+	)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&xhci->cache_list_lock, flags);
+	xhci->cache_quota_granted -= virt_ep->cache_quota;
+	virt_ep->cache_quota = 0;
+	spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
+}
+
+/*
+ * Host push for a bulk or interrupt OUT payload.  A payload that fits in
+ * one cache write is written to a run of cache blocks ahead of its TRB,
+ * and the TRB points at the cache, so the device need not send a memory
+ * read request for it.  Anything else, or a cache that is running low,
+ * keeps the device reads.
+ */
+void
+ehub_xhci_cache_block_push_urb(
+	struct xhci_hcd *xhci,
+	struct urb *urb
+)
+{
+	/* The segment reserve is checked, and the run taken, under
+	 * cache_list_lock in ehub_xhci_cache_block_allocate_urb. */
+	if (urb->transfer_buffer_length > MESSAGE_DATA_BUFFER_SIZE_CACHE ||
+		ehub_xhci_cache_block_allocate_urb(xhci, urb, false)) {
+		xhci->cache_push_fallback++;
+		return;
+	}
+
+	xhci->cache_push_count++;
+}
+
 void
 ehub_xhci_cache_block_free(
 	struct xhci_hcd *xhci,
@@ -1012,10 +1802,7 @@ ehub_xhci_cache_block_free(
 
 	spin_lock_irqsave( &xhci->cache_list_lock, flags );
 
-	list_move_tail( &EhubCacheBlock->list,
-				   &xhci->cache_list_free );
-	xhci->number_of_caches_used--;
-	xhci->number_of_caches_free++;
+	ehub_xhci_cache_run_put(xhci, EhubCacheBlock, 1);
 	dev_dbg(dev_ctx_to_dev(xhci->DeviceContext), "Free Block : %d used=%d free=%d\n",
 			EhubCacheBlock->IndexOfBlock, xhci->number_of_caches_used, xhci->number_of_caches_free );
 
@@ -1031,22 +1818,20 @@ ehub_xhci_cache_block_free_by_urb(
 	)
 {
 	unsigned long flags;
-	int index;
 
-	if (urb_priv) {
+	if (urb_priv && urb_priv->cache_block_cnt) {
 		spin_lock_irqsave(&xhci->cache_list_lock, flags);
 
-
-		for (index = 0; index < urb_priv->cache_block_cnt; index++) {
-			dev_dbg(dev_ctx_to_dev(xhci->DeviceContext), "CACHE: Free URB : %d used=%d free=%d urb_priv=0x%p\n",
-					 urb_priv->EhubDataCacheBlock[index]->IndexOfBlock, xhci->number_of_caches_used, xhci->number_of_caches_free, urb_priv );
-			list_move_tail(&urb_priv->EhubDataCacheBlock[index]->list,
-						   &xhci->cache_list_free);
-			xhci->number_of_caches_used--;
-			xhci->number_of_caches_free++;
-			urb_priv->EhubDataCacheBlock[index] = NULL;
-		}
+		dev_dbg(dev_ctx_to_dev(xhci->DeviceContext), "CACHE: Free URB : %d-%d used=%d free=%d urb_priv=0x%p\n",
+				 urb_priv->EhubDataCacheBlock->IndexOfBlock,
+				 urb_priv->EhubDataCacheBlock->IndexOfBlock + urb_priv->cache_block_cnt - 1,
+				 xhci->number_of_caches_used, xhci->number_of_caches_free, urb_priv );
+		ehub_xhci_cache_run_put(xhci, urb_priv->EhubDataCacheBlock, urb_priv->cache_block_cnt);
+		urb_priv->cache_ep->cache_data_used -= urb_priv->cache_block_cnt;
+		urb_priv->cache_ep = NULL;
+		urb_priv->EhubDataCacheBlock = NULL;
 		urb_priv->cache_block_cnt = 0;
+		urb_priv->cache_length = 0;
 
 		spin_unlock_irqrestore(&xhci->cache_list_lock, flags);
 	}
@@ -1138,6 +1923,29 @@ ehub_xhci_cache_copy_from_ring(
 		ASSERT(false);
 	}
 
+	/* Segments are not uploaded whole, so until the ring's first pass
+	 * through a segment reaches the enqueue pointer, the cache holds
+	 * whatever the block held before there.  Land the software owned TRB
+	 * ahead of the new TRBs so the controller stops at it.  Once uploaded,
+	 * a TRB keeps a cycle bit of this ring and needs no guard.
+	 */
+	if (enq_trb - enq_seg->trbs >= enq_seg->cache_uploaded) {
+		status = ehub_queue_cache_write(xhci->DeviceContext,
+										enq_seg->EhubCacheBlock->Address +
+										(( u64 )enq_trb - ( u64 )enq_seg->trbs),
+										( u32* )enq_trb,
+										sizeof(union xhci_trb),
+										-1,
+										false,
+										0,
+										0,
+										0);
+		if (status < 0)
+			dev_err(dev_ctx_to_dev(xhci->DeviceContext), "ERROR EMBEDDED_CACHE_Write fail! %d\n", status);
+		else
+			enq_seg->cache_uploaded = enq_trb - enq_seg->trbs + 1;
+	}
+
 	// First copy from the starting TRB to either the last Trb or
 	// the end of the starting segment if the TD spans multiple segments.
 	//
@@ -1183,6 +1991,8 @@ ehub_xhci_cache_copy_from_ring(
 				dev_err(dev_ctx_to_dev(xhci->DeviceContext), "ERROR EMBEDDED_CACHE_Write fail! %d\n", status);
 				break;
 			}
+			cur_seg->cache_uploaded = max_t(unsigned int, cur_seg->cache_uploaded,
+											end_trb - cur_seg->trbs + 1);
 		}
 
 		if (lastCopy) {
@@ -1235,25 +2045,23 @@ ehub_xhci_get_data_buffer_addr( struct xhci_hcd *xhci, struct urb *urb,
 #ifdef EHUB_ISOCH_DATA_CACHE_ENABLE
 	struct urb_priv* urb_priv = urb->hcpriv;
 	if (urb_priv->cache_block_cnt) {
-		PEHUB_CACHE_BLOCK ehubCacheBlock;
-		unsigned int block_num;
-
-		block_num = (addr - ( u64 )urb->transfer_buffer) / EHUB_CACHE_BLOCK_SIZE;
-		ASSERT(block_num < EHUB_CACHE_MAX_DATA_BLOCKS);
+		PEHUB_CACHE_BLOCK ehubCacheBlock = urb_priv->EhubDataCacheBlock;
+		u64 offset;
 
-		ehubCacheBlock = urb_priv->EhubDataCacheBlock[block_num];
+		/* The run is contiguous and filled from the start of the transfer buffer. */
+		offset = addr - ( u64 )ehub_xhci_urb_buffer_dma(urb);
 
-		if (NULL != ehubCacheBlock) {
+		if (offset + trb_buff_len <= urb_priv->cache_length) {
 
 			ASSERT(ehubCacheBlock->urb == urb);
 
-			addrData = ehubCacheBlock->Address + (addr & (EHUB_CACHE_BLOCK_SIZE - 1));
-			xhci_dbg(xhci, "CACHE: blk_num=%u addr=0x%llx, urb_buf=0x%p addrData=0x%llx\n",
-					  block_num, addr, urb->transfer_buffer, addrData);
+			addrData = ehubCacheBlock->Address + offset;
+			xhci_dbg(xhci, "CACHE: blk=%u offset=0x%llx addr=0x%llx, urb_buf=0x%p addrData=0x%llx\n",
+					  ehubCacheBlock->IndexOfBlock, offset, addr, urb->transfer_buffer, addrData);
 		} else {
-			panic( "\n\n#### ehub out of cache. ###\n\n" );
-			//
-			addrData = 0;
+			/* Past the cached start of the URB: the device reads it from host memory. */
+			xhci->cache_spill_trbs++;
+			addrData = addr;
 		}
 	} else {
 		// Non-cached data
@@ -1279,21 +2087,77 @@ void ehub_xhci_handle_queued_port_status(struct work_struct* work_context)
 	xhci = event_context->xhci;
 	if (0 == DEVICECONTEXT_ErrorCheck(xhci->DeviceContext)) {
 		event = (union xhci_trb *)(&event_context->event);
-		handle_port_status(xhci, event);
+		handle_port_status(xhci, event, NULL);
+	}
+	kfree(work_context);
+}
+
+static void ehub_xhci_port_status_read_done(
+	PDEVICE_CONTEXT DeviceContext,
+	void *Context,
+	u32 Address,
+	u32 Data,
+	int Status
+	)
+{
+	struct event_work_context *work_context = Context;
+
+	if (Status == -ESHUTDOWN || DEVICECONTEXT_ErrorCheck(DeviceContext) < 0) {
+		kfree(work_context);
+		return;
+	}
+
+	/* The read command did not go out, the work item reads PORTSC itself. */
+	if (Status < 0) {
+		schedule_delayed_work( &work_context->work, 0 );
+		return;
+	}
+
+	/* Remote wakeup resume reads more registers, leave it to the work item. */
+	if ((Data & PORT_PLC) && (Data & PORT_PLS_MASK) == XDEV_RESUME) {
+		schedule_delayed_work( &work_context->work, 0 );
+		return;
 	}
+
+	handle_port_status(work_context->xhci,
+					   (union xhci_trb *)(&work_context->event),
+					   &Data);
 	kfree(work_context);
 }
 
+/*
+ * Port status events arrive on the message path, which also delivers
+ * register read completions, so PORTSC is read asynchronously and the event
+ * handled from the completion.  Only when no read tag is free does the event
+ * go through the delayed work.
+ */
 void ehub_xhci_queue_port_status_event(struct xhci_hcd *xhci,union xhci_trb *event)
 {
-	struct event_work_context *work_context = kzalloc(sizeof( *work_context ), GFP_KERNEL);
+	struct event_work_context *work_context;
+	__le32 __iomem *port_reg;
 
-	ASSERT( work_context != NULL );
+	/* The controller changed a port, hub polling must see it. */
+	ehub_xhci_port_snapshot_invalidate(xhci);
+
+	work_context = kzalloc(sizeof( *work_context ), GFP_ATOMIC);
+	if (!work_context) {
+		xhci_err(xhci, "ERROR no memory, port status event dropped\n");
+		return;
+	}
 
 	work_context->xhci = xhci;
 	work_context->event = event->generic;
 
 	INIT_DELAYED_WORK(&work_context->work, ehub_xhci_handle_queued_port_status);
+
+	port_reg = ehub_xhci_port_status_event_reg(xhci, event);
+	if (port_reg &&
+		0 == EMBEDDED_REGISTER_ReadAsync( xhci->DeviceContext,
+										  ( unsigned long )port_reg,
+										  ehub_xhci_port_status_read_done,
+										  work_context ))
+		return;
+
 	schedule_delayed_work( &work_context->work, 10 );
 }
 
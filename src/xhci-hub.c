@@ -469,6 +469,70 @@ void ehub_xhci_test_and_clear_bit(struct xhci_hcd *xhci, __le32 __iomem **port_a
 	}
 }
 
+/*
+ * Read PORTSC, PORTPMSC or PORTLI through the port snapshot.  When the
+ * snapshot is stale the registers of every port are refetched together with
+ * all reads in flight, so a root hub poll followed by GetPortStatus requests
+ * costs one batch instead of a round trip per port.  Callers hold reg_lock.
+ */
+u32 ehub_xhci_read_port_snapshot(struct xhci_hcd *xhci, __le32 __iomem *reg)
+{
+	__le32 __iomem *regs[MAX_HC_PORTS * EHUB_PORT_SNAPSHOT_REGS];
+	u32 vals[MAX_HC_PORTS * EHUB_PORT_SNAPSHOT_REGS];
+	unsigned long offset;
+	int num_ports;
+	int port, i;
+	int target;
+	int gen;
+
+	num_ports = min_t(int, HCS_MAX_PORTS(xhci->hcs_params1), MAX_HC_PORTS);
+
+	offset = (unsigned long) reg -
+		(unsigned long) &xhci->op_regs->port_status_base;
+	port = offset / (NUM_PORT_REGS * sizeof(__le32));
+	i = (offset / sizeof(__le32)) % NUM_PORT_REGS;
+	if ((unsigned long) reg < (unsigned long) &xhci->op_regs->port_status_base ||
+			port >= num_ports || i >= EHUB_PORT_SNAPSHOT_REGS)
+		return xhci_readl( xhci, reg);
+	target = port * EHUB_PORT_SNAPSHOT_REGS + i;
+
+	gen = atomic_read(&xhci->port_snapshot_gen);
+	if (xhci->port_snapshot_valid &&
+			xhci->port_snapshot_gen_filled == gen &&
+			time_before(jiffies, xhci->port_snapshot_expires))
+		return xhci->port_snapshot[port][i];
+
+	for (port = 0; port < num_ports; port++)
+		for (i = 0; i < EHUB_PORT_SNAPSHOT_REGS; i++)
+			regs[port * EHUB_PORT_SNAPSHOT_REGS + i] =
+				&xhci->op_regs->port_status_base +
+				port * NUM_PORT_REGS + i;
+
+	xhci->port_snapshot_valid = false;
+	if (ehub_xhci_readl_multiple(xhci, regs, vals,
+				num_ports * EHUB_PORT_SNAPSHOT_REGS) == 0) {
+		memcpy(xhci->port_snapshot, vals,
+				num_ports * EHUB_PORT_SNAPSHOT_REGS * sizeof(u32));
+		xhci->port_snapshot_gen_filled = gen;
+		xhci->port_snapshot_expires = jiffies +
+			msecs_to_jiffies(EHUB_PORT_SNAPSHOT_VALID_MS);
+		xhci->port_snapshot_valid = true;
+	}
+
+	return vals[target];
+}
+
+/* Clear port RWC bit given a PORTSC value that was just read */
+void ehub_xhci_clear_port_bit(struct xhci_hcd *xhci, __le32 __iomem **port_array,
+				int port_id, u32 port_status, u32 port_bit)
+{
+	if (port_status & port_bit) {
+		port_status = ehub_xhci_port_state_to_neutral(port_status);
+		port_status |= port_bit;
+		xhci_writel( xhci, port_status, port_array[port_id]);
+	}
+}
+
 /* Updates Link Status for USB 2.1 port */
 static void xhci_hub_report_usb2_link_state(u32 *status, u32 status_reg)
 {
@@ -759,7 +823,7 @@ int ehub_xhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 		if (!wIndex || wIndex > max_ports)
 			goto error;
 		wIndex--;
-		temp = xhci_readl( xhci, port_array[wIndex]);
+		temp = ehub_xhci_read_port_snapshot(xhci, port_array[wIndex]);
 		if (temp == 0xffffffff) {
 			retval = -ENODEV;
 			goto error;
@@ -1097,7 +1161,7 @@ int ehub_xhci_hub_status_data(struct usb_hcd *hcd, char *buf)
 	ehub_xhci_reg_lock_irqsave( xhci, flags );
 	/* For each port, did anything change?  If so, set that bit in buf. */
 	for (i = 0; i < max_ports; i++) {
-		temp = xhci_readl( xhci, port_array[i]);
+		temp = ehub_xhci_read_port_snapshot(xhci, port_array[i]);
 		if (temp == 0xffffffff) {
 			retval = -ENODEV;
 			break;
@@ -1120,6 +1184,38 @@ int ehub_xhci_hub_status_data(struct usb_hcd *hcd, char *buf)
 	return status ? retval : 0;
 }
 
+/*
+ * hub_status_data for a single port whose PORTSC is already known, so a port
+ * status event can report the change without reading every port.
+ */
+int ehub_xhci_hub_status_port_data(struct usb_hcd *hcd, int port_index,
+		u32 port_status, char *buf)
+{
+	struct xhci_hcd *xhci = hcd_to_xhci(hcd);
+	struct xhci_bus_state *bus_state;
+	u32 mask;
+	int max_ports, retval;
+	__le32 __iomem **port_array;
+
+	max_ports = xhci_get_ports(hcd, &port_array);
+	bus_state = &xhci->bus_state[hcd_index(hcd)];
+
+	retval = (max_ports + 8) / 8;
+	memset(buf, 0, retval);
+
+	mask = PORT_CSC | PORT_PEC | PORT_OCC | PORT_PLC | PORT_WRC | PORT_CEC;
+
+	if ((port_status & mask) != 0 ||
+		(bus_state->port_c_suspend & 1 << port_index) ||
+		(bus_state->resume_done[port_index] && time_after_eq(
+			jiffies, bus_state->resume_done[port_index]))) {
+		buf[(port_index + 1) / 8] |= 1 << (port_index + 1) % 8;
+		return retval;
+	}
+
+	return bus_state->resuming_ports ? retval : 0;
+}
+
 #ifdef CONFIG_PM
 
 int ehub_xhci_bus_suspend(struct usb_hcd *hcd)
@@ -1129,7 +1225,9 @@ int ehub_xhci_bus_suspend(struct usb_hcd *hcd)
 	__le32 __iomem **port_array;
 	struct xhci_bus_state *bus_state;
 	unsigned long flags;
+	struct ehub_xhci_write_batch batch;
 
+	ehub_xhci_write_batch_init(&batch);
 	max_ports = xhci_get_ports(hcd, &port_array);
 	bus_state = &xhci->bus_state[hcd_index(hcd)];
 
@@ -1159,6 +1257,8 @@ int ehub_xhci_bus_suspend(struct usb_hcd *hcd)
 			slot_id = ehub_xhci_find_slot_id_by_port(hcd, xhci,
 					port_index + 1);
 			if (slot_id) {
+				/* Ports already walked go down before this one stops. */
+				ehub_xhci_write_batch_flush(xhci, &batch);
 				ehub_xhci_reg_unlock_irqrestore( xhci, flags );
 				xhci_stop_device(xhci, slot_id, 1);
 				ehub_xhci_reg_lock_irqsave( xhci, flags );
@@ -1184,8 +1284,9 @@ int ehub_xhci_bus_suspend(struct usb_hcd *hcd)
 
 		t1 = ehub_xhci_port_state_to_neutral(t1);
 		if (t1 != t2)
-			xhci_writel( xhci, t2, port_array[port_index]);
+			ehub_xhci_writel_batch(xhci, &batch, t2, port_array[port_index]);
 	}
+	ehub_xhci_write_batch_flush(xhci, &batch);
 	hcd->state = HC_STATE_SUSPENDED;
 	bus_state->next_statechange = jiffies + msecs_to_jiffies(10);
 	ehub_xhci_reg_unlock_irqrestore( xhci, flags );
@@ -1200,7 +1301,9 @@ int ehub_xhci_bus_resume(struct usb_hcd *hcd)
 	struct xhci_bus_state *bus_state;
 	u32 temp;
 	unsigned long flags;
+	struct ehub_xhci_write_batch batch;
 
+	ehub_xhci_write_batch_init(&batch);
 	max_ports = xhci_get_ports(hcd, &port_array);
 	bus_state = &xhci->bus_state[hcd_index(hcd)];
 
@@ -1232,6 +1335,7 @@ int ehub_xhci_bus_resume(struct usb_hcd *hcd)
 			temp &= ~(PORT_RWC_BITS | PORT_WAKE_BITS);
 		if (test_bit(port_index, &bus_state->bus_suspended) &&
 			(temp & PORT_PLS_MASK)) {
+			ehub_xhci_write_batch_flush(xhci, &batch);
 			if (DEV_SUPERSPEED(temp)) {
 				ehub_xhci_set_link_state(xhci, port_array,
 							port_index, XDEV_U0);
@@ -1262,8 +1366,9 @@ int ehub_xhci_bus_resume(struct usb_hcd *hcd)
 			if (slot_id)
 				ehub_xhci_ring_device(xhci, slot_id);
 		} else
-			xhci_writel( xhci, temp, port_array[port_index]);
+			ehub_xhci_writel_batch(xhci, &batch, temp, port_array[port_index]);
 	}
+	ehub_xhci_write_batch_flush(xhci, &batch);
 
 	(void) xhci_readl( xhci, &xhci->op_regs->command);
 
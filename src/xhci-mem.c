@@ -63,7 +63,13 @@ static struct xhci_segment *xhci_segment_alloc(struct xhci_hcd *xhci,
 		for (i = 0; i < TRBS_PER_SEGMENT; i++)
 			seg->trbs[i].link.control |= cpu_to_le32(TRB_CYCLE);
 	}
-	seg->dma = (dma_addr_t)seg->trbs;
+	seg->iova_dma = IOVA_MapVirtual(xhci->DeviceContext, seg->trbs, TRB_SEGMENT_SIZE);
+	if (!seg->iova_dma) {
+		dma_pool_free(xhci->segment_pool, seg->trbs, dma);
+		kfree(seg);
+		return NULL;
+	}
+	seg->dma = seg->iova_dma;
 	ASSERT(IS_ALIGNED((unsigned long)seg->trbs, 64));
 	seg->orig_dma = dma;
 	seg->next = NULL;
@@ -74,6 +80,7 @@ static struct xhci_segment *xhci_segment_alloc(struct xhci_hcd *xhci,
 static void xhci_segment_free(struct xhci_hcd *xhci, struct xhci_segment *seg)
 {
 	if (seg->trbs) {
+		IOVA_Unmap(xhci->DeviceContext, seg->iova_dma, TRB_SEGMENT_SIZE);
 		dma_pool_free(xhci->segment_pool, seg->trbs, seg->orig_dma);
 		seg->trbs = NULL;
 	}
@@ -383,11 +390,12 @@ static int xhci_alloc_segments_for_ring(struct xhci_hcd *xhci,
 	num_segs--;
 #ifdef USE_TRB_CACHE_MODE
 	if (ehub_cache_ring(type)) {
-		prev->EhubCacheBlock = ehub_xhci_cache_block_allocate_segment( xhci, cycle_state, prev->trbs );
+		prev->EhubCacheBlock = ehub_xhci_cache_block_allocate_segment( xhci, cycle_state, prev->trbs, type );
 		if ( NULL == prev->EhubCacheBlock ) {
 			return -ENOMEM;
 		}
 		prev->dma = ( dma_addr_t ) prev->EhubCacheBlock->Address;
+		prev->cache_uploaded = 1;
 	}
 #endif
 	*first = prev;
@@ -410,11 +418,12 @@ static int xhci_alloc_segments_for_ring(struct xhci_hcd *xhci,
 		}
 #ifdef USE_TRB_CACHE_MODE
 		if (ehub_cache_ring(type)) {
-			next->EhubCacheBlock = ehub_xhci_cache_block_allocate_segment(xhci, cycle_state, next->trbs);
+			next->EhubCacheBlock = ehub_xhci_cache_block_allocate_segment(xhci, cycle_state, next->trbs, type);
 			if (NULL == next->EhubCacheBlock) {
 				return -ENOMEM;
 			}
 			next->dma = ( dma_addr_t )next->EhubCacheBlock->Address;
+			next->cache_uploaded = 1;
 		}
 #endif
 		xhci_link_segments(xhci, prev, next, type);
@@ -560,7 +569,12 @@ static struct xhci_container_ctx *xhci_alloc_container_ctx(struct xhci_hcd *xhci
 		kfree(ctx);
 		return NULL;
 	}
-	ctx->dma = (dma_addr_t)ctx->bytes;
+	ctx->dma = IOVA_MapVirtual(xhci->DeviceContext, ctx->bytes, ctx->size);
+	if (!ctx->dma) {
+		dma_pool_free(xhci->device_pool, ctx->bytes, ctx->orig_dma);
+		kfree(ctx);
+		return NULL;
+	}
 	memset(ctx->bytes, 0, ctx->size);
 	return ctx;
 }
@@ -570,6 +584,7 @@ static void xhci_free_container_ctx(struct xhci_hcd *xhci,
 {
 	if (!ctx)
 		return;
+	IOVA_Unmap(xhci->DeviceContext, ctx->dma, ctx->size);
 	dma_pool_free(xhci->device_pool, ctx->bytes, ctx->orig_dma);
 		kfree( ctx );
 }
@@ -967,6 +982,10 @@ void ehub_xhci_free_virt_device(struct xhci_hcd *xhci, int slot_id)
 	if (dev->tt_info)
 		old_active_eps = dev->tt_info->active_eps;
 
+#ifdef USE_TRB_CACHE_MODE
+	ehub_xhci_cache_admit_release(xhci, dev);
+#endif
+
 	for (i = 0; i < 31; ++i) {
 		if (dev->eps[i].ring)
 			ehub_xhci_ring_free(xhci, dev->eps[i].ring);
@@ -1443,6 +1462,7 @@ int ehub_xhci_endpoint_init(struct xhci_hcd *xhci,
 	ep_ctx->ep_info2 = cpu_to_le32(endpoint_type);
 
 	virt_dev->eps[ep_index].max_buffer_size = TRB_MAX_BUFF_SIZE;
+	virt_dev->eps[ep_index].cache_data = false;
 
 #ifdef EHUB_ISOCH_ENABLE
 	if (usb_endpoint_xfer_isoc(&ep->desc)) {
@@ -1456,8 +1476,11 @@ int ehub_xhci_endpoint_init(struct xhci_hcd *xhci,
 
 	#ifdef EHUB_ISOCH_DATA_CACHE_ENABLE
 		if (usb_endpoint_is_isoc_out(&ep->desc)) {
+			/* The data of one URB sits in a contiguous cache run, so
+			 * its TRBs need not split at cache block boundaries. */
 			virt_dev->eps[ep_index].cache_data = true;
-			virt_dev->eps[ep_index].max_buffer_size = EHUB_CACHE_BLOCK_SIZE;
+			ehub_xhci_cache_quota_reserve(xhci, &virt_dev->eps[ep_index],
+					xhci_get_max_esit_payload(udev, ep));
 		}
 	#endif // EHUB_ISOCH_DATA_CACHE_ENABLE
 	}
@@ -1567,6 +1590,10 @@ void ehub_xhci_endpoint_zero(struct xhci_hcd *xhci,
 		ep_count = atomic_dec_return(&xhci->num_active_isoc_eps);
 		ASSERT(ep_count >= 0);
 		xhci_info(xhci, "Remove isoch ep, num_active_isoc_eps=%d\n", ep_count);
+
+	#ifdef EHUB_ISOCH_DATA_CACHE_ENABLE
+		ehub_xhci_cache_quota_release(xhci, &virt_dev->eps[ep_index]);
+	#endif // EHUB_ISOCH_DATA_CACHE_ENABLE
 	}
 #endif // EHUB_ISOCH_ENABLE
 
@@ -1705,7 +1732,10 @@ static int scratchpad_alloc(struct xhci_hcd *xhci, gfp_t flags)
 	if (!xhci->scratchpad->sp_array)
 		goto fail_sp2;
 
-	xhci->scratchpad->sp_dma = (dma_addr_t)xhci->scratchpad->sp_array;
+	xhci->scratchpad->sp_dma = IOVA_MapVirtual(xhci->DeviceContext,
+			xhci->scratchpad->sp_array, num_sp * sizeof(u64));
+	if (!xhci->scratchpad->sp_dma)
+		goto fail_sp3;
 	xhci->scratchpad->sp_buffers = kzalloc(sizeof(void *) * num_sp, flags);
 	if (!xhci->scratchpad->sp_buffers)
 		goto fail_sp3;
@@ -1722,7 +1752,11 @@ static int scratchpad_alloc(struct xhci_hcd *xhci, gfp_t flags)
 		void *buf = kzalloc(xhci->page_size, flags);
 		if (!buf)
 			goto fail_sp5;
-		dma = (dma_addr_t)buf;
+		dma = IOVA_MapVirtual(xhci->DeviceContext, buf, xhci->page_size);
+		if (!dma) {
+			kfree(buf);
+			goto fail_sp5;
+		}
 		xhci->scratchpad->sp_array[i] = dma;
 		xhci->scratchpad->sp_buffers[i] = buf;
 		xhci->scratchpad->sp_dma_buffers[i] = dma;
@@ -1732,12 +1766,14 @@ static int scratchpad_alloc(struct xhci_hcd *xhci, gfp_t flags)
 
  fail_sp5:
 	for (i = i - 1; i >= 0; i--) {
+		IOVA_Unmap(xhci->DeviceContext, xhci->scratchpad->sp_dma_buffers[i], xhci->page_size);
 		kfree( xhci->scratchpad->sp_buffers[i] );
 	}
 	kfree(xhci->scratchpad->sp_dma_buffers);
 
  fail_sp4:
 	kfree(xhci->scratchpad->sp_buffers);
+	IOVA_Unmap(xhci->DeviceContext, xhci->scratchpad->sp_dma, num_sp * sizeof(u64));
 
  fail_sp3:
 	kfree( xhci->scratchpad->sp_array );
@@ -1762,10 +1798,12 @@ static void scratchpad_free(struct xhci_hcd *xhci)
 	num_sp = HCS_MAX_SCRATCHPAD(xhci->hcs_params2);
 
 	for (i = 0; i < num_sp; i++) {
+		IOVA_Unmap(xhci->DeviceContext, xhci->scratchpad->sp_dma_buffers[i], xhci->page_size);
 		kfree( xhci->scratchpad->sp_buffers[i] );
 	}
 	kfree(xhci->scratchpad->sp_dma_buffers);
 	kfree(xhci->scratchpad->sp_buffers);
+	IOVA_Unmap(xhci->DeviceContext, xhci->scratchpad->sp_dma, num_sp * sizeof(u64));
 	kfree( xhci->scratchpad->sp_array );
 	kfree(xhci->scratchpad);
 	xhci->scratchpad = NULL;
@@ -1813,6 +1851,9 @@ void ehub_xhci_urb_free_priv(struct xhci_hcd *xhci, struct urb_priv *urb_priv)
 #ifdef EHUB_ISOCH_DATA_CACHE_ENABLE
 		ehub_xhci_cache_block_free_by_urb(xhci, urb_priv);
 #endif // EHUB_ISOCH_DATA_CACHE_ENABLE
+		if (urb_priv->transfer_iova)
+			IOVA_Unmap(xhci->DeviceContext, urb_priv->transfer_iova,
+					   urb_priv->transfer_iova_length);
 		kfree(urb_priv->td[0]);
 		kfree(urb_priv);
 	}
@@ -1838,9 +1879,12 @@ void ehub_xhci_mem_cleanup(struct xhci_hcd *xhci)
 
 	/* Free the Event Ring Segment Table and the actual Event Ring */
 	size = sizeof(struct xhci_erst_entry)*(xhci->erst.num_entries);
-	if (xhci->erst.entries)
+	if (xhci->erst.entries) {
+		IOVA_Unmap(xhci->DeviceContext, xhci->erst.erst_dma_addr,
+				   sizeof(struct xhci_erst_entry) * ERST_NUM_SEGS);
 		dma_free_coherent(dev, size,
 						  xhci->erst.entries, xhci->erst.erst_dma_addr_orig);
+	}
 	xhci->erst.entries = NULL;
 	ehub_xhci_dbg_trace(xhci, trace_ehub_xhci_dbg_init, "Freed ERST");
 	if (xhci->event_ring)
@@ -1892,8 +1936,10 @@ void ehub_xhci_mem_cleanup(struct xhci_hcd *xhci)
 	ehub_xhci_dbg_trace(xhci, trace_ehub_xhci_dbg_init,
 			"Freed medium stream array pool");
 
-	if (xhci->dcbaa)
+	if (xhci->dcbaa) {
+		IOVA_Unmap(xhci->DeviceContext, xhci->dcbaa->dma, sizeof(*xhci->dcbaa));
 		dma_pool_free(xhci->page_pool, &xhci->dcbaa, xhci->dcbaa->orig_dma);
+	}
 	xhci->dcbaa = NULL;
 
 	scratchpad_free(xhci);
@@ -2100,7 +2146,7 @@ static void xhci_set_hc_event_deq(struct xhci_hcd *xhci)
 		xhci_warn(xhci, "WARN something wrong with SW event ring "
 				"dequeue ptr.\n");
 	/* Update HC event ring dequeue pointer */
-	temp = xhci_read_64(xhci, &xhci->ir_set->erst_dequeue);
+	temp = xhci_read_64_sw(xhci, &xhci->ir_set->erst_dequeue);
 	temp &= ERST_PTR_MASK;
 	/* Don't clear the EHB bit (which is RW1C) because
 	 * there might be more events to service.
@@ -2437,7 +2483,9 @@ int ehub_xhci_mem_init(struct xhci_hcd *xhci, gfp_t flags)
 		goto fail;
 	memset(xhci->dcbaa, 0, sizeof *(xhci->dcbaa));
 	xhci->dcbaa->orig_dma = dma;
-	dma = ( dma_addr_t )xhci->dcbaa;
+	dma = IOVA_MapVirtual(xhci->DeviceContext, xhci->dcbaa, sizeof(*xhci->dcbaa));
+	if (!dma)
+		goto fail;
 	xhci->dcbaa->dma = dma;
 	ehub_xhci_dbg_trace(xhci, trace_ehub_xhci_dbg_init,
 			"// Device context base array address = 0x%llx (DMA) 0x%11x (orig), %p (virt)\n",
@@ -2537,7 +2585,10 @@ int ehub_xhci_mem_init(struct xhci_hcd *xhci, gfp_t flags)
 	memset(xhci->erst.entries, 0, sizeof(struct xhci_erst_entry)*ERST_NUM_SEGS);
 	xhci->erst.num_entries = ERST_NUM_SEGS;
 	xhci->erst.erst_dma_addr_orig = dma;
-	xhci->erst.erst_dma_addr = (dma_addr_t)xhci->erst.entries;
+	xhci->erst.erst_dma_addr = IOVA_MapVirtual(xhci->DeviceContext, xhci->erst.entries,
+			sizeof(struct xhci_erst_entry) * ERST_NUM_SEGS);
+	if (!xhci->erst.erst_dma_addr)
+		goto fail;
 	ehub_xhci_dbg_trace(xhci, trace_ehub_xhci_dbg_init,
 			"Set ERST to 0; private num segs = %i, virt addr = %p, dma addr = 0x%llx",
 			xhci->erst.num_entries,
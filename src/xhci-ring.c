@@ -73,6 +73,7 @@
 
 int ehub_xhci_map_urb_for_dma(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flags)
 {
+	PDEVICE_CONTEXT deviceContext = hcd_to_xhci(hcd)->DeviceContext;
 	int ret = 0;
 
 	/* Map the URB's buffers for DMA access.
@@ -115,44 +116,67 @@ int ehub_xhci_map_urb_for_dma(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_fl
 			int i;
 			struct scatterlist *s;
 
+			/* Pages are mapped rather than sg_virt() so highmem works. */
 			for_each_sg(urb->sg, s, urb->num_sgs, i)
 			{
-				s->dma_address = (dma_addr_t)sg_virt(s);
+				s->dma_address = IOVA_MapPage(deviceContext, sg_page(s), s->offset, s->length);
+				if (!s->dma_address)
+					break;
 				s->dma_length = s->length;
 				n++;
 			}
 
-			if (n <= 0)
+			urb->num_mapped_sgs = n;
+			if (n <= 0 || n != urb->num_sgs)
 				ret = -EAGAIN;
-			else
+			if (n > 0)
 				urb->transfer_flags |= URB_DMA_MAP_SG;
-
-			urb->num_mapped_sgs = n;
-			if ( n != urb->num_sgs )
-			{
-				urb->transfer_flags |= URB_DMA_SG_COMBINED;
-			}
 		}
 		else if (hcd->driver->flags & HCD_LOCAL_MEM)
 		{
 			if (ret == 0)
 				urb->transfer_flags |= URB_MAP_LOCAL;
 		}
+	}
 
-		if ( ret &&
-			 ( urb->transfer_flags & ( URB_SETUP_MAP_SINGLE | URB_SETUP_MAP_LOCAL ) ) )
-		{
-			usb_hcd_unmap_urb_for_dma(hcd, urb);
-		}
+	/*
+	 * The TRBs point at an IOVA. Buffers the class driver mapped itself keep
+	 * their transfer_dma; those are mapped into urb_priv at enqueue time.
+	 */
+	if ( ret == 0 && urb->transfer_buffer_length != 0
+		 && !(urb->transfer_flags & URB_NO_TRANSFER_DMA_MAP)
+		 && !urb->num_sgs && urb->transfer_buffer )
+	{
+		urb->transfer_dma = IOVA_MapVirtual(deviceContext,
+											urb->transfer_buffer,
+											urb->transfer_buffer_length);
+		if (!urb->transfer_dma)
+			ret = -EAGAIN;
+		else
+			urb->transfer_flags |= URB_DMA_MAP_SINGLE;
 	}
 
+	if ( ret )
+		ehub_xhci_unmap_urb_for_dma(hcd, urb);
+
 	return ret;
 }
 
 void ehub_xhci_unmap_urb_for_dma(struct usb_hcd *hcd, struct urb *urb)
 {
+	PDEVICE_CONTEXT deviceContext = hcd_to_xhci(hcd)->DeviceContext;
+	struct scatterlist *s;
+	int i;
+
 	usb_hcd_unmap_urb_setup_for_dma(hcd, urb);
 
+	if (urb->transfer_flags & URB_DMA_MAP_SG) {
+		for_each_sg(urb->sg, s, urb->num_mapped_sgs, i)
+			IOVA_Unmap(deviceContext, s->dma_address, s->dma_length);
+	} else if (urb->transfer_flags & URB_DMA_MAP_SINGLE) {
+		IOVA_Unmap(deviceContext, urb->transfer_dma, urb->transfer_buffer_length);
+	}
+
 	/* Make it safe to call this routine more than once */
 	urb->transfer_flags &= ~(URB_DMA_MAP_SG | URB_DMA_MAP_PAGE |
 			URB_DMA_MAP_SINGLE | URB_MAP_LOCAL);
@@ -411,6 +435,39 @@ void ehub_xhci_ring_cmd_db_low(struct xhci_hcd *xhci)
 //	xhci_readl( xhci, &xhci->dba->doorbell[0]);
 }
 
+/*
+ * Doorbell register and value that would start this endpoint, or false if
+ * the endpoint must not be rung now.  A stream_id of ~0 selects the command
+ * ring doorbell.
+ */
+bool ehub_xhci_doorbell_value(struct xhci_hcd *xhci,
+		unsigned int slot_id,
+		unsigned int ep_index,
+		unsigned int stream_id,
+		u32 *db_reg,
+		u32 *db_val)
+{
+	unsigned int ep_state;
+
+	if (~(0) == stream_id) {
+		if (!(xhci->cmd_ring_state & CMD_RING_STATE_RUNNING))
+			return false;
+		*db_reg = ( u32 )( unsigned long )&xhci->dba->doorbell[0];
+		*db_val = DB_VALUE_HOST;
+		return true;
+	}
+
+	/* Same rules as ehub_xhci_ring_ep_doorbell. */
+	ep_state = xhci->devs[slot_id]->eps[ep_index].ep_state;
+	if ((ep_state & EP_HALT_PENDING) || (ep_state & SET_DEQ_PENDING) ||
+		(ep_state & EP_HALTED))
+		return false;
+
+	*db_reg = ( u32 )( unsigned long )&xhci->dba->doorbell[slot_id];
+	*db_val = DB_VALUE(ep_index, stream_id);
+	return true;
+}
+
 void ehub_xhci_ring_ep_doorbell(struct xhci_hcd *xhci,
 		unsigned int slot_id,
 		unsigned int ep_index,
@@ -1589,8 +1646,47 @@ static void handle_device_notification(struct xhci_hcd *xhci,
 		usb_wakeup_notification(udev->parent, udev->portnum);
 }
 
-void handle_port_status(struct xhci_hcd *xhci,
+/*
+ * Look up the PORTSC register a Port Status Change Event refers to, so it
+ * can be read ahead of handle_port_status.  Returns NULL for events
+ * handle_port_status would reject; those take the normal path.
+ */
+__le32 __iomem *ehub_xhci_port_status_event_reg(struct xhci_hcd *xhci,
 		union xhci_trb *event)
+{
+	struct usb_hcd *hcd;
+	__le32 __iomem **port_array;
+	u32 port_id;
+	u8 major_revision;
+
+	if (GET_COMP_CODE(le32_to_cpu(event->generic.field[2])) != COMP_SUCCESS)
+		return NULL;
+
+	port_id = GET_PORT_ID(le32_to_cpu(event->generic.field[0]));
+	if ((port_id <= 0) || (port_id > HCS_MAX_PORTS(xhci->hcs_params1)))
+		return NULL;
+
+	major_revision = xhci->port_array[port_id - 1];
+	if (major_revision == 0 || major_revision == DUPLICATE_ENTRY)
+		return NULL;
+
+	hcd = xhci_to_hcd(xhci);
+	if (hcd->speed == HCD_USB3)
+		port_array = xhci->usb3_ports;
+	else
+		port_array = xhci->usb2_ports;
+
+	return port_array[find_faked_portnum_from_hw_portnum(hcd, xhci, port_id)];
+}
+
+/*
+ * port_status is the PORTSC value when the caller already read it, e.g. from
+ * an async register read on the message path.  Only the remote wakeup
+ * resume case still reads registers synchronously, callers without process
+ * context must hand that one to a work item.
+ */
+void handle_port_status(struct xhci_hcd *xhci,
+		union xhci_trb *event, const u32 *port_status)
 {
 	struct usb_hcd *hcd;
 	u32 port_id;
@@ -1656,7 +1752,10 @@ void handle_port_status(struct xhci_hcd *xhci,
 	faked_port_index = find_faked_portnum_from_hw_portnum(hcd, xhci,
 			port_id);
 
-	temp = xhci_readl( xhci, port_array[faked_port_index]);
+	if (port_status)
+		temp = *port_status;
+	else
+		temp = xhci_readl( xhci, port_array[faked_port_index]);
 	if (temp == ~( u32 )0)
 		return;
 	if (hcd->state == HC_STATE_SUSPENDED) {
@@ -1719,8 +1818,8 @@ void handle_port_status(struct xhci_hcd *xhci,
 		if (bus_state->port_remote_wakeup & (1 << faked_port_index)) {
 			bus_state->port_remote_wakeup &=
 				~(1 << faked_port_index);
-			ehub_xhci_test_and_clear_bit(xhci, port_array,
-					faked_port_index, PORT_PLC);
+			ehub_xhci_clear_port_bit(xhci, port_array,
+					faked_port_index, temp, PORT_PLC);
 			usb_wakeup_notification(hcd->self.root_hub,
 					faked_port_index + 1);
 			bogus_port_status = true;
@@ -1742,8 +1841,8 @@ void handle_port_status(struct xhci_hcd *xhci,
 	}
 
 	if (hcd->speed != HCD_USB3)
-		ehub_xhci_test_and_clear_bit(xhci, port_array, faked_port_index,
-					PORT_PLC);
+		ehub_xhci_clear_port_bit(xhci, port_array, faked_port_index,
+					temp, PORT_PLC);
 
 cleanup:
 	if (xhci->event_ring == NULL)
@@ -1777,7 +1876,12 @@ cleanup:
 			char buffer[6]; /* Any root hubs with > 31 ports? */
 //			unsigned long flags;
 
-			length = hcd->driver->hub_status_data(hcd, buffer);
+			/* Reading every port would block the message path. */
+			if (port_status)
+				length = ehub_xhci_hub_status_port_data(hcd,
+						faked_port_index, temp, buffer);
+			else
+				length = hcd->driver->hub_status_data(hcd, buffer);
 
 			if (length > 0) {
 				hcd->status_urb = NULL;
@@ -2695,7 +2799,15 @@ cleanup:
 			 */
 			if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS)
 				status = 0;
-			usb_hcd_giveback_urb(bus_to_hcd(urb->dev->bus), urb, status);
+			if (xhci->event_batch) {
+				/* The URB is off its endpoint, so urb_list is
+				 * ours until the giveback. */
+				urb->status = status;
+				list_add_tail(&urb->urb_list,
+					      &xhci->event_batch->giveback);
+			} else {
+				usb_hcd_giveback_urb(bus_to_hcd(urb->dev->bus), urb, status);
+			}
 //			xhci_spin_lock_irq(xhci);
 		}
 
@@ -2710,6 +2822,40 @@ cleanup:
 	return 0;
 }
 
+/*
+ * Start a run of transfer events.  Nothing but ehub_xhci_handle_event on
+ * transfer events may be called until ehub_xhci_event_batch_end, in
+ * particular no URB is given back while xhci->lock is held, since its
+ * completion may resubmit.
+ */
+void ehub_xhci_event_batch_begin(struct xhci_hcd *xhci,
+		struct xhci_event_batch *batch)
+{
+	INIT_LIST_HEAD(&batch->giveback);
+	batch->events = 0;
+
+	ehub_xhci_spin_lock_irqsave(xhci, batch->flags);
+	xhci->event_batch = batch;
+}
+
+void ehub_xhci_event_batch_end(struct xhci_hcd *xhci,
+		struct xhci_event_batch *batch)
+{
+	struct urb *urb, *next;
+
+	xhci->event_batch = NULL;
+	xhci->event_batches++;
+	xhci->event_batch_events += batch->events;
+	if (batch->events > xhci->event_batch_largest)
+		xhci->event_batch_largest = batch->events;
+	ehub_xhci_spin_unlock_irqrestore(xhci, batch->flags);
+
+	list_for_each_entry_safe(urb, next, &batch->giveback, urb_list) {
+		list_del_init(&urb->urb_list);
+		usb_hcd_giveback_urb(bus_to_hcd(urb->dev->bus), urb, urb->status);
+	}
+}
+
 /*
  * Take a value instead of a pointer here so nothing has to worry about keeping
  * the data around until we have processed it completely.
@@ -2723,6 +2869,8 @@ void ehub_xhci_handle_event(const void *xhci_void, struct xhci_generic_trb event
 
 	event_trb = (void *)&event;
 
+	ehub_xhci_handshake_kick(xhci);
+
 	switch ((le32_to_cpu(event_trb->event_cmd.flags) & TRB_TYPE_BITMASK)) {
 	case TRB_TYPE(TRB_COMPLETION):
 		handle_cmd_completion(xhci, &event_trb->event_cmd);
@@ -2732,7 +2880,17 @@ void ehub_xhci_handle_event(const void *xhci_void, struct xhci_generic_trb event
 		update_ptrs = 0;
 		break;
 	case TRB_TYPE(TRB_TRANSFER):
-		ret = ehub_handle_tx_event(xhci, &event_trb->trans_event);
+		if (xhci->event_batch) {
+			xhci->event_batch->events++;
+			ret = ehub_handle_tx_event(xhci, &event_trb->trans_event);
+		} else {
+			struct xhci_event_batch batch;
+
+			ehub_xhci_event_batch_begin(xhci, &batch);
+			batch.events++;
+			ret = ehub_handle_tx_event(xhci, &event_trb->trans_event);
+			ehub_xhci_event_batch_end(xhci, &batch);
+		}
 		if (ret < 0)
 			xhci->error_bitmask |= 1 << 9;
 		else
@@ -2793,7 +2951,7 @@ static int xhci_handle_event(struct xhci_hcd *xhci)
 		handle_cmd_completion(xhci, &event->event_cmd);
 		break;
 	case TRB_TYPE(TRB_PORT_STATUS):
-		handle_port_status(xhci, event);
+		handle_port_status(xhci, event, NULL);
 		update_ptrs = 0;
 		break;
 	case TRB_TYPE(TRB_TRANSFER):
@@ -2876,7 +3034,7 @@ hw_died:
 	if (hcd->irq) {
 		u32 irq_pending;
 		/* Acknowledge the PCI interrupt */
-		irq_pending = xhci_readl( xhci, &xhci->ir_set->irq_pending);
+		irq_pending = ehub_xhci_readl_sw( xhci, &xhci->ir_set->irq_pending);
 		irq_pending |= IMAN_IP;
 		xhci_writel( xhci, irq_pending, &xhci->ir_set->irq_pending);
 	}
@@ -2887,7 +3045,7 @@ hw_died:
 		/* Clear the event handler busy flag (RW1C);
 		 * the event ring should be empty.
 		 */
-		temp_64 = xhci_read_64(xhci, &xhci->ir_set->erst_dequeue);
+		temp_64 = xhci_read_64_sw(xhci, &xhci->ir_set->erst_dequeue);
 		xhci_write_64(xhci, temp_64 | ERST_EHB,
 				&xhci->ir_set->erst_dequeue);
 		xhci_reg_unlock_irq( xhci );
@@ -2901,7 +3059,7 @@ hw_died:
 	 */
 	while (xhci_handle_event(xhci) > 0) {}
 
-	temp_64 = xhci_read_64(xhci, &xhci->ir_set->erst_dequeue);
+	temp_64 = xhci_read_64_sw(xhci, &xhci->ir_set->erst_dequeue);
 	/* If necessary, update the HW's version of the event ring deq ptr. */
 	if (event_ring_deq != xhci->event_ring->dequeue) {
 		deq = ehub_xhci_trb_virt_to_dma(xhci->event_ring->deq_seg,
@@ -3489,7 +3647,7 @@ int ehub_xhci_queue_bulk_tx(struct xhci_hcd *xhci, gfp_t mem_flags,
 	if (!ep_ring)
 		return -EINVAL;
 
-	buffer_addr = (dma_addr_t)urb->transfer_buffer;
+	buffer_addr = ehub_xhci_urb_buffer_dma(urb);
 
 	num_trbs = 0;
 	/* How much data is (potentially) left before the 64KB boundary? */
@@ -3515,6 +3673,12 @@ int ehub_xhci_queue_bulk_tx(struct xhci_hcd *xhci, gfp_t mem_flags,
 	if (ret < 0)
 		return ret;
 
+#ifdef USE_OUT_HOST_PUSH
+	/* Scatter-gather OUT payloads are still read by the device. */
+	if (usb_urb_dir_out(urb) && urb->transfer_buffer_length)
+		ehub_xhci_cache_block_push_urb(xhci, urb);
+#endif /* USE_OUT_HOST_PUSH */
+
 	urb_priv = urb->hcpriv;
 	td = urb_priv->td[0];
 
@@ -3700,8 +3864,8 @@ int ehub_xhci_queue_ctrl_tx(struct xhci_hcd *xhci, gfp_t mem_flags,
 		if (setup->bRequestType & USB_DIR_IN)
 			field |= TRB_DIR_IN;
 		queue_trb(xhci, ep_ring, true,
-				lower_32_bits((dma_addr_t)urb->transfer_buffer),
-				upper_32_bits((dma_addr_t)urb->transfer_buffer),
+				lower_32_bits(ehub_xhci_urb_buffer_dma(urb)),
+				upper_32_bits(ehub_xhci_urb_buffer_dma(urb)),
 				length_field,
 				field | ep_ring->cycle_state);
 	}
@@ -3734,7 +3898,7 @@ static int count_isoc_trbs_needed(struct xhci_hcd *xhci,
 	int num_trbs = 0;
 	u64 addr, td_len;
 
-	addr = (u64) (urb->transfer_dma + urb->iso_frame_desc[i].offset);
+	addr = (u64) (ehub_xhci_urb_buffer_dma(urb) + urb->iso_frame_desc[i].offset);
 	td_len = urb->iso_frame_desc[i].length;
 
 	num_trbs = DIV_ROUND_UP(td_len + (addr & (max_buffer_size - 1)),
@@ -3824,7 +3988,7 @@ static int xhci_queue_isoc_tx(struct xhci_hcd *xhci, gfp_t mem_flags,
 	struct xhci_segment* currentSegment;
 	unsigned int max_buffer_size;
 
-	buffer_addr = ( dma_addr_t )urb->transfer_buffer;
+	buffer_addr = ehub_xhci_urb_buffer_dma(urb);
 
 	ep_ring = xhci->devs[slot_id]->eps[ep_index].ring;
 
@@ -4045,7 +4209,7 @@ int ehub_xhci_queue_isoc_tx_prepare(struct xhci_hcd *xhci, gfp_t mem_flags,
 	/* If data needs to be cached on chip, allocate cache blocks and transfer data
 	 */
 	if (xdev->eps[ep_index].cache_data) {
-		ret = ehub_xhci_cache_block_allocate_urb(xhci, urb);
+		ret = ehub_xhci_cache_block_allocate_urb(xhci, urb, true);
 		if (ret)
 			return ret;
 	}
@@ -29,6 +29,7 @@
 #include <linux/slab.h>
 #include <linux/dmi.h>
 #include <linux/dma-mapping.h>
+#include <linux/version.h>
 
 #include "xhci.h"
 #include "ehub-xhci-trace.h"
@@ -46,9 +47,17 @@ static unsigned int quirks;
 module_param(quirks, uint, S_IRUGO);
 MODULE_PARM_DESC(quirks, "Bit flags for quirks to be enabled as default");
 
-/* TODO: copied from ehci-hcd.c - can this be refactored? */
+/* 3.10 kernels lack wait_event_hrtimeout(); wait in jiffies there instead. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+#define ehub_wait_event_timeout_us(wq, condition, us) \
+	wait_event_timeout(wq, condition, usecs_to_jiffies(us))
+#else
+#define ehub_wait_event_timeout_us(wq, condition, us) \
+	wait_event_hrtimeout(wq, condition, ns_to_ktime((us) * NSEC_PER_USEC))
+#endif
+
 /*
- * ehub_xhci_handshake - spin reading hc until handshake completes or fails
+ * ehub_xhci_handshake - poll hc until handshake completes or fails
  * @ptr: address of hc register to be read
  * @mask: bits to look at in result of read
  * @done: value of those bits when handshake succeeds
@@ -59,22 +68,51 @@ MODULE_PARM_DESC(quirks, "Bit flags for quirks to be enabled as default");
  * Success happens when the "mask" bits have the specified value (hardware
  * handshake done).  There are two failure modes:  "usec" have passed (major
  * hardware flakeout), or the register reads as all-ones (hardware removed).
+ *
+ * Every read is a USB round trip, so the timeout is a ktime deadline rather
+ * than an iteration count.  The delay between reads starts at about one
+ * round trip and doubles up to usec / EHUB_HANDSHAKE_POLLS, which keeps the
+ * number of reads bounded however long the timeout.  An event pushed by the
+ * device cuts the current delay short, since the controller usually
+ * reports the state change that ends the wait that way.
  */
 int ehub_xhci_handshake( struct xhci_hcd *xhci, void __iomem *ptr, u32 mask, u32 done, int usec)
 {
+	ktime_t deadline;
+	s64 delay_max;
+	s64 delay;
+	s64 remaining;
+	int events;
+	bool expired;
 	u32 result;
 
-	do {
+	deadline = ktime_add_us(ktime_get(), usec);
+	delay_max = clamp_t(s64, usec / EHUB_HANDSHAKE_POLLS,
+			EHUB_HANDSHAKE_MIN_DELAY_US, EHUB_HANDSHAKE_MAX_DELAY_US);
+	delay = EHUB_HANDSHAKE_MIN_DELAY_US;
+
+	for (;;) {
+		/* Sample the clock first so the last read is taken past the deadline. */
+		expired = ktime_us_delta(ktime_get(), deadline) > 0;
+		events = atomic_read(&xhci->handshake_events);
+
 		result = xhci_readl( xhci, ptr);
 		if (result == ~(u32)0)      /* card removed */
 			return -ENODEV;
 		result &= mask;
 		if (result == done)
 			return 0;
-		udelay(1);
-		usec--;
-	} while (usec > 0);
-	return -ETIMEDOUT;
+		if (expired)
+			return -ETIMEDOUT;
+
+		remaining = ktime_us_delta(deadline, ktime_get());
+		if (remaining > 0)
+			ehub_wait_event_timeout_us(xhci->handshake_wait,
+					atomic_read(&xhci->handshake_events) != events,
+					min(delay, remaining));
+
+		delay = min(delay * 2, delay_max);
+	}
 }
 
 /*
@@ -429,7 +467,7 @@ int ehub_xhci_run(struct usb_hcd *hcd)
 
 	ehub_xhci_dbg_trace(xhci, trace_ehub_xhci_dbg_init,
 			"// Set the interrupt modulation register");
-	temp = xhci_readl( xhci, &xhci->ir_set->irq_control);
+	temp = ehub_xhci_readl_sw( xhci, &xhci->ir_set->irq_control);
 	temp &= ~ER_IRQ_INTERVAL_MASK;
 	temp |= (u32) 160;
 	xhci_writel( xhci, temp, &xhci->ir_set->irq_control);
@@ -441,7 +479,7 @@ int ehub_xhci_run(struct usb_hcd *hcd)
 			"// Enable interrupts, cmd = 0x%x.", temp);
 	xhci_writel( xhci, temp, &xhci->op_regs->command);
 
-	temp = xhci_readl( xhci, &xhci->ir_set->irq_pending);
+	temp = ehub_xhci_readl_sw( xhci, &xhci->ir_set->irq_pending);
 	ehub_xhci_dbg_trace(xhci, trace_ehub_xhci_dbg_init,
 			"// Enabling event ring interrupter %p by writing 0x%x to irq_pending",
 			xhci->ir_set, (unsigned int) ER_IRQ_ENABLE(temp));
@@ -531,7 +569,7 @@ void ehub_xhci_stop(struct usb_hcd *hcd)
 			"// Disabling event ring interrupts");
 	temp = xhci_readl( xhci, &xhci->op_regs->status);
 	xhci_writel( xhci, temp & ~STS_EINT, &xhci->op_regs->status);
-	temp = xhci_readl( xhci, &xhci->ir_set->irq_pending);
+	temp = ehub_xhci_readl_sw( xhci, &xhci->ir_set->irq_pending);
 	xhci_writel( xhci, ER_IRQ_DISABLE(temp), &xhci->ir_set->irq_pending);
 	ehub_xhci_print_ir_set(xhci, 0);
 
@@ -569,28 +607,50 @@ void ehub_xhci_shutdown(struct usb_hcd *hcd)
 #ifdef CONFIG_PM
 static void xhci_save_registers(struct xhci_hcd *xhci)
 {
-	xhci->s3.command = xhci_readl( xhci, &xhci->op_regs->command);
-	xhci->s3.dev_nt = xhci_readl( xhci, &xhci->op_regs->dev_notification);
-	xhci->s3.dcbaa_ptr = xhci_read_64(xhci, &xhci->op_regs->dcbaa_ptr);
-	xhci->s3.config_reg = xhci_readl( xhci, &xhci->op_regs->config_reg);
-	xhci->s3.erst_size = xhci_readl( xhci, &xhci->ir_set->erst_size);
-	xhci->s3.erst_base = xhci_read_64(xhci, &xhci->ir_set->erst_base);
-	xhci->s3.erst_dequeue = xhci_read_64(xhci, &xhci->ir_set->erst_dequeue);
-	xhci->s3.irq_pending = xhci_readl( xhci, &xhci->ir_set->irq_pending);
-	xhci->s3.irq_control = xhci_readl( xhci, &xhci->ir_set->irq_control);
+	__le32 __iomem *regs[] = {
+		&xhci->op_regs->command,
+		&xhci->op_regs->dev_notification,
+		(__le32 __iomem *) &xhci->op_regs->dcbaa_ptr,
+		(__le32 __iomem *) &xhci->op_regs->dcbaa_ptr + 1,
+		&xhci->op_regs->config_reg,
+		&xhci->ir_set->erst_size,
+		(__le32 __iomem *) &xhci->ir_set->erst_base,
+		(__le32 __iomem *) &xhci->ir_set->erst_base + 1,
+		(__le32 __iomem *) &xhci->ir_set->erst_dequeue,
+		(__le32 __iomem *) &xhci->ir_set->erst_dequeue + 1,
+		&xhci->ir_set->irq_pending,
+		&xhci->ir_set->irq_control,
+	};
+	u32 vals[ARRAY_SIZE(regs)];
+
+	ehub_xhci_readl_multiple(xhci, regs, vals, ARRAY_SIZE(regs));
+
+	xhci->s3.command = vals[0];
+	xhci->s3.dev_nt = vals[1];
+	xhci->s3.dcbaa_ptr = vals[2] + ((u64) vals[3] << 32);
+	xhci->s3.config_reg = vals[4];
+	xhci->s3.erst_size = vals[5];
+	xhci->s3.erst_base = vals[6] + ((u64) vals[7] << 32);
+	xhci->s3.erst_dequeue = vals[8] + ((u64) vals[9] << 32);
+	xhci->s3.irq_pending = vals[10];
+	xhci->s3.irq_control = vals[11];
 }
 
 static void xhci_restore_registers(struct xhci_hcd *xhci)
 {
-	xhci_writel( xhci, xhci->s3.command, &xhci->op_regs->command);
-	xhci_writel( xhci, xhci->s3.dev_nt, &xhci->op_regs->dev_notification);
-	xhci_write_64(xhci, xhci->s3.dcbaa_ptr, &xhci->op_regs->dcbaa_ptr);
-	xhci_writel( xhci, xhci->s3.config_reg, &xhci->op_regs->config_reg);
-	xhci_writel( xhci, xhci->s3.erst_size, &xhci->ir_set->erst_size);
-	xhci_write_64(xhci, xhci->s3.erst_base, &xhci->ir_set->erst_base);
-	xhci_write_64(xhci, xhci->s3.erst_dequeue, &xhci->ir_set->erst_dequeue);
-	xhci_writel( xhci, xhci->s3.irq_pending, &xhci->ir_set->irq_pending);
-	xhci_writel( xhci, xhci->s3.irq_control, &xhci->ir_set->irq_control);
+	struct ehub_xhci_write_batch batch;
+
+	ehub_xhci_write_batch_init(&batch);
+	ehub_xhci_writel_batch(xhci, &batch, xhci->s3.command, &xhci->op_regs->command);
+	ehub_xhci_writel_batch(xhci, &batch, xhci->s3.dev_nt, &xhci->op_regs->dev_notification);
+	xhci_write_64_batch(xhci, &batch, xhci->s3.dcbaa_ptr, &xhci->op_regs->dcbaa_ptr);
+	ehub_xhci_writel_batch(xhci, &batch, xhci->s3.config_reg, &xhci->op_regs->config_reg);
+	ehub_xhci_writel_batch(xhci, &batch, xhci->s3.erst_size, &xhci->ir_set->erst_size);
+	xhci_write_64_batch(xhci, &batch, xhci->s3.erst_base, &xhci->ir_set->erst_base);
+	xhci_write_64_batch(xhci, &batch, xhci->s3.erst_dequeue, &xhci->ir_set->erst_dequeue);
+	ehub_xhci_writel_batch(xhci, &batch, xhci->s3.irq_pending, &xhci->ir_set->irq_pending);
+	ehub_xhci_writel_batch(xhci, &batch, xhci->s3.irq_control, &xhci->ir_set->irq_control);
+	ehub_xhci_write_batch_flush(xhci, &batch);
 }
 
 static void xhci_set_cmd_ring_deq(struct xhci_hcd *xhci)
@@ -631,6 +691,8 @@ static void xhci_clear_command_ring(struct xhci_hcd *xhci)
 			sizeof(union xhci_trb) * (TRBS_PER_SEGMENT - 1));
 		seg->trbs[TRBS_PER_SEGMENT - 1].link.control &=
 			cpu_to_le32(~TRB_CYCLE);
+		/* The cache block still holds the old TRBs. */
+		seg->cache_uploaded = 0;
 		seg = seg->next;
 	} while (seg != ring->deq_seg);
 
@@ -665,7 +727,9 @@ static void xhci_disable_port_wake_on_bits(struct xhci_hcd *xhci)
 	__le32 __iomem **port_array;
 	unsigned long flags;
 	u32 t1, t2;
+	struct ehub_xhci_write_batch batch;
 
+	ehub_xhci_write_batch_init(&batch);
 	ehub_xhci_reg_lock_irqsave( xhci, flags );
 
 	/* disble usb3 ports Wake bits*/
@@ -676,7 +740,7 @@ static void xhci_disable_port_wake_on_bits(struct xhci_hcd *xhci)
 		t1 = ehub_xhci_port_state_to_neutral(t1);
 		t2 = t1 & ~PORT_WAKE_BITS;
 		if (t1 != t2)
-			xhci_writel( xhci, t2, port_array[port_index]);
+			ehub_xhci_writel_batch(xhci, &batch, t2, port_array[port_index]);
 	}
 
 	/* disble usb2 ports Wake bits*/
@@ -687,9 +751,10 @@ static void xhci_disable_port_wake_on_bits(struct xhci_hcd *xhci)
 		t1 = ehub_xhci_port_state_to_neutral(t1);
 		t2 = t1 & ~PORT_WAKE_BITS;
 		if (t1 != t2)
-			xhci_writel( xhci, t2, port_array[port_index]);
+			ehub_xhci_writel_batch(xhci, &batch, t2, port_array[port_index]);
 	}
 
+	ehub_xhci_write_batch_flush(xhci, &batch);
 	ehub_xhci_reg_unlock_irqrestore( xhci, flags );
 }
 
@@ -1179,6 +1244,21 @@ int ehub_xhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flags)
 #endif // EHUB_ISOCH_DATA_CACHE_ENABLE
 	urb->hcpriv = urb_priv;
 
+	if ( (urb->transfer_flags & URB_NO_TRANSFER_DMA_MAP)
+		 && urb->transfer_buffer_length != 0
+		 && !urb->num_sgs && urb->transfer_buffer )
+	{
+		urb_priv->transfer_iova = IOVA_MapVirtual(xhci->DeviceContext,
+												  urb->transfer_buffer,
+												  urb->transfer_buffer_length);
+		if (!urb_priv->transfer_iova) {
+			ehub_xhci_urb_free_priv(xhci, urb_priv);
+			urb->hcpriv = NULL;
+			return -EAGAIN;
+		}
+		urb_priv->transfer_iova_length = urb->transfer_buffer_length;
+	}
+
 	if (usb_endpoint_xfer_control(&urb->ep->desc)) {
 		/* Check to see if the max packet size for the default control
 		 * endpoint changed during FS device enumeration
@@ -1590,6 +1670,13 @@ int ehub_xhci_add_endpoint(struct usb_hcd *hcd, struct usb_device *udev,
 		return 0;
 	}
 
+#ifdef USE_TRB_CACHE_MODE
+	/* Refuse the endpoint now if the device cache can't take its ring. */
+	ret = ehub_xhci_cache_admit_endpoint(xhci, virt_dev, ep);
+	if (ret)
+		return ret;
+#endif /* USE_TRB_CACHE_MODE */
+
 	/*
 	 * Configuration and alternate setting changes must be done in
 	 * process context, not interrupt context (or so documenation
@@ -2649,6 +2736,9 @@ int ehub_xhci_check_bandwidth(struct usb_hcd *hcd, struct usb_device *udev)
 		virt_dev->eps[i].new_ring = NULL;
 	}
 command_cleanup:
+#ifdef USE_TRB_CACHE_MODE
+	ehub_xhci_cache_admit_release(xhci, virt_dev);
+#endif /* USE_TRB_CACHE_MODE */
 	kfree(command->completion);
 	kfree(command);
 
@@ -2675,6 +2765,9 @@ void ehub_xhci_reset_bandwidth(struct usb_hcd *hcd, struct usb_device *udev)
 			virt_dev->eps[i].new_ring = NULL;
 		}
 	}
+#ifdef USE_TRB_CACHE_MODE
+	ehub_xhci_cache_admit_release(xhci, virt_dev);
+#endif /* USE_TRB_CACHE_MODE */
 	xhci_zero_in_ctx(xhci, virt_dev);
 }
 
@@ -26,12 +26,15 @@
 
 #include <linux/usb.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <linux/kernel.h>
+#include <linux/bitmap.h>
 #include <linux/usb/hcd.h>
 #include "ehub_defines.h"
 #include "ehub_utility.h"
 #include "ehub_device_context.h"
 #include "ehub_embedded_cache.h"
+#include "ehub_iova.h"
 
 #ifdef EHUB_DEBUG_ENABLE
 #include <linux/kgdb.h>
@@ -904,6 +907,9 @@ struct xhci_virt_ep {
 	/* Used to split TDs based on cache block size*/
 	unsigned int        max_buffer_size;
 	bool                cache_data;
+	/* Cache blocks this endpoint's data may hold, and holds now */
+	unsigned int        cache_quota;
+	unsigned int        cache_data_used;
 };
 
 enum xhci_overhead_type {
@@ -955,6 +961,8 @@ struct xhci_virt_device {
 	struct xhci_tt_bw_info      *tt_info;
 	/* The current max exit latency for the enabled USB3 link states. */
 	u16             current_mel;
+	/* Cache blocks admitted for endpoints added since the last configure */
+	int             cache_blocks_admitted;
 };
 
 /*
@@ -1376,7 +1384,11 @@ struct xhci_segment {
 	dma_addr_t      dma;
 	/* save the original dma address returned from dma_pool_alloc to use when freeing */
 	dma_addr_t      orig_dma;
+	/* device address of trbs in host memory, dma may point at the cache */
+	dma_addr_t      iova_dma;
 	PEHUB_CACHE_BLOCK EhubCacheBlock;
+	/* TRBs from the start of the segment already in its cache block */
+	unsigned int    cache_uploaded;
 };
 
 struct xhci_td {
@@ -1471,7 +1483,15 @@ struct xhci_scratchpad {
 struct urb_priv {
 	int length;
 	int cache_block_cnt;
-	PEHUB_CACHE_BLOCK EhubDataCacheBlock[6];
+	/* First block of the contiguous run holding the URB data. */
+	PEHUB_CACHE_BLOCK EhubDataCacheBlock;
+	/* Bytes from the start of the URB data held in that run. */
+	u32 cache_length;
+	/* Endpoint whose cache quota the run counts against. */
+	struct xhci_virt_ep *cache_ep;
+	/* Device address of a driver-mapped (URB_NO_TRANSFER_DMA_MAP) buffer. */
+	dma_addr_t transfer_iova;
+	u32 transfer_iova_length;
 	int td_cnt;
 	struct  xhci_td *td[0];
 };
@@ -1544,19 +1564,38 @@ static inline unsigned int hcd_index(struct usb_hcd *hcd)
 
 struct cache_write_context {
 	struct list_head list;
+	/* Writes packed into this one's transfer, see USE_DELAYED_CACHE_MODE */
+	struct list_head batch;
 	struct work_struct work;
 	PDEVICE_CONTEXT DeviceContext;
 	URB_CONTEXT *UrbContext;
 	u32 CacheAddress;
 	u32* DataBuffer;
 	u32 DataBufferLength;
+	/* Record already built in UrbContext->DataBuffer, see USE_DELAYED_CACHE_MODE */
+	u32 RecordLength;
 	int TrbCycleState;
 	bool ring_doorbell;
 	unsigned int slot_id;
 	unsigned int ep_index;
 	unsigned int stream_id;
+	/* Doorbell sent in the same transfer, see USE_CACHE_WRITE_DOORBELL */
+	u32 doorbell_reg;
+	u32 doorbell_val;
 };
 
+/* Record bytes one delayed cache write transfer carries, doorbell aside. */
+#define EHUB_CACHE_BATCH_LENGTH \
+	(sizeof(EMBEDDED_CACHE_TRANSFER) + MESSAGE_DATA_BUFFER_SIZE_CACHE)
+
+/* Number of registers kept in xhci_hcd.reg_shadow */
+#define EHUB_XHCI_REG_SHADOW_COUNT  12
+
+/* PORTSC, PORTPMSC and PORTLI of every port go into the port snapshot */
+#define EHUB_PORT_SNAPSHOT_REGS     3
+/* How long a port snapshot may answer hub polling and GetPortStatus */
+#define EHUB_PORT_SNAPSHOT_VALID_MS 5
+
 /* There is one xhci_hcd structure per controller */
 struct xhci_hcd {
 	struct usb_hcd *main_hcd;
@@ -1585,6 +1624,22 @@ struct xhci_hcd {
 	struct semaphore reg_lock;
 	bool reg_lock_acquired;
 
+	/* Write-through shadow of software owned registers, see xhci-ehub.c */
+	spinlock_t  reg_shadow_lock;
+	unsigned long reg_shadow_valid;
+	u32         reg_shadow[EHUB_XHCI_REG_SHADOW_COUNT];
+
+	/* Device pushed events wake ehub_xhci_handshake early */
+	wait_queue_head_t handshake_wait;
+	atomic_t    handshake_events;
+
+	/* Port registers read in one batch, see ehub_xhci_read_port_snapshot */
+	u32         port_snapshot[MAX_HC_PORTS][EHUB_PORT_SNAPSHOT_REGS];
+	bool        port_snapshot_valid;
+	unsigned long port_snapshot_expires;
+	int         port_snapshot_gen_filled;
+	atomic_t    port_snapshot_gen;
+
 	/* packed release number */
 	u8      sbrn;
 	u16     hci_version;
@@ -1643,16 +1698,47 @@ struct xhci_hcd {
 
 	// Cache pool.
 	//
-	struct list_head cache_list_free;
-	struct list_head cache_list_used;
+	PEHUB_CACHE_BLOCK cache_blocks;
+	/* One bit per cache block, set while the block is in use. */
+	DECLARE_BITMAP(cache_map, EHUB_CACHE_NUMBER_OF_BLOCKS);
 	spinlock_t cache_list_lock;
 	int number_of_caches_free;
 	int number_of_caches_used;
+	/* OUT payloads pushed into the cache, and those left to device reads. */
+	u32 cache_push_count;
+	u32 cache_push_fallback;
+	/* Cached URBs only partly placed in the cache; the rest is read by
+	 * the device from host memory. */
+	u32 cache_spill_count;
+	u64 cache_spill_bytes;
+	u32 cache_spill_trbs;
+	/* Sum of the isoch OUT data quotas granted, see ehub_xhci_cache_quota_reserve */
+	unsigned int cache_quota_granted;
+	u32 cache_quota_denied;
+	u32 cache_admit_rejected;
+	/* Ring blocks admitted to endpoints whose configure command is pending */
+	int cache_blocks_admitted;
+
+	/* Transfer event batch in progress, under xhci->lock. */
+	struct xhci_event_batch *event_batch;
+	u32 event_batches;
+	u32 event_batch_events;
+	u32 event_batch_largest;
 
 	struct workqueue_struct *ehub_cache_wq;
 	struct cache_write_context ehub_cache_work;
 	struct list_head cache_queue_free;
 	struct list_head cache_queue_used;
+	/* Cache writes not yet sent, and the record bytes they need. */
+	struct list_head cache_queue_pending;
+	u32 cache_pending_length;
+	struct hrtimer cache_flush_timer;
+	u32 cache_batches;
+	u32 cache_batch_records;
+	u32 cache_batch_largest;
+	u32 cache_flush_full_count;
+	u32 cache_flush_doorbell_count;
+	u32 cache_flush_timer_count;
 
 	/* Host controller watchdog timer structures */
 	unsigned int        xhc_state;
@@ -1738,6 +1824,18 @@ struct xhci_hcd {
 #define COMP_MODE_RCVRY_MSECS 2000
 };
 
+/* Device address of an URB's linear transfer buffer. */
+static inline dma_addr_t ehub_xhci_urb_buffer_dma(struct urb *urb)
+{
+	struct urb_priv *urb_priv = urb->hcpriv;
+
+	if (urb_priv && urb_priv->transfer_iova)
+		return urb_priv->transfer_iova;
+	if (urb->transfer_flags & URB_DMA_MAP_SINGLE)
+		return urb->transfer_dma;
+	return (dma_addr_t)urb->transfer_buffer;
+}
+
 /* convert between an HCD pointer and the corresponding EHCI_HCD */
 static inline struct xhci_hcd *hcd_to_xhci(struct usb_hcd *hcd)
 {
@@ -1811,6 +1909,20 @@ ehub_xhci_readl(
 	__le32 *regs
 	);
 
+unsigned int
+ehub_xhci_readl_sw(
+	const struct xhci_hcd *xhci,
+	__le32 *regs
+	);
+
+int
+ehub_xhci_readl_multiple(
+	const struct xhci_hcd *xhci,
+	__le32 **regs,
+	u32 *vals,
+	int count
+	);
+
 void
 ehub_xhci_writel(
 	struct xhci_hcd *xhci,
@@ -1818,6 +1930,35 @@ ehub_xhci_writel(
 	__le32 *regs
 	);
 
+/*
+ * Register writes collected by ehub_xhci_writel_batch and sent to the
+ * device in one transfer by ehub_xhci_write_batch_flush.
+ */
+struct ehub_xhci_write_batch {
+	int count;
+	u32 address[ NUMBER_OF_EMBEDDED_REGISTER_WRITE_BATCH ];
+	u32 data[ NUMBER_OF_EMBEDDED_REGISTER_WRITE_BATCH ];
+};
+
+static inline void ehub_xhci_write_batch_init(struct ehub_xhci_write_batch *batch)
+{
+	batch->count = 0;
+}
+
+void
+ehub_xhci_writel_batch(
+	struct xhci_hcd *xhci,
+	struct ehub_xhci_write_batch *batch,
+	const unsigned int val,
+	__le32 *regs
+	);
+
+void
+ehub_xhci_write_batch_flush(
+	struct xhci_hcd *xhci,
+	struct ehub_xhci_write_batch *batch
+	);
+
 void
 ehub_xhci_writel_doorbell(
 	struct xhci_hcd *xhci,
@@ -1846,6 +1987,30 @@ ehub_xhci_handle_event(
 	struct xhci_generic_trb event
 	);
 
+/*
+ * A run of transfer events handled under one xhci->lock hold.  URBs they
+ * complete are unlinked and queued on giveback, with their status in
+ * urb->status, and given back by ehub_xhci_event_batch_end once the lock
+ * is dropped.
+ */
+struct xhci_event_batch {
+	unsigned long flags;
+	struct list_head giveback;
+	u32 events;
+};
+
+void
+ehub_xhci_event_batch_begin(
+	struct xhci_hcd *xhci,
+	struct xhci_event_batch *batch
+	);
+
+void
+ehub_xhci_event_batch_end(
+	struct xhci_hcd *xhci,
+	struct xhci_event_batch *batch
+	);
+
 /* TODO: copied from ehci.h - can be refactored? */
 /* xHCI spec says all registers are little endian */
 static inline unsigned int xhci_readl(const struct xhci_hcd *xhci,
@@ -1881,15 +2046,32 @@ static inline u64 xhci_read_64(const struct xhci_hcd *xhci,
 	u64 val_hi = xhci_readl( xhci, ptr + 1);
 	return val_lo + (val_hi << 32);
 }
-static inline void xhci_write_64(struct xhci_hcd *xhci,
+static inline u64 xhci_read_64_sw(const struct xhci_hcd *xhci,
+		__le64 __iomem *regs)
+{
+	__u32 __iomem *ptr = (__u32 __iomem *) regs;
+	u64 val_lo = ehub_xhci_readl_sw( xhci, ptr);
+	u64 val_hi = ehub_xhci_readl_sw( xhci, ptr + 1);
+	return val_lo + (val_hi << 32);
+}
+static inline void xhci_write_64_batch(struct xhci_hcd *xhci,
+				 struct ehub_xhci_write_batch *batch,
 				 const u64 val, __le64 __iomem *regs)
 {
 	__u32 __iomem *ptr = (__u32 __iomem *) regs;
-	u32 val_lo = lower_32_bits(val);
-	u32 val_hi = upper_32_bits(val);
 
-	xhci_writel( xhci, val_lo, ptr);
-	xhci_writel( xhci, val_hi, ptr + 1);
+	ehub_xhci_writel_batch(xhci, batch, lower_32_bits(val), ptr);
+	ehub_xhci_writel_batch(xhci, batch, upper_32_bits(val), ptr + 1);
+}
+static inline void xhci_write_64(struct xhci_hcd *xhci,
+				 const u64 val, __le64 __iomem *regs)
+{
+	struct ehub_xhci_write_batch batch;
+
+	/* Both halves go out in one transfer, low dword first. */
+	ehub_xhci_write_batch_init(&batch);
+	xhci_write_64_batch(xhci, &batch, val, regs);
+	ehub_xhci_write_batch_flush(xhci, &batch);
 }
 
 static inline int xhci_link_trb_quirk(struct xhci_hcd *xhci)
@@ -1990,7 +2172,24 @@ void ehub_xhci_free_command(struct xhci_hcd *xhci,
 
 /* xHCI host controller glue */
 typedef void (*xhci_get_quirks_t)(struct device *, struct xhci_hcd *);
+/* ehub_xhci_handshake read pacing, a register read costs about one microframe */
+#define EHUB_HANDSHAKE_MIN_DELAY_US 125
+#define EHUB_HANDSHAKE_MAX_DELAY_US (20 * 1000)
+#define EHUB_HANDSHAKE_POLLS        16
+
 int ehub_xhci_handshake( struct xhci_hcd *xhci, void __iomem *ptr, u32 mask, u32 done, int usec);
+
+/*
+ * Wake handshakes waiting for the device to change state.  This runs for
+ * every event, so skip the wait queue lock when nobody waits; the barrier
+ * in wq_has_sleeper orders the count update before the check.
+ */
+static inline void ehub_xhci_handshake_kick(struct xhci_hcd *xhci)
+{
+	atomic_inc(&xhci->handshake_events);
+	if (wq_has_sleeper(&xhci->handshake_wait))
+		wake_up(&xhci->handshake_wait);
+}
 void ehub_xhci_quiesce(struct xhci_hcd *xhci);
 int ehub_xhci_halt(struct xhci_hcd *xhci);
 int ehub_xhci_reset(struct xhci_hcd *xhci);
@@ -2094,6 +2293,9 @@ void xhci_queue_config_ep_quirk(struct xhci_hcd *xhci,
 void ehub_xhci_stop_endpoint_command_watchdog(unsigned long arg);
 void ehub_xhci_handle_command_timeout(unsigned long data);
 
+bool ehub_xhci_doorbell_value(struct xhci_hcd *xhci, unsigned int slot_id,
+		unsigned int ep_index, unsigned int stream_id,
+		u32 *db_reg, u32 *db_val);
 void ehub_xhci_ring_ep_doorbell(struct xhci_hcd *xhci, unsigned int slot_id,
 		unsigned int ep_index, unsigned int stream_id);
 void ehub_xhci_cleanup_command_queue(struct xhci_hcd *xhci);
@@ -2107,9 +2309,20 @@ int ehub_xhci_disable_usb3_lpm_timeout(struct usb_hcd *hcd,
 			struct usb_device *udev, enum usb3_link_state state);
 void ehub_xhci_test_and_clear_bit(struct xhci_hcd *xhci, __le32 __iomem **port_array,
 				int port_id, u32 port_bit);
+void ehub_xhci_clear_port_bit(struct xhci_hcd *xhci, __le32 __iomem **port_array,
+				int port_id, u32 port_status, u32 port_bit);
 int ehub_xhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u16 wIndex,
 		char *buf, u16 wLength);
 int ehub_xhci_hub_status_data(struct usb_hcd *hcd, char *buf);
+int ehub_xhci_hub_status_port_data(struct usb_hcd *hcd, int port_index,
+		u32 port_status, char *buf);
+u32 ehub_xhci_read_port_snapshot(struct xhci_hcd *xhci, __le32 __iomem *reg);
+
+/* Anything that may have changed a port register drops the snapshot. */
+static inline void ehub_xhci_port_snapshot_invalidate(struct xhci_hcd *xhci)
+{
+	atomic_inc(&xhci->port_snapshot_gen);
+}
 int ehub_xhci_find_raw_port_number(struct usb_hcd *hcd, int port1);
 
 #ifdef CONFIG_PM
@@ -2132,7 +2345,10 @@ struct xhci_ep_ctx *ehub_xhci_get_ep_ctx(struct xhci_hcd *xhci, struct xhci_cont
 
 int ehub_xhci_map_urb_for_dma(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flags);
 void ehub_xhci_unmap_urb_for_dma(struct usb_hcd *hcd, struct urb *urb);
-void handle_port_status(struct xhci_hcd *xhci,union xhci_trb *event);
+void handle_port_status(struct xhci_hcd *xhci,union xhci_trb *event,
+		const u32 *port_status);
+__le32 __iomem *ehub_xhci_port_status_event_reg(struct xhci_hcd *xhci,
+		union xhci_trb *event);
 
 static inline int ehub_cache_ring(enum xhci_ring_type type)
 {
@@ -2228,11 +2444,45 @@ PEHUB_CACHE_BLOCK
 ehub_xhci_cache_block_allocate_segment(
 	struct xhci_hcd *xhci,
 	int cycle_state,
-	void *start_addr
+	void *start_addr,
+	enum xhci_ring_type type
+	);
+
+int
+ehub_xhci_cache_admit_endpoint(
+	struct xhci_hcd *xhci,
+	struct xhci_virt_device *virt_dev,
+	struct usb_host_endpoint *ep
+	);
+
+void
+ehub_xhci_cache_admit_release(
+	struct xhci_hcd *xhci,
+	struct xhci_virt_device *virt_dev
+	);
+
+void
+ehub_xhci_cache_quota_reserve(
+	struct xhci_hcd *xhci,
+	struct xhci_virt_ep *virt_ep,
+	u32 max_esit_payload
+	);
+
+void
+ehub_xhci_cache_quota_release(
+	struct xhci_hcd *xhci,
+	struct xhci_virt_ep *virt_ep
 	);
 
 int
 ehub_xhci_cache_block_allocate_urb(
+	struct xhci_hcd *xhci,
+	struct urb *urb,
+	bool spill
+);
+
+void
+ehub_xhci_cache_block_push_urb(
 	struct xhci_hcd *xhci,
 	struct urb *urb
 );
@@ -2278,6 +2528,13 @@ ehub_queue_cache_write(
 	unsigned int stream_id
 );
 
+#ifdef USE_DELAYED_CACHE_MODE
+int
+ehub_cache_flush(
+	struct xhci_hcd *xhci
+);
+#endif /* USE_DELAYED_CACHE_MODE */
+
 union xhci_trb*
 ehub_xhci_get_last_trb_from_segment(
 	struct xhci_segment *seg